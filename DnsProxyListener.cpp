@@ -59,6 +59,7 @@
 #include "resolv_cache.h"
 #include "resolv_private.h"
 #include "stats.pb.h"
+#include "util.h"
 
 using aidl::android::net::metrics::INetdEventListener;
 using android::net::NetworkDnsEventReported;
@@ -509,6 +510,21 @@ bool getDns64Prefix(unsigned netId, netdutils::IPPrefix* prefix) {
     return !gDnsResolv->resolverCtrl.getPrefix64(netId, prefix);
 }
 
+// Identifies the result synthesized with |prefix| for a getaddrinfo() request. The arguments are
+// the same as in the key of resolv_getaddrinfo() results, which the prefix keeps apart.
+std::string makeDns64CacheKey(const netdutils::IPPrefix& prefix, const char* host,
+                              const char* service, const addrinfo* hints,
+                              const android_net_context& netcontext) {
+    const addrinfo ai = hints ? *hints : addrinfo{};
+    std::string key = android::base::StringPrintf(
+            "dns64 %s %u %u %u %d %d %d %d ", prefix.toString().c_str(), netcontext.uid,
+            netcontext.app_mark, netcontext.flags, ai.ai_flags, ai.ai_family, ai.ai_socktype,
+            ai.ai_protocol);
+    key.append(service ? service : "^").push_back('\0');
+    key.append(host);
+    return key;
+}
+
 std::string makeThreadName(unsigned netId, uint32_t uid) {
     // The maximum of netId and app_id are 5-digit numbers.
     return android::base::StringPrintf("Dns_%u_%u", netId, multiuser_get_app_id(uid));
@@ -617,8 +633,20 @@ static bool sendaddrinfo(SocketClient* c, addrinfo* ai) {
     return true;
 }
 
+addrinfo* DnsProxyListener::GetAddrInfoHandler::lookupDns64Result() {
+    if (mHost == nullptr || getExperimentFlagInt("addrinfo_cache", 0) == 0) return nullptr;
+    // Only these are synthesized, see doDns64Synthesis().
+    if (mHints && mHints->ai_family != AF_INET6 && mHints->ai_family != AF_UNSPEC) return nullptr;
+
+    netdutils::IPPrefix prefix{};
+    if (!getDns64Prefix(mNetContext.dns_netid, &prefix)) return nullptr;
+    mDns64CacheKey = makeDns64CacheKey(prefix, mHost, mService, mHints, mNetContext);
+    return resolv_cache_lookup_addrinfo(mNetContext.dns_netid, mDns64CacheKey);
+}
+
 void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinfo** res,
-                                                            NetworkDnsEventReported* event) {
+                                                            NetworkDnsEventReported* event,
+                                                            uint32_t ttl) {
     if (mHost == nullptr) return;
 
     const bool ipv6WantedButNoData = (mHints && mHints->ai_family == AF_INET6 && *rv == EAI_NODATA);
@@ -641,7 +669,8 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
             mHints->ai_family = AF_INET;
             // Don't need to do freeaddrinfo(res) before starting new DNS lookup because previous
             // DNS lookup is failed with error EAI_NODATA.
-            *rv = resolv_getaddrinfo(mHost, mService, mHints, &mNetContext, res, event);
+            // The synthesized result lives as long as the A records it is made of.
+            *rv = resolv_getaddrinfo(mHost, mService, mHints, &mNetContext, res, event, &ttl);
             queryLimiter.finish(uid);
             if (*rv) {
                 *rv = EAI_NODATA;  // return original error code
@@ -663,6 +692,8 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
                 *res = nullptr;
             }
         }
+    } else if (!mDns64CacheKey.empty()) {
+        resolv_cache_add_addrinfo(mNetContext.dns_netid, mDns64CacheKey, *res, ttl);
     }
 }
 
@@ -678,12 +709,12 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
     int32_t rv = 0;
     NetworkDnsEventReported event;
     initDnsEvent(&event);
+    uint32_t ttl = 0;
     if (queryLimiter.start(uid)) {
-        if (evaluate_domain_name(mNetContext, mHost)) {
-            rv = resolv_getaddrinfo(mHost, mService, mHints, &mNetContext, &result,
-                                    &event);
-        } else {
+        if (!evaluate_domain_name(mNetContext, mHost)) {
             rv = EAI_SYSTEM;
+        } else if ((result = lookupDns64Result()) == nullptr) {
+            rv = resolv_getaddrinfo(mHost, mService, mHints, &mNetContext, &result, &event, &ttl);
         }
         queryLimiter.finish(uid);
     } else {
@@ -694,7 +725,7 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
                    << ", max concurrent queries reached";
     }
 
-    doDns64Synthesis(&rv, &result, &event);
+    doDns64Synthesis(&rv, &result, &event, ttl);
     const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
     event.set_latency_micros(latencyUs);
     event.set_event_type(EVENT_GETADDRINFO);
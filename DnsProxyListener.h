@@ -57,13 +57,20 @@ class DnsProxyListener : public FrameworkListener {
         std::string threadName();
 
       private:
-        void doDns64Synthesis(int32_t* rv, addrinfo** res, NetworkDnsEventReported* event);
+        // Returns the result synthesized for an identical earlier request, if the network
+        // uses DNS64 and it is still cached.
+        addrinfo* lookupDns64Result();
+        // Synthesizes IPv6 answers from the result |*res| of a lookup that may be reused for
+        // |ttl| seconds, and caches them if lookupDns64Result() set a key.
+        void doDns64Synthesis(int32_t* rv, addrinfo** res, NetworkDnsEventReported* event,
+                              uint32_t ttl);
 
         SocketClient* mClient;  // ref counted
         char* mHost;            // owned. TODO: convert to std::string.
         char* mService;         // owned. TODO: convert to std::string.
         addrinfo* mHints;       // owned
         android_net_context mNetContext;
+        std::string mDns64CacheKey;
     };
 
     /* ------ gethostbyname ------*/
@@ -18,10 +18,12 @@
 
 #include "DnsResolverService.h"
 
+#include <algorithm>
 #include <set>
 #include <vector>
 
 #include <BinderUtil.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android/binder_manager.h>
@@ -35,7 +37,9 @@
 #include "resolv_cache.h"
 
 using aidl::android::net::ResolverParamsParcel;
+using aidl::android::net::ResolverStatsSnapshotParcel;
 using android::base::Join;
+using android::base::ParseUint;
 using android::base::StringPrintf;
 using android::netdutils::DumpWriter;
 
@@ -58,6 +62,25 @@ namespace {
 #define ENFORCE_NETWORK_STACK_PERMISSIONS() \
     ENFORCE_ANY_PERMISSION(PERM_NETWORK_STACK, PERM_MAINLINE_NETWORK_STACK)
 
+// Returns the ResolverController::DumpSection bits named by |names|, or 0 if a name is unknown.
+uint32_t parseDumpSections(const std::vector<std::string>& names) {
+    uint32_t sections = 0;
+    for (const auto& name : names) {
+        if (name == "config") {
+            sections |= ResolverController::DUMP_CONFIG;
+        } else if (name == "dns64") {
+            sections |= ResolverController::DUMP_DNS64;
+        } else if (name == "privatedns") {
+            sections |= ResolverController::DUMP_PRIVATE_DNS;
+        } else if (name == "stats") {
+            sections |= ResolverController::DUMP_STATS;
+        } else {
+            return 0;
+        }
+    }
+    return sections;
+}
+
 inline ::ndk::ScopedAStatus statusFromErrcode(int ret) {
     if (ret) {
         return ::ndk::ScopedAStatus(
@@ -92,18 +115,68 @@ binder_status_t DnsResolverService::start() {
     return STATUS_OK;
 }
 
-binder_status_t DnsResolverService::dump(int fd, const char**, uint32_t) {
+binder_status_t DnsResolverService::dump(int fd, const char** args, uint32_t numArgs) {
     auto dump_permission = checkAnyPermission({PERM_DUMP});
     if (!dump_permission.isOk()) {
         return STATUS_PERMISSION_DENIED;
     }
 
     // This method does not grab any locks. If individual classes need locking
-    // their dump() methods MUST handle locking appropriately.
+    // their dump() methods MUST handle locking appropriately. Networks are dumped one at a time,
+    // so no lock is held across the whole dump.
     DumpWriter dw(fd);
-    for (auto netId : resolv_list_caches()) {
+    std::vector<std::string> argv(args, args + numArgs);
+    bool proto = false;
+    if (!argv.empty() && argv[0] == "--proto") {
+        proto = true;
+        argv.erase(argv.begin());
+    }
+
+    std::vector<unsigned> netIds = resolv_list_caches();
+    uint32_t sections = ResolverController::DUMP_ALL;
+    if (!argv.empty()) {
+        unsigned netId;
+        if (argv[0] == "list" && argv.size() == 1 && !proto) {
+            for (const auto id : netIds) {
+                dw.println("%u", id);
+            }
+            return STATUS_OK;
+        } else if (argv[0] == "netid" && argv.size() >= 2 && ParseUint(argv[1], &netId)) {
+            if (std::find(netIds.begin(), netIds.end(), netId) == netIds.end()) {
+                dw.println("Unknown netId %u", netId);
+                return STATUS_OK;
+            }
+            netIds = {netId};
+            if (argv.size() > 2) sections = parseDumpSections({argv.begin() + 2, argv.end()});
+        } else {
+            sections = 0;
+        }
+        if (sections == 0) {
+            dw.println("Usage: dumpsys dnsresolver [--proto] "
+                       "[list | netid <netId> [<section>...]]");
+            dw.println("Sections: config, dns64, privatedns, stats");
+            return STATUS_OK;
+        }
+    }
+
+    if (proto) {
+        // Each network is written as a separate ResolverDump; the stream parses as one.
+        ResolverDump header;
+        for (const int bound : kLatencyBucketBoundsMs) {
+            header.add_latency_bucket_bounds_ms(bound);
+        }
+        if (!header.SerializeToFileDescriptor(fd)) return STATUS_OK;
+        for (const auto netId : netIds) {
+            ResolverDump part;
+            *part.add_networks() = gDnsResolv->resolverCtrl.dumpProto(netId);
+            if (!part.SerializeToFileDescriptor(fd)) break;
+        }
+        return STATUS_OK;
+    }
+
+    for (auto netId : netIds) {
         dw.println("NetId: %u", netId);
-        gDnsResolv->resolverCtrl.dump(dw, netId);
+        gDnsResolv->resolverCtrl.dump(dw, netId, sections);
         dw.blankline();
     }
 
@@ -195,6 +268,16 @@ binder_status_t DnsResolverService::dump(int fd, const char**, uint32_t) {
     return statusFromErrcode(res);
 }
 
+::ndk::ScopedAStatus DnsResolverService::getResolverStatsSnapshot(
+        int32_t netId, int64_t sinceRevision, ResolverStatsSnapshotParcel* snapshot) {
+    // Locking happens in res_cache.cpp functions.
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
+
+    int res = gDnsResolv->resolverCtrl.getResolverStatsSnapshot(netId, sinceRevision, snapshot);
+
+    return statusFromErrcode(res);
+}
+
 ::ndk::ScopedAStatus DnsResolverService::startPrefix64Discovery(int32_t netId) {
     // Locking happens in Dns64Configuration.
     ENFORCE_NETWORK_STACK_PERMISSIONS();
@@ -21,6 +21,7 @@
 
 #include <aidl/android/net/BnDnsResolver.h>
 #include <aidl/android/net/ResolverParamsParcel.h>
+#include <aidl/android/net/ResolverStatsSnapshotParcel.h>
 #include <android/binder_ibinder.h>
 
 #include "netd_resolv/resolv.h"
@@ -48,6 +49,9 @@ class DnsResolverService : public aidl::android::net::BnDnsResolver {
             std::vector<std::string>* tlsServers, std::vector<int32_t>* params,
             std::vector<int32_t>* stats,
             std::vector<int32_t>* wait_for_pending_req_timeout_count) override;
+    ::ndk::ScopedAStatus getResolverStatsSnapshot(
+            int32_t netId, int64_t sinceRevision,
+            aidl::android::net::ResolverStatsSnapshotParcel* snapshot) override;
     ::ndk::ScopedAStatus destroyNetworkCache(int32_t netId) override;
     ::ndk::ScopedAStatus createNetworkCache(int32_t netId) override;
 
@@ -19,6 +19,9 @@
 
 #include "DnsStats.h"
 
+#include <algorithm>
+#include <atomic>
+
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 
@@ -71,7 +74,8 @@ bool ensureNoInvalidIp(const std::vector<IPSockAddr>& servers) {
 
 }  // namespace
 
-// The comparison ignores the last update time.
+// The comparison ignores the last update time and revision, and the histogram, which is derived
+// from the same records as the latency.
 bool StatsData::operator==(const StatsData& o) const {
     return std::tie(serverSockAddr, total, rcodeCounts, latencyUs) ==
            std::tie(o.serverSockAddr, o.total, o.rcodeCounts, o.latencyUs);
@@ -96,7 +100,8 @@ std::string StatsData::toString() const {
 StatsRecords::StatsRecords(const IPSockAddr& ipSockAddr, size_t size)
     : mCapacity(size), mStatsData(ipSockAddr) {}
 
-void StatsRecords::push(const Record& record) {
+void StatsRecords::push(const Record& record, uint64_t revision) {
+    mStatsData.revision = revision;
     updateStatsData(record, true);
     mRecords.push_back(record);
 
@@ -117,15 +122,44 @@ void StatsRecords::updateStatsData(const Record& record, const bool add) {
         mStatsData.rcodeCounts[rcode] -= 1;
         mStatsData.latencyUs -= record.latencyUs;
     }
+    if (rcode != NS_R_TIMEOUT && rcode != NS_R_INTERNAL_ERROR) {
+        const int latencyMs = duration_cast<milliseconds>(record.latencyUs).count();
+        const size_t bucket = std::lower_bound(kLatencyBucketBoundsMs.begin(),
+                                               kLatencyBucketBoundsMs.end(), latencyMs) -
+                              kLatencyBucketBoundsMs.begin();
+        mStatsData.latencyHistogram[bucket] += add ? 1 : -1;
+    }
     mStatsData.lastUpdate = std::chrono::steady_clock::now();
 }
 
+std::optional<microseconds> StatsRecords::getLatencyPercentile(int percentile) const {
+    std::vector<microseconds> latencies;
+    latencies.reserve(mRecords.size());
+    for (const auto& record : mRecords) {
+        if (record.rcode == NS_R_TIMEOUT || record.rcode == NS_R_INTERNAL_ERROR) continue;
+        latencies.push_back(record.latencyUs);
+    }
+    if (latencies.empty()) return std::nullopt;
+
+    percentile = std::clamp(percentile, 0, 100);
+    const size_t rank = (latencies.size() - 1) * percentile / 100;
+    std::nth_element(latencies.begin(), latencies.begin() + rank, latencies.end());
+    return latencies[rank];
+}
+
+uint64_t DnsStats::nextRevision() {
+    static std::atomic<uint64_t> sRevision = 0;
+    return ++sRevision;
+}
+
 bool DnsStats::setServers(const std::vector<netdutils::IPSockAddr>& servers, Protocol protocol) {
     if (!ensureNoInvalidIp(servers)) return false;
 
     ServerStatsMap& statsMap = mStats[protocol];
+    const size_t oldSize = statsMap.size();
+    bool added = false;
     for (const auto& server : servers) {
-        statsMap.try_emplace(server, StatsRecords(server, kLogSize));
+        added |= statsMap.try_emplace(server, StatsRecords(server, kLogSize)).second;
     }
 
     // Clean up the map to eliminate the nodes not belonging to the given list of servers.
@@ -141,6 +175,11 @@ bool DnsStats::setServers(const std::vector<netdutils::IPSockAddr>& servers, Pro
 
     cleanup(&statsMap);
 
+    // Servers were added, removed, or both.
+    if (added || statsMap.size() != oldSize) {
+        mServersRevision = mRevision = nextRevision();
+    }
+
     return true;
 }
 
@@ -153,13 +192,28 @@ bool DnsStats::addStats(const IPSockAddr& ipSockAddr, const DnsQueryEvent& recor
                     .rcode = record.rcode(),
                     .latencyUs = microseconds(record.latency_micros()),
             };
-            statsRecords.push(rec);
+            mRevision = nextRevision();
+            statsRecords.push(rec, mRevision);
             return true;
         }
     }
     return false;
 }
 
+std::optional<microseconds> DnsStats::getLatencyPercentile(const IPSockAddr& server,
+                                                           Protocol protocol,
+                                                           int percentile) const {
+    const auto statsMap = mStats.find(protocol);
+    if (statsMap == mStats.end()) return std::nullopt;
+
+    for (const auto& [serverSockAddr, statsRecords] : statsMap->second) {
+        if (serverSockAddr == server) {
+            return statsRecords.getLatencyPercentile(percentile);
+        }
+    }
+    return std::nullopt;
+}
+
 std::vector<StatsData> DnsStats::getStats(Protocol protocol) const {
     std::vector<StatsData> ret;
 
@@ -171,6 +225,21 @@ std::vector<StatsData> DnsStats::getStats(Protocol protocol) const {
     return ret;
 }
 
+std::vector<std::pair<Protocol, StatsData>> DnsStats::getStatsSince(uint64_t revision,
+                                                                   bool* full) const {
+    *full = revision < mServersRevision;
+    std::vector<std::pair<Protocol, StatsData>> ret;
+    for (const auto& [protocol, statsMap] : mStats) {
+        for (const auto& [_, statsRecords] : statsMap) {
+            const StatsData& data = statsRecords.getStatsData();
+            if (*full || data.revision > revision) {
+                ret.emplace_back(protocol, data);
+            }
+        }
+    }
+    return ret;
+}
+
 void DnsStats::dump(DumpWriter& dw) {
     const auto dumpStatsMap = [&](ServerStatsMap& statsMap) {
         ScopedIndent indentLog(dw);
@@ -17,9 +17,11 @@
 
 #pragma once
 
+#include <array>
 #include <chrono>
 #include <deque>
 #include <map>
+#include <optional>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
@@ -31,6 +33,11 @@
 
 namespace android::net {
 
+// Upper bounds, in milliseconds, of the buckets of the latency histogram in StatsData. The last
+// bucket holds the latencies above the last bound.
+constexpr std::array<int, 8> kLatencyBucketBoundsMs = {10, 20, 50, 100, 200, 500, 1000, 2000};
+constexpr size_t kNumLatencyBuckets = kLatencyBucketBoundsMs.size() + 1;
+
 // The overall information of a StatsRecords.
 struct StatsData {
     StatsData(const netdutils::IPSockAddr& ipSockAddr) : serverSockAddr(ipSockAddr) {
@@ -51,9 +58,16 @@ struct StatsData {
     // For DNS-over-TLS, it might include TCP handshake plus SSL handshake.
     std::chrono::microseconds latencyUs = {};
 
+    // The number of answered queries in each latency bucket, see kLatencyBucketBoundsMs.
+    // Timeouts and internal errors are not counted.
+    std::array<int, kNumLatencyBuckets> latencyHistogram = {};
+
     // The last update timestamp.
     std::chrono::time_point<std::chrono::steady_clock> lastUpdate;
 
+    // The revision of the owning DnsStats at which this data last changed.
+    uint64_t revision = 0;
+
     std::string toString() const;
 
     // For testing.
@@ -73,10 +87,15 @@ class StatsRecords {
 
     StatsRecords(const netdutils::IPSockAddr& ipSockAddr, size_t size);
 
-    void push(const Record& record);
+    // Adds |record|, which is the change at |revision| of the owning DnsStats.
+    void push(const Record& record, uint64_t revision = 0);
 
     const StatsData& getStatsData() const { return mStatsData; }
 
+    // Returns the |percentile|th percentile of the latency of the answered queries in the
+    // records, or std::nullopt if there are none. Timeouts and internal errors are ignored.
+    std::optional<std::chrono::microseconds> getLatencyPercentile(int percentile) const;
+
   private:
     void updateStatsData(const Record& record, const bool add);
 
@@ -98,6 +117,20 @@ class DnsStats {
     // Return true if |record| is successfully added into |server|'s stats; otherwise, return false.
     bool addStats(const netdutils::IPSockAddr& server, const DnsQueryEvent& record);
 
+    // Returns the |percentile|th percentile of the latency of |server| with |protocol|, or
+    // std::nullopt if no query to |server| has been answered recently.
+    std::optional<std::chrono::microseconds> getLatencyPercentile(
+            const netdutils::IPSockAddr& server, Protocol protocol, int percentile) const;
+
+    // Returns the stats of the servers that changed after |revision|, with their protocol, for
+    // callers that poll. Sets |full| if the set of servers changed after |revision|, in which
+    // case the stats of all servers are returned. Pass 0 to get all of them.
+    std::vector<std::pair<Protocol, StatsData>> getStatsSince(uint64_t revision,
+                                                              bool* full) const;
+
+    // The revision of the last change to the stats. It only increases, even across instances.
+    uint64_t getRevision() const { return mRevision; }
+
     void dump(netdutils::DumpWriter& dw);
 
     // For testing.
@@ -107,7 +140,14 @@ class DnsStats {
     // TODO: Support getSortedServers().
 
   private:
+    // Revisions are drawn from a process-wide counter, so that they keep increasing when a
+    // network is destroyed and created again.
+    static uint64_t nextRevision();
+
     std::map<Protocol, ServerStatsMap> mStats;
+    uint64_t mRevision = nextRevision();
+    // The revision at which the set of servers last changed.
+    uint64_t mServersRevision = mRevision;
 
     static constexpr size_t kLogSize = 128;
 };
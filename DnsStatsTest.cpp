@@ -79,6 +79,44 @@ TEST_F(StatsRecordsTest, PushRecord) {
               makeStatsData(server, 3, 750ms, {{NS_R_NO_ERROR, 0}, {NS_R_TIMEOUT, 3}}));
 }
 
+TEST_F(StatsRecordsTest, LatencyPercentile) {
+    const IPSockAddr server = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+    StatsRecords sr(server, 10);
+    EXPECT_EQ(sr.getLatencyPercentile(90), std::nullopt);
+
+    // Timeouts are not answers, so they do not count.
+    sr.push({NS_R_TIMEOUT, 5000ms});
+    EXPECT_EQ(sr.getLatencyPercentile(90), std::nullopt);
+
+    for (int i = 10; i >= 1; i--) {
+        sr.push({NS_R_NO_ERROR, milliseconds(i * 10)});
+    }
+    // The oldest records, including the timeout, have been evicted.
+    EXPECT_EQ(sr.getLatencyPercentile(0), 10ms);
+    EXPECT_EQ(sr.getLatencyPercentile(50), 50ms);
+    EXPECT_EQ(sr.getLatencyPercentile(90), 90ms);
+    EXPECT_EQ(sr.getLatencyPercentile(100), 100ms);
+}
+
+TEST_F(StatsRecordsTest, LatencyHistogram) {
+    const IPSockAddr server = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+    StatsRecords sr(server, 3);
+
+    sr.push({NS_R_NO_ERROR, 10ms});
+    sr.push({NS_R_NXDOMAIN, 15ms});
+    sr.push({NS_R_TIMEOUT, 5000ms});
+    std::array<int, kNumLatencyBuckets> expected = {};
+    expected[0] = 1;  // <= 10ms
+    expected[1] = 1;  // <= 20ms
+    EXPECT_EQ(expected, sr.getStatsData().latencyHistogram);
+
+    // The oldest record is evicted from the histogram, too.
+    sr.push({NS_R_SERVFAIL, 3000ms});
+    expected[0] = 0;
+    expected[kNumLatencyBuckets - 1] = 1;  // > 2000ms
+    EXPECT_EQ(expected, sr.getStatsData().latencyHistogram);
+}
+
 class DnsStatsTest : public ::testing::Test {
   protected:
     DnsStats mDnsStats;
@@ -262,6 +300,48 @@ TEST_F(DnsStatsTest, StatsRemainsInExistentServer) {
     EXPECT_THAT(mDnsStats.getStats(PROTO_UDP), UnorderedElementsAreArray(expectedStats));
 }
 
+TEST_F(DnsStatsTest, GetStatsSince) {
+    const std::vector<IPSockAddr> servers = {
+            IPSockAddr::toIPSockAddr("127.0.0.1", 53),
+            IPSockAddr::toIPSockAddr("127.0.0.2", 53),
+    };
+    EXPECT_TRUE(mDnsStats.setServers(servers, PROTO_TCP));
+    EXPECT_TRUE(mDnsStats.setServers(servers, PROTO_UDP));
+
+    // All servers, over both protocols.
+    bool full = false;
+    EXPECT_EQ(4U, mDnsStats.getStatsSince(0, &full).size());
+    EXPECT_TRUE(full);
+    const uint64_t revision1 = mDnsStats.getRevision();
+    EXPECT_THAT(mDnsStats.getStatsSince(revision1, &full), IsEmpty());
+    EXPECT_FALSE(full);
+
+    // Only the server that got a record.
+    EXPECT_TRUE(mDnsStats.addStats(servers[1], makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 10ms)));
+    const uint64_t revision2 = mDnsStats.getRevision();
+    EXPECT_GT(revision2, revision1);
+    const auto changed = mDnsStats.getStatsSince(revision1, &full);
+    EXPECT_FALSE(full);
+    ASSERT_EQ(1U, changed.size());
+    EXPECT_EQ(PROTO_UDP, changed[0].first);
+    EXPECT_EQ(makeStatsData(servers[1], 1, 10ms, {{NS_R_NO_ERROR, 1}}), changed[0].second);
+    EXPECT_EQ(revision2, changed[0].second.revision);
+
+    // Setting the same servers again changes nothing.
+    EXPECT_TRUE(mDnsStats.setServers(servers, PROTO_UDP));
+    EXPECT_THAT(mDnsStats.getStatsSince(revision2, &full), IsEmpty());
+    EXPECT_FALSE(full);
+
+    // A change of servers makes the next snapshot full.
+    EXPECT_TRUE(mDnsStats.setServers({servers[0]}, PROTO_UDP));
+    EXPECT_EQ(3U, mDnsStats.getStatsSince(revision2, &full).size());
+    EXPECT_TRUE(full);
+
+    // Revisions keep increasing across instances.
+    DnsStats other;
+    EXPECT_GT(other.getRevision(), mDnsStats.getRevision());
+}
+
 TEST_F(DnsStatsTest, AddStatsRecords_100000) {
     constexpr int num = 100000;
     const std::vector<IPSockAddr> servers = {
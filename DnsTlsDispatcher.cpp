@@ -18,12 +18,18 @@
 
 #include "DnsTlsDispatcher.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <string_view>
+#include <thread>
+
 #include <netdutils/Stopwatch.h>
 
 #include "DnsTlsSocketFactory.h"
 #include "resolv_cache.h"
 #include "resolv_private.h"
 #include "stats.pb.h"
+#include "util.h"
 
 #include <android-base/logging.h>
 
@@ -33,14 +39,18 @@ namespace net {
 using android::netdutils::IPSockAddr;
 using android::netdutils::Stopwatch;
 using netdutils::Slice;
-
-// static
-std::mutex DnsTlsDispatcher::sLock;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
 
 DnsTlsDispatcher::DnsTlsDispatcher() {
     mFactory.reset(new DnsTlsSocketFactory());
 }
 
+DnsTlsDispatcher& DnsTlsDispatcher::getInstance() {
+    static DnsTlsDispatcher instance;
+    return instance;
+}
+
 std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedServerList(
         const std::list<DnsTlsServer> &tlsServers, unsigned mark) const {
     // Our preferred DnsTlsServer order is:
@@ -56,11 +66,15 @@ std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedServerList(
     // Pull out any servers for which we might have existing connections and
     // place them at the from the list of servers to try.
     {
-        std::lock_guard guard(sLock);
-
         for (const auto& tlsServer : tlsServers) {
             const Key key = std::make_pair(mark, tlsServer);
-            if (mStore.find(key) != mStore.end()) {
+            Shard& shard = getShard(key);
+            bool exists;
+            {
+                std::lock_guard guard(shard.lock);
+                exists = shard.store.find(key) != shard.store.end();
+            }
+            if (exists) {
                 switch (tlsServer.ss.ss_family) {
                     case AF_INET:
                         existing4.push_back(tlsServer);
@@ -98,110 +112,356 @@ DnsTlsTransport::Response DnsTlsDispatcher::query(const std::list<DnsTlsServer>&
 
     DnsTlsTransport::Response code = DnsTlsTransport::Response::internal_error;
     int serverCount = 0;
-    for (const auto& server : orderedServers) {
-        DnsQueryEvent* dnsQueryEvent =
-                statp->event->mutable_dns_query_events()->add_dns_query_event();
+    auto server = orderedServers.begin();
+    if (orderedServers.size() >= 2 && getExperimentFlagInt("dot_query_hedging", 0) != 0) {
+        earnHedgeCredit();
+        if (hedgedQuery(*server, *std::next(server), statp, query, ans, resplen, &code,
+                        &serverCount)) {
+            return code;
+        }
+        std::advance(server, serverCount);
+    }
+    for (; server != orderedServers.end(); ++server) {
         Stopwatch queryStopwatch;
-        code = this->query(server, statp->_mark, query, ans, resplen);
-
-        dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(queryStopwatch.timeTakenUs()));
-        dnsQueryEvent->set_dns_server_index(serverCount++);
-        dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(server.ss.ss_family));
-        dnsQueryEvent->set_protocol(PROTO_DOT);
-        dnsQueryEvent->set_type(getQueryType(query.base(), query.size()));
-
-        switch (code) {
-            // These response codes are valid responses and not expected to
-            // change if another server is queried.
-            case DnsTlsTransport::Response::success:
-                dnsQueryEvent->set_rcode(
-                        static_cast<NsRcode>(reinterpret_cast<HEADER*>(ans.base())->rcode));
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
-                return code;
-            case DnsTlsTransport::Response::limit_error:
-                dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
-                return code;
-            // These response codes might differ when trying other servers, so
-            // keep iterating to see if we can get a different (better) result.
-            case DnsTlsTransport::Response::network_error:
-                // Sync from res_tls_send in res_send.cpp
-                dnsQueryEvent->set_rcode(NS_R_TIMEOUT);
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
-                break;
-            case DnsTlsTransport::Response::internal_error:
-                dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
-                break;
-            // No "default" statement.
+        code = this->query(*server, statp->_mark, query, ans, resplen);
+        const microseconds latency(static_cast<int64_t>(queryStopwatch.timeTakenUs()));
+        if (reportQuery(statp, *server, serverCount++, query, ans, code, latency)) {
+            return code;
         }
     }
 
     return code;
 }
 
-DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, unsigned mark,
-                                                  const Slice query,
-                                                  const Slice ans, int *resplen) {
-    const Key key = std::make_pair(mark, server);
-    Transport* xport;
+bool DnsTlsDispatcher::reportQuery(res_state statp, const DnsTlsServer& server, int serverIndex,
+                                   const Slice query, const Slice ans,
+                                   DnsTlsTransport::Response code, microseconds latency) {
+    DnsQueryEvent* dnsQueryEvent = statp->event->mutable_dns_query_events()->add_dns_query_event();
+    dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(latency.count()));
+    dnsQueryEvent->set_dns_server_index(serverIndex);
+    dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(server.ss.ss_family));
+    dnsQueryEvent->set_protocol(PROTO_DOT);
+    dnsQueryEvent->set_type(getQueryType(query.base(), query.size()));
+
+    switch (code) {
+        // These response codes are valid responses and not expected to
+        // change if another server is queried.
+        case DnsTlsTransport::Response::success:
+            dnsQueryEvent->set_rcode(
+                    static_cast<NsRcode>(reinterpret_cast<HEADER*>(ans.base())->rcode));
+            resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
+            return true;
+        case DnsTlsTransport::Response::limit_error:
+            dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
+            resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
+            return true;
+        // These response codes might differ when trying other servers, so
+        // keep iterating to see if we can get a different (better) result.
+        case DnsTlsTransport::Response::network_error:
+            // Sync from res_tls_send in res_send.cpp
+            dnsQueryEvent->set_rcode(NS_R_TIMEOUT);
+            resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
+            return false;
+        case DnsTlsTransport::Response::internal_error:
+            dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
+            resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
+            return false;
+        // No "default" statement.
+    }
+    return false;
+}
+
+namespace {
+
+// The percentile of a server's latency after which a query to it is considered slow.
+constexpr int kSlowQueryPercentile = 90;
+// The threshold used for a server without latency statistics.
+constexpr milliseconds kDefaultSlowQueryThreshold(500);
+// Bounds of the threshold.
+constexpr milliseconds kMinSlowQueryThreshold(20);
+constexpr milliseconds kMaxSlowQueryThreshold(2000);
+
+// The state shared by a hedged query and the threads waiting for its answers.
+struct HedgeState {
+    HedgeState(const Slice query, unsigned netId, const DnsTlsServer& primary,
+               const DnsTlsServer& secondary)
+        : query(query.base(), query.limit()), netId(netId), servers{primary, secondary} {}
+
+    // A copy of the query. DnsTlsTransport keeps referring to the query until it is answered,
+    // which may happen after the caller has returned and released its own buffer.
+    const std::vector<uint8_t> query;
+
+    // Where the query was sent, and when, indexed by server index. The start times are set
+    // before the answers are watched.
+    const unsigned netId;
+    const std::array<DnsTlsServer, 2> servers;
+    std::array<std::chrono::steady_clock::time_point, 2> starts;
+
+    struct Arrival {
+        int serverIndex;
+        DnsTlsTransport::Result result;
+        std::chrono::steady_clock::time_point time;
+    };
+
+    std::mutex lock;
+    std::condition_variable cv;
+    // The answers, in the order they arrive.
+    std::vector<Arrival> arrivals GUARDED_BY(lock);
+    // Set once the caller stops waiting. Answers arriving afterwards are only recorded in the
+    // server statistics.
+    bool abandoned GUARDED_BY(lock) = false;
+};
+
+// Records the answer of a server that lost a hedged query, which arrived after the caller
+// returned, in the statistics of the network. Otherwise only the fast answers of a slow server
+// would be counted, and its latency percentile, hence the hedging threshold, would drift down.
+void recordLateArrival(const HedgeState& state, const HedgeState::Arrival& arrival) {
+    const DnsTlsServer& server = state.servers[arrival.serverIndex];
+    const auto latency = std::chrono::duration_cast<microseconds>(
+            arrival.time - state.starts[arrival.serverIndex]);
+    DnsQueryEvent event;
+    event.set_latency_micros(saturate_cast<int32_t>(latency.count()));
+    event.set_dns_server_index(arrival.serverIndex);
+    event.set_ip_version(ipFamilyToIPVersion(server.ss.ss_family));
+    event.set_protocol(PROTO_DOT);
+    event.set_type(getQueryType(state.query.data(), state.query.size()));
+    const auto& response = arrival.result.response;
+    switch (arrival.result.code) {
+        case DnsTlsTransport::Response::success:
+            if (response.size() < HFIXEDSZ) return;
+            event.set_rcode(
+                    static_cast<NsRcode>(reinterpret_cast<const HEADER*>(response.data())->rcode));
+            break;
+        case DnsTlsTransport::Response::network_error:
+            event.set_rcode(NS_R_TIMEOUT);
+            break;
+        case DnsTlsTransport::Response::limit_error:
+        case DnsTlsTransport::Response::internal_error:
+            event.set_rcode(NS_R_INTERNAL_ERROR);
+            break;
+    }
+    resolv_stats_add(state.netId, IPSockAddr::toIPSockAddr(server.ss), &event);
+}
+
+// Waits for |result| on a separate thread and appends it to |state|, or records it if the
+// caller is gone. The thread owns everything it touches, including the query buffer, so it may
+// outlive the caller, the transport and the dispatcher.
+void watchHedgedResult(std::future<DnsTlsTransport::Result> result, int serverIndex,
+                       std::shared_ptr<HedgeState> state) {
+    std::thread([result = std::move(result), serverIndex, state]() mutable {
+        HedgeState::Arrival arrival{serverIndex, result.get(), std::chrono::steady_clock::now()};
+        {
+            std::lock_guard guard(state->lock);
+            if (!state->abandoned) {
+                state->arrivals.push_back(std::move(arrival));
+                state->cv.notify_one();
+                return;
+            }
+        }
+        recordLateArrival(*state, arrival);
+    }).detach();
+}
+
+}  // namespace
+
+// static
+milliseconds DnsTlsDispatcher::getSlowQueryThreshold(unsigned netId, const DnsTlsServer& server) {
+    const auto latency = resolv_stats_get_latency_percentile(
+            netId, IPSockAddr::toIPSockAddr(server.ss), PROTO_DOT, kSlowQueryPercentile);
+    if (!latency) return kDefaultSlowQueryThreshold;
+    return std::clamp(std::chrono::duration_cast<milliseconds>(*latency), kMinSlowQueryThreshold,
+                      kMaxSlowQueryThreshold);
+}
+
+bool DnsTlsDispatcher::hedgedQuery(const DnsTlsServer& primary, const DnsTlsServer& secondary,
+                                   res_state statp, const Slice query, const Slice ans,
+                                   int* resplen, DnsTlsTransport::Response* code, int* tried) {
+    auto state = std::make_shared<HedgeState>(query, statp->netid, primary, secondary);
+    const auto start = std::chrono::steady_clock::now();
+    Transport* primaryXport = acquireTransport(primary, statp->_mark);
+    auto primaryResult = primaryXport->transport.query(netdutils::makeSlice(state->query));
+
+    if (primaryResult.wait_for(getSlowQueryThreshold(statp->netid, primary)) ==
+                std::future_status::ready ||
+        !spendHedgeCredits()) {
+        // Either the primary server was fast enough or the hedge budget is exhausted, so this
+        // is an ordinary query.
+        const auto result = primaryResult.get();
+        releaseTransport(primaryXport);
+        *code = copyResult(result, ans, resplen);
+        *tried = 1;
+        const auto latency = std::chrono::steady_clock::now() - start;
+        return reportQuery(statp, primary, 0, query, ans, *code,
+                           std::chrono::duration_cast<microseconds>(latency));
+    }
+
+    LOG(DEBUG) << "Hedging query to the next server";
+    state->starts = {start, std::chrono::steady_clock::now()};
+    Transport* secondaryXport = acquireTransport(secondary, statp->_mark);
+    watchHedgedResult(std::move(primaryResult), 0, state);
+    watchHedgedResult(secondaryXport->transport.query(netdutils::makeSlice(state->query)), 1,
+                      state);
+
+    // Wait for the first successful answer, or for both servers to fail.
+    std::vector<HedgeState::Arrival> arrivals;
     {
-        std::lock_guard guard(sLock);
-        auto it = mStore.find(key);
-        if (it == mStore.end()) {
-            xport = new Transport(server, mark, mFactory.get());
-            mStore[key].reset(xport);
-        } else {
-            xport = it->second.get();
+        std::unique_lock lock(state->lock);
+        android::base::ScopedLockAssertion assume_lock(state->lock);
+        while (state->arrivals.size() < 2 &&
+               (state->arrivals.empty() ||
+                state->arrivals.back().result.code != DnsTlsTransport::Response::success)) {
+            state->cv.wait(lock);
+        }
+        arrivals = state->arrivals;
+        state->abandoned = true;
+    }
+    // The loser's query stays pending in its transport, which completes it on its own. Its
+    // watcher then records the answer in the server statistics.
+    releaseTransport(primaryXport);
+    releaseTransport(secondaryXport);
+
+    *tried = 2;
+    for (const auto& arrival : arrivals) {
+        const DnsTlsServer& server = arrival.serverIndex == 0 ? primary : secondary;
+        const auto latency = arrival.time - state->starts[arrival.serverIndex];
+        *code = copyResult(arrival.result, ans, resplen);
+        if (reportQuery(statp, server, arrival.serverIndex, query, ans, *code,
+                        std::chrono::duration_cast<microseconds>(latency))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DnsTlsDispatcher::earnHedgeCredit() {
+    int credits = mHedgeCredits.load(std::memory_order_relaxed);
+    while (credits < kMaxHedgeCredits &&
+           !mHedgeCredits.compare_exchange_weak(credits, credits + 1, std::memory_order_relaxed)) {
+    }
+}
+
+bool DnsTlsDispatcher::spendHedgeCredits() {
+    int credits = mHedgeCredits.load(std::memory_order_relaxed);
+    while (credits >= kHedgeCost) {
+        if (mHedgeCredits.compare_exchange_weak(credits, credits - kHedgeCost,
+                                                std::memory_order_relaxed)) {
+            return true;
         }
-        ++xport->useCount;
     }
+    LOG(DEBUG) << "Hedge budget exhausted";
+    return false;
+}
+
+// static
+DnsTlsTransport::Response DnsTlsDispatcher::copyResult(const DnsTlsTransport::Result& result,
+                                                       const Slice ans, int* resplen) {
+    if (result.code != DnsTlsTransport::Response::success) {
+        LOG(DEBUG) << "Query failed: " << (unsigned int)result.code;
+        return result.code;
+    }
+    if (result.response.size() > ans.size()) {
+        LOG(DEBUG) << "Response too large: " << result.response.size() << " > " << ans.size();
+        return DnsTlsTransport::Response::limit_error;
+    }
+    LOG(DEBUG) << "Got response successfully";
+    *resplen = result.response.size();
+    netdutils::copy(ans, netdutils::makeSlice(result.response));
+    return DnsTlsTransport::Response::success;
+}
+
+DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, unsigned mark,
+                                                  const Slice query,
+                                                  const Slice ans, int *resplen) {
+    Transport* xport = acquireTransport(server, mark);
 
     LOG(DEBUG) << "Sending query of length " << query.size();
     auto res = xport->transport.query(query);
     LOG(DEBUG) << "Awaiting response";
-    const auto& result = res.get();
-    DnsTlsTransport::Response code = result.code;
-    if (code == DnsTlsTransport::Response::success) {
-        if (result.response.size() > ans.size()) {
-            LOG(DEBUG) << "Response too large: " << result.response.size() << " > " << ans.size();
-            code = DnsTlsTransport::Response::limit_error;
-        } else {
-            LOG(DEBUG) << "Got response successfully";
-            *resplen = result.response.size();
-            netdutils::copy(ans, netdutils::makeSlice(result.response));
-        }
-    } else {
-        LOG(DEBUG) << "Query failed: " << (unsigned int)code;
+    // If the connection stops answering, the query is moved to a new one.
+    while (res.wait_for(xport->transport.stallTimeout()) == std::future_status::timeout) {
+        xport->transport.moveStalledQueries();
     }
+    const DnsTlsTransport::Response code = copyResult(res.get(), ans, resplen);
 
-    auto now = std::chrono::steady_clock::now();
-    {
-        std::lock_guard guard(sLock);
-        --xport->useCount;
-        xport->lastUsed = now;
-        cleanup(now);
-    }
+    releaseTransport(xport);
     return code;
 }
 
-// This timeout effectively controls how long to keep SSL session tickets.
-static constexpr std::chrono::minutes IDLE_TIMEOUT(5);
-void DnsTlsDispatcher::cleanup(std::chrono::time_point<std::chrono::steady_clock> now) {
-    // To avoid scanning mStore after every query, return early if a cleanup has been
+bool DnsTlsDispatcher::validate(const DnsTlsServer& server, unsigned netId, unsigned mark) {
+    Transport* xport = acquireTransport(server, mark);
+    const bool success = xport->transport.validate(netId);
+    releaseTransport(xport);
+    return success;
+}
+
+DnsTlsDispatcher::Shard& DnsTlsDispatcher::getShard(const Key& key) const {
+    // Only the mark and the IP address are hashed, which is consistent with the exact
+    // comparison of Key since equal keys always have equal addresses.
+    const DnsTlsServer& server = key.second;
+    std::string_view addr;
+    switch (server.ss.ss_family) {
+        case AF_INET:
+            addr = std::string_view(
+                    reinterpret_cast<const char*>(
+                            &reinterpret_cast<const sockaddr_in*>(&server.ss)->sin_addr),
+                    sizeof(in_addr));
+            break;
+        case AF_INET6:
+            addr = std::string_view(
+                    reinterpret_cast<const char*>(
+                            &reinterpret_cast<const sockaddr_in6*>(&server.ss)->sin6_addr),
+                    sizeof(in6_addr));
+            break;
+    }
+    const size_t hash = std::hash<std::string_view>()(addr) * 31 + key.first;
+    return mShards[hash % kNumShards];
+}
+
+DnsTlsDispatcher::Transport* DnsTlsDispatcher::acquireTransport(const DnsTlsServer& server,
+                                                                unsigned mark) {
+    const Key key = std::make_pair(mark, server);
+    Shard& shard = getShard(key);
+    std::lock_guard guard(shard.lock);
+    cleanup(shard, std::chrono::steady_clock::now());
+    auto it = shard.store.find(key);
+    Transport* xport;
+    if (it == shard.store.end()) {
+        xport = new Transport(server, mark, mFactory.get());
+        shard.store[key].reset(xport);
+    } else {
+        xport = it->second.get();
+    }
+    // Incrementing under the shard lock guarantees that cleanup() cannot destroy |xport|
+    // while it is in use.
+    xport->useCount.fetch_add(1, std::memory_order_relaxed);
+    return xport;
+}
+
+// static
+void DnsTlsDispatcher::releaseTransport(Transport* xport) {
+    xport->lastUsed.store(std::chrono::steady_clock::now(), std::memory_order_relaxed);
+    // The release ordering publishes lastUsed to cleanup(), which observes the zero count
+    // with acquire ordering. |xport| must not be touched after this line.
+    xport->useCount.fetch_sub(1, std::memory_order_release);
+}
+
+void DnsTlsDispatcher::cleanup(Shard& shard,
+                               std::chrono::time_point<std::chrono::steady_clock> now) {
+    // To avoid scanning the shard on every query, return early if a cleanup has been
     // performed recently.
-    if (now - mLastCleanup < IDLE_TIMEOUT) {
+    if (now - shard.lastCleanup < mIdleTimeout) {
         return;
     }
-    for (auto it = mStore.begin(); it != mStore.end();) {
+    for (auto it = shard.store.begin(); it != shard.store.end();) {
         auto& s = it->second;
-        if (s->useCount == 0 && now - s->lastUsed > IDLE_TIMEOUT) {
-            it = mStore.erase(it);
+        if (s->useCount.load(std::memory_order_acquire) == 0 &&
+            now - s->lastUsed.load(std::memory_order_relaxed) > mIdleTimeout) {
+            it = shard.store.erase(it);
         } else {
             ++it;
         }
     }
-    mLastCleanup = now;
+    shard.lastCleanup = now;
 }
 
 }  // end of namespace net
@@ -17,6 +17,9 @@
 #ifndef _DNS_DNSTLSDISPATCHER_H
 #define _DNS_DNSTLSDISPATCHER_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <list>
 #include <map>
 #include <memory>
@@ -41,14 +44,19 @@ class DnsTlsDispatcher {
     DnsTlsDispatcher();
 
     // Constructor with dependency injection for testing.
-    explicit DnsTlsDispatcher(std::unique_ptr<IDnsTlsSocketFactory> factory)
-        : mFactory(std::move(factory)) {}
+    explicit DnsTlsDispatcher(std::unique_ptr<IDnsTlsSocketFactory> factory,
+                              std::chrono::milliseconds idleTimeout = kIdleTimeout)
+        : mIdleTimeout(idleTimeout), mFactory(std::move(factory)) {}
+
+    // Returns the dispatcher shared by resolver queries and private DNS validation.
+    static DnsTlsDispatcher& getInstance();
 
     // Enqueues |query| for resolution via the given |tlsServers| on the
     // network indicated by |mark|; writes the response into |ans|, and stores
     // the count of bytes written in |resplen|. Returns a success or error code.
     // The order in which servers from |tlsServers| are queried may not be the
-    // order passed in by the caller.
+    // order passed in by the caller. If the dot_query_hedging experiment flag is set, a query
+    // that the first server is slow to answer is also sent to the second one.
     DnsTlsTransport::Response query(const std::list<DnsTlsServer>& tlsServers,
                                     res_state _Nonnull statp, const netdutils::Slice query,
                                     const netdutils::Slice ans, int* _Nonnull resplen);
@@ -60,12 +68,18 @@ class DnsTlsDispatcher {
                                     const netdutils::Slice query, const netdutils::Slice ans,
                                     int* _Nonnull resplen);
 
-  private:
-    // This lock is static so that it can be used to annotate the Transport struct.
-    // DnsTlsDispatcher is a singleton in practice, so making this static does not change
-    // the locking behavior.
-    static std::mutex sLock;
+    // Returns how long a query to |server| on |netId| may take before it is considered slow:
+    // the 90th percentile of its recent DNS over TLS latency, clamped to [20ms, 2s], or 500ms
+    // without statistics.
+    static std::chrono::milliseconds getSlowQueryThreshold(unsigned netId,
+                                                           const DnsTlsServer& server);
+
+    // Checks that |server| is a working DNS over TLS server on |netId|, with the transport that
+    // queries for the network indicated by |mark| use. The connection and TLS session are thus
+    // kept for the first queries, instead of being torn down after validation.
+    bool validate(const DnsTlsServer& server, unsigned netId, unsigned mark);
 
+  private:
     // Key = <mark, server>
     typedef std::pair<unsigned, const DnsTlsServer> Key;
 
@@ -77,24 +91,81 @@ class DnsTlsDispatcher {
         // DnsTlsTransport is thread-safe, so it doesn't need to be guarded.
         DnsTlsTransport transport;
         // This use counter and timestamp are used to ensure that only idle sessions are
-        // destroyed.
-        int useCount GUARDED_BY(sLock) = 0;
+        // destroyed. useCount is only incremented with the lock of the owning Shard held, so
+        // cleanup() can trust a zero count; it is decremented without any lock.
+        std::atomic<int> useCount = 0;
         // lastUsed is only guaranteed to be meaningful after useCount is decremented to zero.
-        std::chrono::time_point<std::chrono::steady_clock> lastUsed GUARDED_BY(sLock);
+        std::atomic<std::chrono::steady_clock::time_point> lastUsed = {};
     };
 
-    // Cache of reusable DnsTlsTransports.  Transports stay in cache as long as
-    // they are in use and for a few minutes after.
-    // The key is a (netid, server) pair.  The netid is first for lexicographic comparison speed.
-    std::map<Key, std::unique_ptr<Transport>> mStore GUARDED_BY(sLock);
-
-    // The last time we did a cleanup.  For efficiency, we only perform a cleanup once every
-    // few minutes.
-    std::chrono::time_point<std::chrono::steady_clock> mLastCleanup GUARDED_BY(sLock);
+    // One slice of the transport cache. Queries for different keys usually land on different
+    // shards, so they do not contend on a single lock.
+    struct Shard {
+        std::mutex lock;
+        // Transports stay in cache as long as they are in use and for a few minutes after.
+        // The key is a (mark, server) pair. The mark is first for lexicographic comparison speed.
+        std::map<Key, std::unique_ptr<Transport>> store GUARDED_BY(lock);
+        // The last time we did a cleanup of this shard. For efficiency, we only perform a
+        // cleanup once every few minutes.
+        std::chrono::time_point<std::chrono::steady_clock> lastCleanup GUARDED_BY(lock);
+    };
 
-    // Drop any cache entries whose useCount is zero and which have not been used recently.
-    // This function performs a linear scan of mStore.
-    void cleanup(std::chrono::time_point<std::chrono::steady_clock> now) REQUIRES(sLock);
+    static constexpr size_t kNumShards = 16;
+
+    // Cache of reusable DnsTlsTransports, sharded by a hash of their key. Looking up a shard
+    // doesn't change the dispatcher, so it may be done from const methods.
+    mutable std::array<Shard, kNumShards> mShards;
+
+    Shard& getShard(const Key& key) const;
+
+    // How long transports are kept after their last use. This effectively controls how long to
+    // keep SSL session tickets.
+    static constexpr std::chrono::minutes kIdleTimeout{5};
+    const std::chrono::milliseconds mIdleTimeout = kIdleTimeout;
+
+    // Returns the transport for |server| on |mark|, creating it if needed, with its useCount
+    // incremented. Every call must be paired with releaseTransport().
+    Transport* _Nonnull acquireTransport(const DnsTlsServer& server, unsigned mark);
+    // Marks |xport| as no longer used by the caller. This does not take any lock; idle
+    // transports are reaped lazily by later calls to acquireTransport().
+    static void releaseTransport(Transport* _Nonnull xport);
+
+    // Drop any entries of |shard| whose useCount is zero and which have not been used recently.
+    // This function performs a linear scan of the shard.
+    void cleanup(Shard& shard, std::chrono::time_point<std::chrono::steady_clock> now)
+            REQUIRES(shard.lock);
+
+    // Records the outcome |code| of a query to |server| in the event and the statistics of
+    // |statp|. Returns true if |code| is final, i.e. not expected to change if another server
+    // is queried.
+    static bool reportQuery(res_state _Nonnull statp, const DnsTlsServer& server,
+                            int serverIndex, const netdutils::Slice query,
+                            const netdutils::Slice ans, DnsTlsTransport::Response code,
+                            std::chrono::microseconds latency);
+
+    // Sends |query| to |primary|, and also to |secondary| if |primary| has not answered within
+    // getSlowQueryThreshold() and the hedge budget allows it. The first successful answer wins.
+    // Stores the number of servers tried in |tried| and the result in |code|. Returns true if
+    // |code| is final, in which case |ans| and |resplen| are filled as in query().
+    bool hedgedQuery(const DnsTlsServer& primary, const DnsTlsServer& secondary,
+                     res_state _Nonnull statp, const netdutils::Slice query,
+                     const netdutils::Slice ans, int* _Nonnull resplen,
+                     DnsTlsTransport::Response* _Nonnull code, int* _Nonnull tried);
+
+    // Every query that could be hedged earns one credit and every hedge spends kHedgeCost of
+    // them, so at most one query in kHedgeCost is hedged in the long run. Credits are capped
+    // at kMaxHedgeCredits to bound bursts after a quiet period.
+    static constexpr int kHedgeCost = 10;
+    static constexpr int kMaxHedgeCredits = 100;
+    std::atomic<int> mHedgeCredits = 0;
+    void earnHedgeCredit();
+    bool spendHedgeCredits();
+
+    // Copies a successful |result| into |ans| and sets |resplen|. Returns the response code,
+    // which is limit_error if the answer does not fit in |ans|.
+    static DnsTlsTransport::Response copyResult(const DnsTlsTransport::Result& result,
+                                                const netdutils::Slice ans,
+                                                int* _Nonnull resplen);
 
     // Return a sorted list of DnsTlsServers in preference order.
     std::list<DnsTlsServer> getOrderedServerList(const std::list<DnsTlsServer>& tlsServers,
@@ -18,10 +18,35 @@
 
 #include "DnsTlsQueryMap.h"
 
+#include <arpa/nameser.h>
+#include <string.h>
+
 #include <android-base/logging.h>
 
 namespace android {
 namespace net {
+namespace {
+
+// Returns the size of the question section of the DNS message |msg|, or 0 if it is malformed.
+// Queries have a single question, without name compression.
+size_t questionSize(const uint8_t* msg, size_t size) {
+    size_t pos = NS_HFIXEDSZ;
+    while (pos < size && msg[pos] != 0) {
+        if (msg[pos] & NS_CMPRSFLGS) return 0;
+        pos += 1 + msg[pos];
+    }
+    pos += 1 + NS_QFIXEDSZ;  // The root label, QTYPE and QCLASS.
+    return pos <= size ? pos - NS_HFIXEDSZ : 0;
+}
+
+// Returns true if |response| answers the question of |query|.
+bool sameQuestion(const netdutils::Slice query, const std::vector<uint8_t>& response) {
+    const size_t size = questionSize(query.base(), query.size());
+    return size != 0 && response.size() >= NS_HFIXEDSZ + size &&
+           memcmp(query.base() + NS_HFIXEDSZ, response.data() + NS_HFIXEDSZ, size) == 0;
+}
+
+}  // namespace
 
 std::unique_ptr<DnsTlsQueryMap::QueryFuture> DnsTlsQueryMap::recordQuery(
         const netdutils::Slice query) {
@@ -58,14 +83,25 @@ void DnsTlsQueryMap::markTried(uint16_t newId) {
     auto it = mQueries.find(newId);
     if (it != mQueries.end()) {
         it->second.tries++;
+        it->second.sentTime = std::chrono::steady_clock::now();
     }
 }
 
-void DnsTlsQueryMap::cleanup() {
+bool DnsTlsQueryMap::hasStalledQuery(std::chrono::steady_clock::time_point cutoff) {
+    std::lock_guard guard(mLock);
+    for (const auto& [id, p] : mQueries) {
+        if (p.tries > 0 && p.sentTime < cutoff) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DnsTlsQueryMap::cleanup(std::chrono::steady_clock::time_point now) {
     std::lock_guard guard(mLock);
     for (auto it = mQueries.begin(); it != mQueries.end();) {
         auto& p = it->second;
-        if (p.tries >= kMaxTries) {
+        if (p.tries >= kMaxTries || now - p.recordTime > kMaxQueryAge) {
             expire(&p);
             it = mQueries.erase(it);
         } else {
@@ -122,7 +158,7 @@ void DnsTlsQueryMap::clear() {
     mQueries.clear();
 }
 
-void DnsTlsQueryMap::onResponse(std::vector<uint8_t> response) {
+void DnsTlsQueryMap::onResponse(std::vector<uint8_t> response, bool late) {
     LOG(VERBOSE) << "Got response of size " << response.size();
     if (response.size() < 2) {
         LOG(WARNING) << "Response is too short";
@@ -132,7 +168,13 @@ void DnsTlsQueryMap::onResponse(std::vector<uint8_t> response) {
     std::lock_guard guard(mLock);
     auto it = mQueries.find(id);
     if (it == mQueries.end()) {
-        LOG(WARNING) << "Discarding response: unknown ID " << id;
+        // This is usually a late duplicate answer to a query that was reissued after a
+        // reconnect and already answered, or that was expired.  It is harmless.
+        LOG(DEBUG) << "Discarding response: unknown ID " << id;
+        return;
+    }
+    if (late && !sameQuestion(it->second.query.query, response)) {
+        LOG(DEBUG) << "Discarding late response: ID " << id << " was reused";
         return;
     }
     Result r = { .code = Response::success, .response = std::move(response) };
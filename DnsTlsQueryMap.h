@@ -17,6 +17,7 @@
 #ifndef _DNS_DNSTLSQUERYMAP_H
 #define _DNS_DNSTLSQUERYMAP_H
 
+#include <chrono>
 #include <future>
 #include <map>
 #include <mutex>
@@ -58,7 +59,9 @@ class DnsTlsQueryMap {
 
     // Process a response, including a new ID.  If the response
     // is not recognized as matching any query, it will be ignored.
-    void onResponse(std::vector<uint8_t> response);
+    // A |late| response comes from a connection that the query was moved away from.  Since the
+    // ID may have been reused by then, it is also ignored unless it has the query's question.
+    void onResponse(std::vector<uint8_t> response, bool late = false);
 
     // Clear all map contents.  This causes all pending queries to resolve with failure.
     void clear();
@@ -69,7 +72,11 @@ class DnsTlsQueryMap {
     // Mark a query has having been retried.  If the query hits the retry limit, it will
     // be expired at the next call to cleanup.
     void markTried(uint16_t newId);
-    void cleanup();
+    // Returns true if a query that was last sent before |cutoff| is still unanswered.
+    bool hasStalledQuery(std::chrono::steady_clock::time_point cutoff);
+    // Expire the queries that are no longer worth sending: those that hit the retry limit and
+    // those recorded more than kMaxQueryAge before |now|.  Their results resolve with failure.
+    void cleanup(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
 
     // Returns true if there are no pending queries.
     bool empty();
@@ -82,6 +89,10 @@ class DnsTlsQueryMap {
         Query query;
         // Number of times the query has been tried.  Limited to kMaxTries.
         int tries = 0;
+        // When the query was last sent.  Only meaningful once it has been tried.
+        std::chrono::steady_clock::time_point sentTime;
+        // When the query was recorded.  Used to stop reissuing queries after kMaxQueryAge.
+        const std::chrono::steady_clock::time_point recordTime = std::chrono::steady_clock::now();
         // A promise whose future is returned by recordQuery()
         // It is fulfilled by onResponse().
         std::promise<Result> result;
@@ -90,6 +101,11 @@ class DnsTlsQueryMap {
     // The maximum number of times we will send a query before abandoning it.
     static constexpr int kMaxTries = 3;
 
+    // The maximum age of a query that is reissued after a reconnect.  DnsTlsDispatcher::query()
+    // waits for the result without a timeout, so this is what bounds how long a caller blocks
+    // on a query that keeps being reissued by a flapping connection.
+    static constexpr std::chrono::seconds kMaxQueryAge{30};
+
     // Outstanding queries by newId.
     std::map<uint16_t, QueryPromise> mQueries GUARDED_BY(mLock);
 
@@ -64,6 +64,12 @@ struct DnsTlsServer {
     // (presume net.ipv4.tcp_syn_retries = 6)
     std::chrono::milliseconds connectTimeout = std::chrono::milliseconds(127 * 1000);
 
+    // How long a connection to the server is kept open without any traffic.  DnsTlsTransport
+    // adapts it to the traffic pattern, and DnsTlsSocket shortens it to the server's own
+    // edns-tcp-keepalive timeout (RFC 7828) if the server announces one.
+    // It does not take part in comparisons.
+    std::chrono::milliseconds idleTimeout = std::chrono::seconds(20);
+
     // Exact comparison of DnsTlsServer objects
     bool operator<(const DnsTlsServer& other) const;
     bool operator==(const DnsTlsServer& other) const;
@@ -18,11 +18,47 @@
 
 #define LOG_TAG "resolv"
 
+#include <time.h>
+
 #include <android-base/logging.h>
 
 namespace android {
 namespace net {
 
+// static
+std::mutex DnsTlsSessionCache::sSharedLock;
+// static
+std::list<std::pair<DnsTlsSessionCache::SharedKey, std::shared_ptr<DnsTlsSessionCache::Sessions>>>
+        DnsTlsSessionCache::sShared;
+
+DnsTlsSessionCache::DnsTlsSessionCache() : mSessions(std::make_shared<Sessions>()) {}
+
+DnsTlsSessionCache::DnsTlsSessionCache(const DnsTlsServer& server)
+    : mSessions(getSharedSessions([&server] {
+          // Only the fields that the server identity depends on take part in the key.
+          DnsTlsServer identity(server.ss);
+          identity.name = server.name;
+          return std::make_pair(identity, server.certificate);
+      }())) {}
+
+// static
+std::shared_ptr<DnsTlsSessionCache::Sessions> DnsTlsSessionCache::getSharedSessions(
+        const SharedKey& key) {
+    std::lock_guard guard(sSharedLock);
+    for (auto it = sShared.begin(); it != sShared.end(); ++it) {
+        if (it->first == key) {
+            sShared.splice(sShared.begin(), sShared, it);
+            return sShared.front().second;
+        }
+    }
+    sShared.emplace_front(key, std::make_shared<Sessions>());
+    if (sShared.size() > kMaxSharedServers) {
+        LOG(DEBUG) << "Too many servers in the shared session cache; trimming";
+        sShared.pop_back();
+    }
+    return sShared.front().second;
+}
+
 bool DnsTlsSessionCache::prepareSsl(SSL* ssl) {
     // Add this cache as the 0-index extra data for the socket.
     // This is used by newSessionCallback.
@@ -53,23 +89,30 @@ int DnsTlsSessionCache::newSessionCallback(SSL* ssl, SSL_SESSION* session) {
 }
 
 void DnsTlsSessionCache::recordSession(SSL_SESSION* session) {
-    std::lock_guard guard(mLock);
-    mSessions.emplace_front(session);
-    if (mSessions.size() > kMaxSize) {
+    std::lock_guard guard(mSessions->lock);
+    auto& queue = mSessions->queue;
+    queue.emplace_front(session);
+    if (queue.size() > kMaxSize) {
         LOG(DEBUG) << "Too many sessions; trimming";
-        mSessions.pop_back();
+        queue.pop_back();
     }
 }
 
 bssl::UniquePtr<SSL_SESSION> DnsTlsSessionCache::getSession() {
-    std::lock_guard guard(mLock);
-    if (mSessions.size() == 0) {
-        LOG(DEBUG) << "No known sessions";
-        return nullptr;
+    std::lock_guard guard(mSessions->lock);
+    auto& queue = mSessions->queue;
+    // Sessions whose lifetime is over would only be rejected by the server, so drop them.
+    const uint64_t now = time(nullptr);
+    while (!queue.empty()) {
+        bssl::UniquePtr<SSL_SESSION> ret = std::move(queue.front());
+        queue.pop_front();
+        if (SSL_SESSION_get_time(ret.get()) + SSL_SESSION_get_timeout(ret.get()) > now) {
+            return ret;
+        }
+        LOG(DEBUG) << "Dropping expired session";
     }
-    bssl::UniquePtr<SSL_SESSION> ret = std::move(mSessions.front());
-    mSessions.pop_front();
-    return ret;
+    LOG(DEBUG) << "No known sessions";
+    return nullptr;
 }
 
 }  // end of namespace net
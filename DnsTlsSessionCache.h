@@ -18,12 +18,18 @@
 #define _DNS_DNSTLSSESSIONCACHE_H
 
 #include <deque>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <utility>
 
 #include <openssl/ssl.h>
 
 #include <android-base/thread_annotations.h>
 
+#include "DnsTlsServer.h"
+
 namespace android {
 namespace net {
 
@@ -31,27 +37,57 @@ namespace net {
 // This class is thread-safe.
 class DnsTlsSessionCache {
   public:
+    // Sessions are only visible to this object.
+    DnsTlsSessionCache();
+
+    // Sessions are shared, process-wide, with every other cache created for a server with the
+    // same address, name and certificate.  This lets a connection on a new network, or one
+    // created after an idle transport was dropped, resume TLS instead of doing a full handshake.
+    explicit DnsTlsSessionCache(const DnsTlsServer& server);
+
     // Prepare SSL objects to use this session cache.  These methods must be called
     // before making use of either object.
     void prepareSslContext(SSL_CTX* _Nonnull ssl_ctx);
     bool prepareSsl(SSL* _Nonnull ssl);
 
-    // Get the most recently discovered session.  For TLS 1.3 compatibility and
-    // maximum privacy, each session will only be returned once, so the caller
-    // gains ownership of the session.  (Here and throughout,
+    // Get the most recently discovered session that has not expired.  For TLS 1.3
+    // compatibility and maximum privacy, each session will only be returned once, so the
+    // caller gains ownership of the session.  (Here and throughout,
     // bssl::UniquePtr<SSL_SESSION> is actually serving as a reference counted
     // pointer.)
-    bssl::UniquePtr<SSL_SESSION> getSession() EXCLUDES(mLock);
+    bssl::UniquePtr<SSL_SESSION> getSession();
+
+    // Takes ownership of a newly negotiated |session|.  Public for testing.
+    void recordSession(SSL_SESSION* _Nullable session);
+
+    // The maximum number of servers whose sessions are kept in the shared store.
+    static constexpr size_t kMaxSharedServers = 32;
 
   private:
     static constexpr size_t kMaxSize = 5;
     static int newSessionCallback(SSL* _Nullable ssl, SSL_SESSION* _Nullable session);
 
-    std::mutex mLock;
-    void recordSession(SSL_SESSION* _Nullable session) EXCLUDES(mLock);
+    struct Sessions {
+        std::mutex lock;
+        // Queue of sessions, from most recently added to least recently.
+        std::deque<bssl::UniquePtr<SSL_SESSION>> queue GUARDED_BY(lock);
+    };
+
+    // The identity of a server, for the purpose of session resumption.
+    // Key = <server address and name, certificate>
+    typedef std::pair<DnsTlsServer, std::string> SharedKey;
+
+    // Returns the sessions of the server identified by |key| in the shared store, creating
+    // them if needed and evicting the least recently used server beyond kMaxSharedServers.
+    static std::shared_ptr<Sessions> getSharedSessions(const SharedKey& key)
+            EXCLUDES(sSharedLock);
+
+    static std::mutex sSharedLock;
+    // Shared sessions, from most recently used server to least recently.
+    static std::list<std::pair<SharedKey, std::shared_ptr<Sessions>>> sShared
+            GUARDED_BY(sSharedLock);
 
-    // Queue of sessions, from least recently added to most recently.
-    std::deque<bssl::UniquePtr<SSL_SESSION>> mSessions GUARDED_BY(mLock);
+    const std::shared_ptr<Sessions> mSessions;
 };
 
 }  // end of namespace net
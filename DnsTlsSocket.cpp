@@ -28,6 +28,7 @@
 #include <sys/poll.h>
 #include <unistd.h>
 #include <algorithm>
+#include <optional>
 
 #include "DnsTlsSessionCache.h"
 #include "IDnsTlsSocketObserver.h"
@@ -60,6 +61,36 @@ namespace {
 
 constexpr const char kCaCertDir[] = "/system/etc/security/cacerts";
 
+// The edns-tcp-keepalive EDNS0 option code (RFC 7828).
+constexpr uint16_t kEdnsTcpKeepalive = 11;
+// Lower bound of the idle timeout, so that a server announcing a timeout of 0 does not make
+// the connection close while answers are still on their way.
+constexpr std::chrono::seconds kMinIdleTimeout(1);
+// How long loop() waits for the server while answers are outstanding.  The idle timeout only
+// applies once the connection is idle.
+constexpr std::chrono::seconds kPendingQueryTimeout(20);
+
+// Appends an empty edns-tcp-keepalive option to the OPT record of the DNS message that starts
+// at |offset| in |buf|, if the OPT record is the last record of the message.
+void addTcpKeepaliveOption(std::vector<uint8_t>* buf, size_t offset) {
+    ns_msg handle;
+    if (ns_initparse(buf->data() + offset, buf->size() - offset, &handle) < 0) return;
+    const int arcount = ns_msg_count(handle, ns_s_ar);
+    ns_rr rr;
+    if (arcount == 0 || ns_parserr(&handle, ns_s_ar, arcount - 1, &rr) < 0 ||
+        ns_rr_type(rr) != ns_t_opt) {
+        return;
+    }
+    if (ns_rr_rdata(rr) + ns_rr_rdlen(rr) != buf->data() + buf->size()) return;
+
+    // RDLENGTH immediately precedes RDATA.
+    const size_t rdlenOffset = ns_rr_rdata(rr) - buf->data() - INT16SZ;
+    const uint16_t rdlen = ns_rr_rdlen(rr) + 2 * INT16SZ;
+    (*buf)[rdlenOffset] = rdlen >> 8;
+    (*buf)[rdlenOffset + 1] = rdlen;
+    buf->insert(buf->end(), {0, kEdnsTcpKeepalive, 0, 0});
+}
+
 int waitForReading(int fd, int timeoutMs = -1) {
     pollfd fds = {.fd = fd, .events = POLLIN};
     return TEMP_FAILURE_RETRY(poll(&fds, 1, timeoutMs));
@@ -314,10 +345,17 @@ bool DnsTlsSocket::sslWrite(const Slice buffer) {
     return true;
 }
 
+std::chrono::milliseconds DnsTlsSocket::getIdleTimeout() {
+    std::chrono::milliseconds timeout = mServer.idleTimeout;
+    if (mServerIdleTimeout) {
+        timeout = std::min(timeout, *mServerIdleTimeout);
+    }
+    return std::max<std::chrono::milliseconds>(timeout, kMinIdleTimeout);
+}
+
 void DnsTlsSocket::loop() {
     std::lock_guard guard(mLock);
     std::deque<std::vector<uint8_t>> q;
-    const int timeout_msecs = DnsTlsSocket::kIdleTimeout.count() * 1000;
 
     Fwmark mark;
     mark.intValue = mMark;
@@ -342,6 +380,9 @@ void DnsTlsSocket::loop() {
             fds[EVENTFD].events = POLLIN;
         }
 
+        const std::chrono::milliseconds timeout =
+                (q.empty() && mPendingResponses == 0) ? getIdleTimeout() : kPendingQueryTimeout;
+        const int timeout_msecs = timeout.count();
         const int s = TEMP_FAILURE_RETRY(poll(fds, std::size(fds), timeout_msecs));
         if (s == 0) {
             LOG(DEBUG) << "Idle timeout";
@@ -414,21 +455,54 @@ DnsTlsSocket::~DnsTlsSocket() {
     LOG(DEBUG) << "Destructor completed";
 }
 
-bool DnsTlsSocket::query(uint16_t id, const Slice query) {
-    // Compose the entire message in a single buffer, so that it can be
-    // sent as a single TLS record.
+// static
+std::vector<uint8_t> DnsTlsSocket::makeQueryMessage(uint16_t id, const Slice query) {
     std::vector<uint8_t> buf(query.size() + 4);
-    // Write 2-byte length
-    uint16_t len = query.size() + 2;  // + 2 for the ID.
-    buf[0] = len >> 8;
-    buf[1] = len;
     // Write 2-byte ID
     buf[2] = id >> 8;
     buf[3] = id;
     // Copy body
     std::memcpy(buf.data() + 4, query.base(), query.size());
+    // Ask the server for its idle timeout.
+    addTcpKeepaliveOption(&buf, 2);
+    // Write 2-byte length
+    const uint16_t len = buf.size() - 2;  // The ID and the body.
+    buf[0] = len >> 8;
+    buf[1] = len;
+    return buf;
+}
+
+// static
+std::optional<std::chrono::milliseconds> DnsTlsSocket::getTcpKeepaliveTimeout(
+        const std::vector<uint8_t>& msg) {
+    ns_msg handle;
+    if (ns_initparse(msg.data(), msg.size(), &handle) < 0) return std::nullopt;
+    for (int i = 0; i < ns_msg_count(handle, ns_s_ar); i++) {
+        ns_rr rr;
+        if (ns_parserr(&handle, ns_s_ar, i, &rr) < 0) return std::nullopt;
+        if (ns_rr_type(rr) != ns_t_opt) continue;
+
+        const uint8_t* cp = ns_rr_rdata(rr);
+        const uint8_t* const end = cp + ns_rr_rdlen(rr);
+        while (end - cp >= 2 * INT16SZ) {
+            const uint16_t code = (cp[0] << 8) | cp[1];
+            const uint16_t len = (cp[2] << 8) | cp[3];
+            cp += 2 * INT16SZ;
+            if (len > end - cp) break;
+            if (code == kEdnsTcpKeepalive && len == INT16SZ) {
+                // The timeout is in units of 100 milliseconds.
+                return std::chrono::milliseconds(((cp[0] << 8) | cp[1]) * 100);
+            }
+            cp += len;
+        }
+    }
+    return std::nullopt;
+}
 
-    mQueue.push(std::move(buf));
+bool DnsTlsSocket::query(uint16_t id, const Slice query) {
+    // Compose the entire message in a single buffer, so that it can be
+    // sent as a single TLS record.
+    mQueue.push(makeQueryMessage(id, query));
     // Increment the mEventFd counter by 1.
     return incrementEventFd(1);
 }
@@ -490,6 +564,7 @@ bool DnsTlsSocket::sendQuery(const std::vector<uint8_t>& buf) {
         return false;
     }
     LOG(DEBUG) << mMark << " SSL_write complete";
+    mPendingResponses++;
     return true;
 }
 
@@ -526,6 +601,15 @@ bool DnsTlsSocket::readResponse() {
     }
     LOG(DEBUG) << mMark << " SSL_read complete";
 
+    if (const auto timeout = getTcpKeepaliveTimeout(response); timeout) {
+        if (timeout != mServerIdleTimeout) {
+            LOG(DEBUG) << mMark << " Server idle timeout is " << timeout->count() << "ms";
+        }
+        mServerIdleTimeout = timeout;
+    }
+    if (mPendingResponses > 0) {
+        mPendingResponses--;
+    }
     mObserver->onResponse(std::move(response));
     return true;
 }
@@ -18,8 +18,11 @@
 #define _DNS_DNSTLSSOCKET_H
 
 #include <openssl/ssl.h>
+#include <chrono>
 #include <future>
 #include <mutex>
+#include <optional>
+#include <vector>
 
 #include <android-base/thread_annotations.h>
 #include <android-base/unique_fd.h>
@@ -38,7 +41,9 @@ class DnsTlsSessionCache;
 
 // A class for managing a TLS socket that sends and receives messages in
 // [length][value] format, with a 2-byte length (i.e. DNS-over-TCP format).
-// This class is not aware of query-response pairing or anything else about DNS.
+// This class is not aware of query-response pairing.  The only DNS it knows about is the
+// edns-tcp-keepalive option (RFC 7828), which it adds to queries and reads from responses
+// to learn the server's idle timeout.
 // For the observer:
 // This class is not re-entrant: the observer is not permitted to wait for a call to query()
 // or the destructor in a callback.  Doing so will result in deadlocks.
@@ -64,6 +69,16 @@ class DnsTlsSocket : public IDnsTlsSocket {
     // Thread-safe.
     bool query(uint16_t id, const netdutils::Slice query) override EXCLUDES(mLock);
 
+    // Returns the message that query() sends for |query| with |id|: the 2-byte length, the ID
+    // and the body, with an edns-tcp-keepalive option appended to the OPT record of the body if
+    // it ends with one.  Public for testing.
+    static std::vector<uint8_t> makeQueryMessage(uint16_t id, const netdutils::Slice query);
+
+    // Returns the timeout of the edns-tcp-keepalive option in the DNS message |msg|, if any.
+    // Public for testing.
+    static std::optional<std::chrono::milliseconds> getTcpKeepaliveTimeout(
+            const std::vector<uint8_t>& msg);
+
   private:
     // Lock to be held by the SSL event loop thread.  This is not normally in contention.
     std::mutex mLock;
@@ -125,7 +140,13 @@ class DnsTlsSocket : public IDnsTlsSocket {
     bssl::UniquePtr<SSL_CTX> mSslCtx GUARDED_BY(mLock);
     base::unique_fd mSslFd GUARDED_BY(mLock);
     bssl::UniquePtr<SSL> mSsl GUARDED_BY(mLock);
-    static constexpr std::chrono::seconds kIdleTimeout = std::chrono::seconds(20);
+
+    // The idle timeout announced by the server in an edns-tcp-keepalive option, if any.
+    std::optional<std::chrono::milliseconds> mServerIdleTimeout GUARDED_BY(mLock);
+    // Returns how long the connection may stay idle before loop() closes it.
+    std::chrono::milliseconds getIdleTimeout() REQUIRES(mLock);
+    // Number of queries sent on this connection that have not been answered yet.
+    int mPendingResponses GUARDED_BY(mLock) = 0;
 
     const unsigned mMark;  // Socket mark
     const DnsTlsServer mServer;
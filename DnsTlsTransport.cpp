@@ -25,7 +25,8 @@
 #include <arpa/nameser.h>
 #include <netdutils/ThreadUtil.h>
 
-#include "DnsTlsSocketFactory.h"
+#include <algorithm>
+
 #include "IDnsTlsSocketFactory.h"
 
 namespace android {
@@ -33,6 +34,9 @@ namespace net {
 
 std::future<DnsTlsTransport::Result> DnsTlsTransport::query(const netdutils::Slice query) {
     std::lock_guard guard(mLock);
+    const auto now = std::chrono::steady_clock::now();
+    updateIdleTimeoutLocked(now);
+    moveStalledQueriesLocked(now);
 
     auto record = mQueries.recordQuery(query);
     if (!record) {
@@ -41,7 +45,7 @@ std::future<DnsTlsTransport::Result> DnsTlsTransport::query(const netdutils::Sli
         });
     }
 
-    if (!mSocket) {
+    if (!mConnection) {
         LOG(DEBUG) << "No socket for query.  Opening socket and sending.";
         doConnect();
     } else {
@@ -53,45 +57,119 @@ std::future<DnsTlsTransport::Result> DnsTlsTransport::query(const netdutils::Sli
 
 bool DnsTlsTransport::sendQuery(const DnsTlsQueryMap::Query q) {
     // Strip off the ID number and send the new ID instead.
-    bool sent = mSocket->query(q.newId, netdutils::drop(q.query, 2));
+    bool sent = mConnection->socket->query(q.newId, netdutils::drop(q.query, 2));
     if (sent) {
         mQueries.markTried(q.newId);
     }
     return sent;
 }
 
-void DnsTlsTransport::doConnect() {
+std::chrono::milliseconds DnsTlsTransport::updateIdleTimeout(
+        std::chrono::steady_clock::time_point now) {
+    std::lock_guard guard(mLock);
+    updateIdleTimeoutLocked(now);
+    return mIdleTimeout;
+}
+
+void DnsTlsTransport::updateIdleTimeoutLocked(std::chrono::steady_clock::time_point now) {
+    if (mLastQueryTime != std::chrono::steady_clock::time_point()) {
+        const auto gap =
+                std::chrono::duration_cast<std::chrono::milliseconds>(now - mLastQueryTime);
+        if (gap > kMaxIdleTimeout) {
+            mIdleTimeout = DnsTlsServer().idleTimeout;
+        } else if (gap > mIdleTimeout) {
+            // The connection was probably closed just before this query.  Keep the next one
+            // open for a while longer than this gap.
+            mIdleTimeout = std::min<std::chrono::milliseconds>(gap * 3 / 2, kMaxIdleTimeout);
+            LOG(DEBUG) << "Idle timeout raised to " << mIdleTimeout.count() << "ms";
+        }
+    }
+    mLastQueryTime = now;
+}
+
+std::unique_ptr<DnsTlsTransport::Connection> DnsTlsTransport::connect() {
     LOG(DEBUG) << "Constructing new socket";
-    mSocket = mFactory->createDnsTlsSocket(mServer, mMark, this, &mCache);
-
-    if (mSocket) {
-        auto queries = mQueries.getAll();
-        LOG(DEBUG) << "Initialization succeeded.  Reissuing " << queries.size() << " queries.";
-        for(auto& q : queries) {
-            if (!sendQuery(q)) {
-                break;
-            }
+    DnsTlsServer server = mServer;
+    server.idleTimeout = mIdleTimeout;
+    auto connection = std::make_unique<Connection>(this);
+    connection->socket = mFactory->createDnsTlsSocket(server, mMark, connection.get(), &mCache);
+    if (!connection->socket) {
+        LOG(DEBUG) << "Initialization failed.";
+        return nullptr;
+    }
+    return connection;
+}
+
+void DnsTlsTransport::reissueQueries() {
+    auto queries = mQueries.getAll();
+    LOG(DEBUG) << "Reissuing " << queries.size() << " queries.";
+    for (auto& q : queries) {
+        if (!sendQuery(q)) {
+            break;
         }
+    }
+}
+
+void DnsTlsTransport::doConnect() {
+    mConnection = connect();
+    if (mConnection) {
+        reissueQueries();
     } else {
-        LOG(DEBUG) << "Initialization failed.";
-        mSocket.reset();
         LOG(DEBUG) << "Failing all pending queries.";
         mQueries.clear();
     }
 }
 
-void DnsTlsTransport::onResponse(std::vector<uint8_t> response) {
-    mQueries.onResponse(std::move(response));
+void DnsTlsTransport::moveStalledQueries() {
+    std::lock_guard guard(mLock);
+    moveStalledQueriesLocked(std::chrono::steady_clock::now());
+}
+
+void DnsTlsTransport::moveStalledQueriesLocked(std::chrono::steady_clock::time_point now) {
+    // A closed connection is already being replaced by doReconnect().
+    if (!mConnection || mConnection->closed || !mQueries.hasStalledQuery(now - mStallTimeout)) {
+        return;
+    }
+    // The loops of closed connections are done, so destroying them can't wait for mLock.
+    mStalledConnections.erase(
+            std::remove_if(mStalledConnections.begin(), mStalledConnections.end(),
+                           [](const auto& c) { return c->closed; }),
+            mStalledConnections.end());
+    if (mStalledConnections.size() >= kMaxStalledConnections) {
+        return;
+    }
+    LOG(DEBUG) << "Connection stalled.  Moving pending queries to a new connection.";
+    auto connection = connect();
+    if (!connection) {
+        // Keep waiting on the stalled connection.
+        return;
+    }
+    mConnection->stalled = true;
+    mStalledConnections.push_back(std::move(mConnection));
+    mConnection = std::move(connection);
+    // Queries sent kMaxTries times are given up rather than sent again.
+    mQueries.cleanup(now);
+    reissueQueries();
+}
+
+void DnsTlsTransport::Connection::onResponse(std::vector<uint8_t> response) {
+    transport->mQueries.onResponse(std::move(response), stalled);
+}
+
+void DnsTlsTransport::Connection::onClosed() {
+    transport->onClosed(this);
 }
 
-void DnsTlsTransport::onClosed() {
+void DnsTlsTransport::onClosed(Connection* connection) {
     std::lock_guard guard(mLock);
-    if (mClosing) {
+    connection->closed = true;
+    if (mClosing || connection != mConnection.get()) {
+        // Stalled connections are not reopened: their queries are on the current one.
         return;
     }
     // Move remaining operations to a new thread.
     // This is necessary because
-    // 1. onClosed is currently running on a thread that blocks mSocket's destructor
+    // 1. onClosed is currently running on a thread that blocks the socket's destructor
     // 2. doReconnect will call that destructor
     if (mReconnectThread) {
         // Complete cleanup of a previous reconnect thread, if present.
@@ -118,7 +196,7 @@ void DnsTlsTransport::doReconnect() {
         doConnect();
     } else {
         LOG(DEBUG) << "No pending queries.  Going idle.";
-        mSocket.reset();
+        mConnection.reset();
     }
 }
 
@@ -138,16 +216,14 @@ DnsTlsTransport::~DnsTlsTransport() {
         mReconnectThread->join();
         mReconnectThread.reset();
     }
-    // Ensure that the socket is destroyed, and can clean up its callback threads,
+    // Ensure that the sockets are destroyed, and can clean up their callback threads,
     // before any of this object's fields become invalid.
-    mSocket.reset();
+    mConnection.reset();
+    mStalledConnections.clear();
     LOG(DEBUG) << "Destructor completed";
 }
 
-// static
-// TODO: Use this function to preheat the session cache.
-// That may require moving it to DnsTlsDispatcher.
-bool DnsTlsTransport::validate(const DnsTlsServer& server, unsigned netid, uint32_t mark) {
+bool DnsTlsTransport::validate(unsigned netid) {
     LOG(DEBUG) << "Beginning validation on " << netid;
     // Generate "<random>-dnsotls-ds.metric.gstatic.com", which we will lookup through |ss| in
     // order to prove that it is actually a working DNS over TLS server.
@@ -180,9 +256,7 @@ bool DnsTlsTransport::validate(const DnsTlsServer& server, unsigned netid, uint3
     const int qlen = std::size(query);
 
     int replylen = 0;
-    DnsTlsSocketFactory factory;
-    DnsTlsTransport transport(server, mark, &factory);
-    auto r = transport.query(netdutils::Slice(query, qlen)).get();
+    auto r = this->query(netdutils::Slice(query, qlen)).get();
     if (r.code != Response::success) {
         LOG(DEBUG) << "query failed";
         return false;
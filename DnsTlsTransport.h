@@ -17,6 +17,8 @@
 #ifndef _DNS_DNSTLSTRANSPORT_H
 #define _DNS_DNSTLSTRANSPORT_H
 
+#include <atomic>
+#include <chrono>
 #include <future>
 #include <map>
 #include <mutex>
@@ -37,13 +39,20 @@ namespace net {
 
 class IDnsTlsSocketFactory;
 
-// Manages at most one DnsTlsSocket at a time.  This class handles socket lifetime issues,
-// such as reopening the socket and reissuing pending queries.
-class DnsTlsTransport : public IDnsTlsSocketObserver {
+// Manages the DnsTlsSockets to one server.  This class handles socket lifetime issues,
+// such as reopening the socket and reissuing pending queries.  Queries are sent on the current
+// socket.  If it stops answering, the pending queries are reissued on a new socket, which becomes
+// the current one, and the stalled socket is kept until it closes in case it answers first.
+class DnsTlsTransport {
   public:
     DnsTlsTransport(const DnsTlsServer& server, unsigned mark,
-                    IDnsTlsSocketFactory* _Nonnull factory)
-        : mMark(mark), mServer(server), mFactory(factory) {}
+                    IDnsTlsSocketFactory* _Nonnull factory,
+                    std::chrono::milliseconds stallTimeout = kStallTimeout)
+        : mCache(server),
+          mMark(mark),
+          mServer(server),
+          mFactory(factory),
+          mStallTimeout(stallTimeout) {}
     ~DnsTlsTransport();
 
     typedef DnsTlsServer::Response Response;
@@ -52,18 +61,40 @@ class DnsTlsTransport : public IDnsTlsSocketObserver {
     // Given a |query|, this method sends it to the server and returns the result asynchronously.
     std::future<Result> query(const netdutils::Slice query) EXCLUDES(mLock);
 
-    // Check that a given TLS server is fully working on the specified netid.
-    // This function is used in ResolverController to ensure that we don't enable DNS over TLS
-    // on networks where it doesn't actually work.
-    static bool validate(const DnsTlsServer& server, unsigned netid, uint32_t mark);
+    // Check that the TLS server of this transport is fully working on the specified netid.
+    // This function is used in PrivateDnsConfiguration to ensure that we don't enable DNS over
+    // TLS on networks where it doesn't actually work. The connection is kept for later queries.
+    bool validate(unsigned netid) EXCLUDES(mLock);
 
-    // Implement IDnsTlsSocketObserver
-    void onResponse(std::vector<uint8_t> response) override;
-    void onClosed() override EXCLUDES(mLock);
+    // Accounts for a query sent at |now| and returns the idle timeout of the next connection.
+    // query() does this for each query.  Public for testing.
+    std::chrono::milliseconds updateIdleTimeout(std::chrono::steady_clock::time_point now)
+            EXCLUDES(mLock);
+
+    // Moves the pending queries to a new socket if a query has been sent on the current one for
+    // longer than the stall timeout without an answer.  query() does this for each query, and
+    // callers waiting for a result do it every stallTimeout().
+    void moveStalledQueries() EXCLUDES(mLock);
+    std::chrono::milliseconds stallTimeout() const { return mStallTimeout; }
 
   private:
     std::mutex mLock;
 
+    // A socket, and the observer of its callbacks, which tells the transport which socket
+    // they come from.
+    struct Connection : public IDnsTlsSocketObserver {
+        explicit Connection(DnsTlsTransport* _Nonnull transport) : transport(transport) {}
+        void onResponse(std::vector<uint8_t> response) override;
+        void onClosed() override;
+
+        DnsTlsTransport* _Nonnull const transport;
+        // Set when the pending queries are moved away from this connection.
+        std::atomic<bool> stalled = false;
+        // Set by onClosed(), with the transport's mLock held.
+        bool closed = false;
+        std::unique_ptr<IDnsTlsSocket> socket;
+    };
+
     DnsTlsSessionCache mCache;
     DnsTlsQueryMap mQueries;
 
@@ -72,6 +103,20 @@ class DnsTlsTransport : public IDnsTlsSocketObserver {
     IDnsTlsSocketFactory* _Nonnull const mFactory;
 
     void doConnect() REQUIRES(mLock);
+    // Opens a new connection, or returns null if that fails.
+    std::unique_ptr<Connection> connect() REQUIRES(mLock);
+    // Sends all the pending queries on the current connection.
+    void reissueQueries() REQUIRES(mLock);
+    void moveStalledQueriesLocked(std::chrono::steady_clock::time_point now) REQUIRES(mLock);
+    void onClosed(Connection* _Nonnull connection) EXCLUDES(mLock);
+
+    // The idle timeout of the next connection.  It grows to cover the gaps between bursts of
+    // queries that are longer than the current timeout, up to kMaxIdleTimeout, so that bursty
+    // traffic finds a warm connection.  Gaps longer than that reset it to the default.
+    std::chrono::milliseconds mIdleTimeout GUARDED_BY(mLock) = DnsTlsServer().idleTimeout;
+    std::chrono::steady_clock::time_point mLastQueryTime GUARDED_BY(mLock);
+    static constexpr std::chrono::seconds kMaxIdleTimeout{60};
+    void updateIdleTimeoutLocked(std::chrono::steady_clock::time_point now) REQUIRES(mLock);
 
     // doReconnect is used by onClosed.  It runs on the reconnect thread.
     void doReconnect() EXCLUDES(mLock);
@@ -81,7 +126,19 @@ class DnsTlsTransport : public IDnsTlsSocketObserver {
     bool mClosing GUARDED_BY(mLock) = false;
 
     // Sending queries on the socket is thread-safe, but construction/destruction is not.
-    std::unique_ptr<IDnsTlsSocket> mSocket GUARDED_BY(mLock);
+    std::unique_ptr<Connection> mConnection GUARDED_BY(mLock);
+
+    // Connections that the pending queries were moved away from.  Their answers are still used,
+    // until they close on their own.  Closed ones are destroyed at the next move.
+    std::vector<std::unique_ptr<Connection>> mStalledConnections GUARDED_BY(mLock);
+    // Beyond this many stalled connections, queries wait instead of being moved again.
+    static constexpr size_t kMaxStalledConnections = 2;
+
+    // How long a query may go unanswered before its connection is considered stalled.  This is
+    // the largest slow query threshold of DnsTlsDispatcher, beyond which query hedging doesn't
+    // help either.
+    static constexpr std::chrono::milliseconds kStallTimeout{2000};
+    const std::chrono::milliseconds mStallTimeout;
 
     // Send a query to the socket.
     bool sendQuery(const DnsTlsQueryMap::Query q) REQUIRES(mLock);
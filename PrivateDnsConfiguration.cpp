@@ -18,16 +18,18 @@
 
 #include "PrivateDnsConfiguration.h"
 
+#include <algorithm>
+
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <netdb.h>
 #include <netdutils/ThreadUtil.h>
 #include <sys/socket.h>
 
+#include "DnsTlsDispatcher.h"
 #include "DnsTlsTransport.h"
 #include "ResolverEventReporter.h"
 #include "netd_resolv/resolv.h"
-#include "netdutils/BackoffSequence.h"
 #include "resolv_cache.h"
 
 using std::chrono::milliseconds;
@@ -60,6 +62,13 @@ bool parseServer(const char* server, sockaddr_storage* parsed) {
     return true;
 }
 
+PrivateDnsConfiguration::PrivateDnsConfiguration()
+    : PrivateDnsConfiguration(DnsTlsDispatcher::getInstance(), kValidationThreadIdleTimeout) {}
+
+PrivateDnsConfiguration::PrivateDnsConfiguration(DnsTlsDispatcher& dispatcher,
+                                                 milliseconds validationThreadIdleTimeout)
+    : mDispatcher(dispatcher), mValidationThreadIdleTimeout(validationThreadIdleTimeout) {}
+
 int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
                                  const std::vector<std::string>& servers, const std::string& name,
                                  const std::string& caCert, int32_t connectTimeoutMs) {
@@ -89,6 +98,8 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
     }
 
     std::lock_guard guard(mPrivateDnsLock);
+    // Let the queries waiting for a validated server see the new mode.
+    mValidationCv.notify_all();
     if (!name.empty()) {
         mPrivateDnsModes[netId] = PrivateDnsMode::STRICT;
     } else if (!tlsServers.empty()) {
@@ -96,8 +107,10 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
     } else {
         mPrivateDnsModes[netId] = PrivateDnsMode::OFF;
         mPrivateDnsTransports.erase(netId);
+        publishSnapshotLocked(netId);
         resolv_stats_set_servers_for_dot(netId, {});
         mPrivateDnsValidateThreads.erase(netId);
+        dropQueuedValidations(netId);
         return 0;
     }
 
@@ -109,6 +122,7 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
         std::tie(netPair, added) = mPrivateDnsTransports.emplace(netId, PrivateDnsTracker());
         if (!added) {
             LOG(ERROR) << "Memory error while recording private DNS for netId " << netId;
+            publishSnapshotLocked(netId);
             return -ENOMEM;
         }
     }
@@ -129,6 +143,7 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
             validatePrivateDnsProvider(server, tracker, netId, mark);
         }
     }
+    publishSnapshotLocked(netId);
 
     return resolv_stats_set_servers_for_dot(netId, servers);
 }
@@ -151,12 +166,68 @@ PrivateDnsStatus PrivateDnsConfiguration::getStatus(unsigned netId) {
     return status;
 }
 
+std::shared_ptr<const PrivateDnsSnapshot> PrivateDnsConfiguration::getSnapshot(
+        unsigned netId) const {
+    static const auto kOff = std::make_shared<const PrivateDnsSnapshot>();
+    const auto snapshots = std::atomic_load(&mSnapshots);
+    const auto it = snapshots->find(netId);
+    return (it != snapshots->end()) ? it->second : kOff;
+}
+
+bool PrivateDnsConfiguration::hasValidatedServer(unsigned netId) const {
+    return !getSnapshot(netId)->validatedServers.empty();
+}
+
+void PrivateDnsConfiguration::publishSnapshotLocked(unsigned netId) {
+    auto snapshots = std::make_shared<SnapshotMap>(*mSnapshots);
+    const auto mode = mPrivateDnsModes.find(netId);
+    if (mode == mPrivateDnsModes.end()) {
+        snapshots->erase(netId);
+    } else {
+        auto snapshot = std::make_shared<PrivateDnsSnapshot>();
+        snapshot->mode = mode->second;
+        const auto netPair = mPrivateDnsTransports.find(netId);
+        if (netPair != mPrivateDnsTransports.end()) {
+            for (const auto& [server, validation] : netPair->second) {
+                if (validation == Validation::success) snapshot->validatedServers.push_back(server);
+            }
+        }
+        (*snapshots)[netId] = std::move(snapshot);
+    }
+    std::atomic_store(&mSnapshots, std::shared_ptr<const SnapshotMap>(std::move(snapshots)));
+}
+
+bool PrivateDnsConfiguration::hasValidatedServerLocked(unsigned netId) {
+    const auto netPair = mPrivateDnsTransports.find(netId);
+    if (netPair == mPrivateDnsTransports.end()) return false;
+    return std::any_of(netPair->second.begin(), netPair->second.end(), [](const auto& serverPair) {
+        return serverPair.second == Validation::success;
+    });
+}
+
+bool PrivateDnsConfiguration::waitForValidatedServer(unsigned netId, milliseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock lock(mPrivateDnsLock);
+    android::base::ScopedLockAssertion assume_lock(mPrivateDnsLock);
+    while (!hasValidatedServerLocked(netId)) {
+        const auto mode = mPrivateDnsModes.find(netId);
+        if (mode == mPrivateDnsModes.end() || mode->second != PrivateDnsMode::STRICT) return false;
+        if (mValidationCv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            return hasValidatedServerLocked(netId);
+        }
+    }
+    return true;
+}
+
 void PrivateDnsConfiguration::clear(unsigned netId) {
     LOG(DEBUG) << "PrivateDnsConfiguration::clear(" << netId << ")";
     std::lock_guard guard(mPrivateDnsLock);
+    mValidationCv.notify_all();
     mPrivateDnsModes.erase(netId);
     mPrivateDnsTransports.erase(netId);
     mPrivateDnsValidateThreads.erase(netId);
+    dropQueuedValidations(netId);
+    publishSnapshotLocked(netId);
 }
 
 void PrivateDnsConfiguration::validatePrivateDnsProvider(const DnsTlsServer& server,
@@ -170,50 +241,150 @@ void PrivateDnsConfiguration::validatePrivateDnsProvider(const DnsTlsServer& ser
         return;
     }
 
-    // Note that capturing |server| and |netId| in this lambda create copies.
-    std::thread validate_thread([this, server, netId, mark] {
-        netdutils::setThreadName(android::base::StringPrintf("TlsVerify_%u", netId).c_str());
+    // cat /proc/sys/net/ipv4/tcp_syn_retries yields "6".
+    //
+    // Start with a 1 minute delay and backoff to once per hour.
+    //
+    // Assumptions:
+    //     [1] Each TLS validation is ~10KB of certs+handshake+payload.
+    //     [2] Network typically provision clients with <=4 nameservers.
+    //     [3] Average month has 30 days.
+    //
+    // Each validation pass in a given hour is ~1.2MB of data. And 24
+    // such validation passes per day is about ~30MB per month, in the
+    // worst case. Otherwise, this will cost ~600 SYNs per month
+    // (6 SYNs per ip, 4 ips per validation pass, 24 passes per day).
+    auto backoff = netdutils::BackoffSequence<>::Builder()
+                           .withInitialRetransmissionTime(std::chrono::seconds(60))
+                           .withMaximumRetransmissionTime(std::chrono::seconds(3600))
+                           .build();
+    scheduleValidation({server, netId, mark, std::move(backoff)}, std::chrono::steady_clock::now());
+}
 
-        // cat /proc/sys/net/ipv4/tcp_syn_retries yields "6".
-        //
-        // Start with a 1 minute delay and backoff to once per hour.
-        //
-        // Assumptions:
-        //     [1] Each TLS validation is ~10KB of certs+handshake+payload.
-        //     [2] Network typically provision clients with <=4 nameservers.
-        //     [3] Average month has 30 days.
-        //
-        // Each validation pass in a given hour is ~1.2MB of data. And 24
-        // such validation passes per day is about ~30MB per month, in the
-        // worst case. Otherwise, this will cost ~600 SYNs per month
-        // (6 SYNs per ip, 4 ips per validation pass, 24 passes per day).
-        auto backoff = netdutils::BackoffSequence<>::Builder()
-                               .withInitialRetransmissionTime(std::chrono::seconds(60))
-                               .withMaximumRetransmissionTime(std::chrono::seconds(3600))
-                               .build();
-
-        while (true) {
-            // ::validate() is a blocking call that performs network operations.
-            // It can take milliseconds to minutes, up to the SYN retry limit.
-            LOG(WARNING) << "Validating DnsTlsServer on netId " << netId;
-            const bool success = DnsTlsTransport::validate(server, netId, mark);
-            LOG(DEBUG) << "validateDnsTlsServer returned " << success << " for "
-                       << addrToString(&server.ss);
-
-            const bool needs_reeval = this->recordPrivateDnsValidation(server, netId, success);
-            if (!needs_reeval) {
-                break;
-            }
+void PrivateDnsConfiguration::scheduleValidation(ValidationTask task,
+                                                 std::chrono::steady_clock::time_point due) {
+    std::lock_guard guard(mValidationLock);
+    mValidationQueue.emplace(due, std::move(task));
+    startValidationThreadsLocked(std::chrono::steady_clock::now());
+    // Idle threads may be waiting for a later task.
+    mValidationQueueCv.notify_all();
+}
+
+PrivateDnsConfiguration::ValidationQueue::iterator
+PrivateDnsConfiguration::findRunnableValidationLocked(std::chrono::steady_clock::time_point now) {
+    for (auto it = mValidationQueue.begin(); it != mValidationQueue.end() && it->first <= now;
+         ++it) {
+        const auto running = mRunningValidations.find(it->second.netId);
+        if (running == mRunningValidations.end() || running->second < kMaxValidationsPerNetwork) {
+            return it;
+        }
+    }
+    return mValidationQueue.end();
+}
+
+void PrivateDnsConfiguration::startValidationThreadsLocked(
+        std::chrono::steady_clock::time_point now) {
+    // Start enough threads to run all the due tasks at once, e.g. all the servers of a network.
+    // A task due later needs one thread to wait for it.
+    std::map<unsigned, int> running = mRunningValidations;
+    int runnable = 0;
+    for (auto it = mValidationQueue.begin(); it != mValidationQueue.end() && it->first <= now;
+         ++it) {
+        if (running[it->second.netId]++ < kMaxValidationsPerNetwork) runnable++;
+    }
+    const int needed = mValidationQueue.empty() ? 0 : std::max(runnable, 1);
+    while (mIdleValidationThreads < needed) {
+        mValidationThreads++;
+        mIdleValidationThreads++;
+        std::thread(&PrivateDnsConfiguration::runValidations, this).detach();
+    }
+}
+
+void PrivateDnsConfiguration::dropQueuedValidations(unsigned netId) {
+    std::lock_guard guard(mValidationLock);
+    for (auto it = mValidationQueue.begin(); it != mValidationQueue.end();) {
+        it = (it->second.netId == netId) ? mValidationQueue.erase(it) : std::next(it);
+    }
+    // Threads waiting for the dropped tasks may exit.
+    mValidationQueueCv.notify_all();
+}
 
-            if (backoff.hasNextTimeout()) {
-                std::this_thread::sleep_for(backoff.getNextTimeout());
+int PrivateDnsConfiguration::validationThreads() {
+    std::lock_guard guard(mValidationLock);
+    return mValidationThreads;
+}
+
+size_t PrivateDnsConfiguration::queuedValidations() {
+    std::lock_guard guard(mValidationLock);
+    return mValidationQueue.size();
+}
+
+void PrivateDnsConfiguration::runValidations() {
+    std::unique_lock lock(mValidationLock);
+    android::base::ScopedLockAssertion assume_lock(mValidationLock);
+    // This thread is counted as idle from the time it is started, and after each task.
+    while (true) {
+        const auto idleDeadline = std::chrono::steady_clock::now() + mValidationThreadIdleTimeout;
+        auto next = mValidationQueue.end();
+        while ((next = findRunnableValidationLocked(std::chrono::steady_clock::now())) ==
+               mValidationQueue.end()) {
+            const auto now = std::chrono::steady_clock::now();
+            // Keep one thread to run the queued tasks when they are due.
+            const bool lastForQueuedTask =
+                    !mValidationQueue.empty() && mIdleValidationThreads == 1;
+            if (now >= idleDeadline && !lastForQueuedTask) {
+                mIdleValidationThreads--;
+                mValidationThreads--;
+                return;
+            }
+            // Tasks that are due but wait for another validation of their network are signalled
+            // when it ends. Otherwise, wake up for the next task, or to exit.
+            const auto later = mValidationQueue.upper_bound(now);
+            if (later != mValidationQueue.end() &&
+                (lastForQueuedTask || later->first < idleDeadline)) {
+                mValidationQueueCv.wait_until(lock, later->first);
+            } else if (lastForQueuedTask) {
+                mValidationQueueCv.wait(lock);
             } else {
-                break;
+                mValidationQueueCv.wait_until(lock, idleDeadline);
             }
         }
-        this->cleanValidateThreadTracker(server, netId);
-    });
-    validate_thread.detach();
+        mIdleValidationThreads--;
+        ValidationTask task = std::move(next->second);
+        mValidationQueue.erase(next);
+        const unsigned netId = task.netId;
+        mRunningValidations[netId]++;
+        // Other tasks may be due as well.
+        startValidationThreadsLocked(std::chrono::steady_clock::now());
+        lock.unlock();
+
+        netdutils::setThreadName(android::base::StringPrintf("TlsVerify_%u", netId).c_str());
+        // ::validate() is a blocking call that performs network operations.
+        // It can take milliseconds to minutes, up to the SYN retry limit.
+        LOG(WARNING) << "Validating DnsTlsServer on netId " << netId;
+        const bool success = mDispatcher.validate(task.server, netId, task.mark);
+        LOG(DEBUG) << "validateDnsTlsServer returned " << success << " for "
+                   << addrToString(&task.server.ss);
+
+        const bool needs_reeval = recordPrivateDnsValidation(task.server, netId, success);
+        if (needs_reeval && task.backoff.hasNextTimeout()) {
+            const auto due = std::chrono::steady_clock::now() + task.backoff.getNextTimeout();
+            // The queued tasks of a network are dropped when it is cleared, which may have
+            // happened since the result was recorded.
+            std::lock_guard guard(mPrivateDnsLock);
+            lock.lock();
+            if (mPrivateDnsTransports.count(netId) != 0) {
+                mValidationQueue.emplace(due, std::move(task));
+            }
+        } else {
+            cleanValidateThreadTracker(task.server, netId);
+            lock.lock();
+        }
+        if (--mRunningValidations[netId] == 0) mRunningValidations.erase(netId);
+        mIdleValidationThreads++;
+        // A task of the same network may have been waiting for this validation to end.
+        mValidationQueueCv.notify_all();
+    }
 }
 
 bool PrivateDnsConfiguration::recordPrivateDnsValidation(const DnsTlsServer& server, unsigned netId,
@@ -274,6 +445,7 @@ bool PrivateDnsConfiguration::recordPrivateDnsValidation(const DnsTlsServer& ser
 
     if (success) {
         tracker[server] = Validation::success;
+        mValidationCv.notify_all();
     } else {
         // Validation failure is expected if a user is on a captive portal.
         // TODO: Trigger a second validation attempt after captive portal login
@@ -281,6 +453,7 @@ bool PrivateDnsConfiguration::recordPrivateDnsValidation(const DnsTlsServer& ser
         tracker[server] = (reevaluationStatus == NEEDS_REEVALUATION) ? Validation::in_process
                                                                      : Validation::fail;
     }
+    publishSnapshotLocked(netId);
     LOG(WARNING) << "Validation " << (success ? "success" : "failed");
 
     return reevaluationStatus;
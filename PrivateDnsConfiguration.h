@@ -16,12 +16,16 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
+#include <netdutils/BackoffSequence.h>
 
 #include "DnsTlsServer.h"
 
@@ -31,6 +35,8 @@ namespace net {
 // The DNS over TLS mode on a specific netId.
 enum class PrivateDnsMode : uint8_t { OFF, OPPORTUNISTIC, STRICT };
 
+class DnsTlsDispatcher;
+
 // Validation status of a DNS over TLS server (on a specific netId).
 enum class Validation : uint8_t { in_process, success, fail, unknown_server, unknown_netid };
 
@@ -50,16 +56,46 @@ struct PrivateDnsStatus {
     }
 };
 
+// Immutable view of the private DNS state of a network, as needed to send a query.
+struct PrivateDnsSnapshot {
+    PrivateDnsMode mode = PrivateDnsMode::OFF;
+    std::list<DnsTlsServer> validatedServers;
+};
+
 class PrivateDnsConfiguration {
   public:
+    PrivateDnsConfiguration();
+
+    // Constructor with dependency injection for testing.
+    PrivateDnsConfiguration(DnsTlsDispatcher& dispatcher,
+                            std::chrono::milliseconds validationThreadIdleTimeout);
+
     int set(int32_t netId, uint32_t mark, const std::vector<std::string>& servers,
             const std::string& name, const std::string& caCert, int32_t connectTimeoutMs)
             EXCLUDES(mPrivateDnsLock);
 
     PrivateDnsStatus getStatus(unsigned netId) EXCLUDES(mPrivateDnsLock);
 
+    // Returns the current private DNS state of |netId| without taking mPrivateDnsLock or copying
+    // any server. The snapshot is replaced, never modified, when the state changes.
+    std::shared_ptr<const PrivateDnsSnapshot> getSnapshot(unsigned netId) const;
+
+    // Returns true if at least one private DNS server of |netId| has been validated. Cheaper than
+    // getStatus() as no server is copied.
+    bool hasValidatedServer(unsigned netId) const;
+
+    // Blocks until a private DNS server of |netId| is validated, the network leaves strict mode,
+    // or |timeout| elapses. Returns true if there is a validated server.
+    bool waitForValidatedServer(unsigned netId, std::chrono::milliseconds timeout)
+            EXCLUDES(mPrivateDnsLock);
+
     void clear(unsigned netId) EXCLUDES(mPrivateDnsLock);
 
+    // Public for testing.
+    int validationThreads() EXCLUDES(mValidationLock);
+    size_t queuedValidations() EXCLUDES(mValidationLock);
+    static constexpr int kMaxValidationsPerNetwork = 4;
+
   private:
     typedef std::map<DnsTlsServer, Validation, AddressComparator> PrivateDnsTracker;
     typedef std::set<DnsTlsServer, AddressComparator> ThreadTracker;
@@ -72,18 +108,71 @@ class PrivateDnsConfiguration {
     bool needValidateThread(const DnsTlsServer& server, unsigned netId) REQUIRES(mPrivateDnsLock);
     void cleanValidateThreadTracker(const DnsTlsServer& server, unsigned netId);
 
+    // Validations are run by a shared pool of threads, in order of due time. A validation can
+    // block up to the SYN retry limit, so at most kMaxValidationsPerNetwork of them run at once
+    // for a network, and the pool grows as needed to run those of the other networks: unreachable
+    // servers can't delay the validation of other networks. A failed validation that needs
+    // reevaluation is queued again after a backoff, instead of keeping a thread asleep. Threads
+    // that stay idle for mValidationThreadIdleTimeout exit, except the last one while a task is
+    // queued.
+    struct ValidationTask {
+        DnsTlsServer server;
+        unsigned netId;
+        uint32_t mark;
+        netdutils::BackoffSequence<> backoff;
+    };
+    using ValidationQueue = std::multimap<std::chrono::steady_clock::time_point, ValidationTask>;
+    void scheduleValidation(ValidationTask task, std::chrono::steady_clock::time_point due)
+            EXCLUDES(mValidationLock);
+    void runValidations() EXCLUDES(mValidationLock);
+    // Returns the first task that is due at |now| and whose network may run one more validation.
+    ValidationQueue::iterator findRunnableValidationLocked(
+            std::chrono::steady_clock::time_point now) REQUIRES(mValidationLock);
+    // Starts threads until there is an idle one for each task that can run at |now|, or for the
+    // next task if none can.
+    void startValidationThreadsLocked(std::chrono::steady_clock::time_point now)
+            REQUIRES(mValidationLock);
+    // Drops the queued validations of |netId|. Running ones end without reevaluation.
+    void dropQueuedValidations(unsigned netId) EXCLUDES(mValidationLock);
+
     // Start validation for newly added servers as well as any servers that have
     // landed in Validation::fail state. Note that servers that have failed
     // multiple validation attempts but for which there is still a validating
     // thread running are marked as being Validation::in_process.
     bool needsValidation(const PrivateDnsTracker& tracker, const DnsTlsServer& server);
 
+    bool hasValidatedServerLocked(unsigned netId) REQUIRES(mPrivateDnsLock);
+
+    // Replaces the snapshot of |netId| to reflect its current mode and validated servers.
+    void publishSnapshotLocked(unsigned netId) REQUIRES(mPrivateDnsLock);
+
     std::mutex mPrivateDnsLock;
+    // Notified when a server is validated, or the mode of a network changes.
+    std::condition_variable mValidationCv;
     std::map<unsigned, PrivateDnsMode> mPrivateDnsModes GUARDED_BY(mPrivateDnsLock);
     // Structure for tracking the validation status of servers on a specific netId.
     // Using the AddressComparator ensures at most one entry per IP address.
     std::map<unsigned, PrivateDnsTracker> mPrivateDnsTransports GUARDED_BY(mPrivateDnsLock);
     std::map<unsigned, ThreadTracker> mPrivateDnsValidateThreads GUARDED_BY(mPrivateDnsLock);
+
+    // Snapshots of the networks, by netId. Written under mPrivateDnsLock, and replaced as a whole
+    // with std::atomic_store() so that readers don't need the lock.
+    using SnapshotMap = std::map<unsigned, std::shared_ptr<const PrivateDnsSnapshot>>;
+    std::shared_ptr<const SnapshotMap> mSnapshots = std::make_shared<const SnapshotMap>();
+
+    DnsTlsDispatcher& mDispatcher;
+
+    static constexpr std::chrono::seconds kValidationThreadIdleTimeout{60};
+    const std::chrono::milliseconds mValidationThreadIdleTimeout;
+    std::mutex mValidationLock;
+    // Notified when a task is queued, or a validation ends.
+    std::condition_variable mValidationQueueCv;
+    ValidationQueue mValidationQueue GUARDED_BY(mValidationLock);
+    // Number of validations running, by netId.
+    std::map<unsigned, int> mRunningValidations GUARDED_BY(mValidationLock);
+    int mValidationThreads GUARDED_BY(mValidationLock) = 0;
+    // Threads that are not running a validation, including those just started.
+    int mIdleValidationThreads GUARDED_BY(mValidationLock) = 0;
 };
 
 extern PrivateDnsConfiguration gPrivateDnsConfiguration;
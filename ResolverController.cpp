@@ -37,7 +37,9 @@
 #include "netd_resolv/stats.h"
 #include "resolv_cache.h"
 
+using aidl::android::net::DnsServerStatsParcel;
 using aidl::android::net::ResolverParamsParcel;
+using aidl::android::net::ResolverStatsSnapshotParcel;
 
 namespace android {
 
@@ -47,6 +49,38 @@ namespace net {
 
 namespace {
 
+// Returns the address of |sockAddr| in network byte order: 4 bytes for IPv4, 16 bytes for IPv6.
+std::string rawAddress(const netdutils::IPSockAddr& sockAddr) {
+    const sockaddr_storage ss = sockAddr;
+    if (ss.ss_family == AF_INET) {
+        const auto& sin = reinterpret_cast<const sockaddr_in&>(ss);
+        return std::string(reinterpret_cast<const char*>(&sin.sin_addr), sizeof(sin.sin_addr));
+    }
+    if (ss.ss_family == AF_INET6) {
+        const auto& sin6 = reinterpret_cast<const sockaddr_in6&>(ss);
+        return std::string(reinterpret_cast<const char*>(&sin6.sin6_addr), sizeof(sin6.sin6_addr));
+    }
+    return "";
+}
+
+DnsServerStatsParcel toDnsServerStatsParcel(Protocol protocol, const StatsData& data) {
+    DnsServerStatsParcel parcel;
+    const std::string address = rawAddress(data.serverSockAddr);
+    parcel.address.assign(address.begin(), address.end());
+    parcel.port = data.serverSockAddr.port();
+    parcel.protocol = protocol;
+    parcel.revision = data.revision;
+    parcel.total = data.total;
+    for (const auto& [rcode, count] : data.rcodeCounts) {
+        if (count == 0) continue;
+        parcel.rcodes.push_back(rcode);
+        parcel.rcodeCounts.push_back(count);
+    }
+    parcel.latencyUsSum = data.latencyUs.count();
+    parcel.latencyHistogram.assign(data.latencyHistogram.begin(), data.latencyHistogram.end());
+    return parcel;
+}
+
 std::string addrToString(const sockaddr_storage* addr) {
     char out[INET6_ADDRSTRLEN] = {0};
     getnameinfo((const sockaddr*)addr, sizeof(sockaddr_storage), out, INET6_ADDRSTRLEN, nullptr, 0,
@@ -65,6 +99,18 @@ const char* getPrivateDnsModeString(PrivateDnsMode mode) {
     }
 }
 
+PrivateDnsModes toPrivateDnsModes(PrivateDnsMode mode) {
+    switch (mode) {
+        case PrivateDnsMode::OFF:
+            return PrivateDnsModes::PDM_OFF;
+        case PrivateDnsMode::OPPORTUNISTIC:
+            return PrivateDnsModes::PDM_OPPORTUNISTIC;
+        case PrivateDnsMode::STRICT:
+            return PrivateDnsModes::PDM_STRICT;
+    }
+    return PrivateDnsModes::PDM_UNKNOWN;
+}
+
 constexpr const char* validationStatusToString(Validation value) {
     switch (value) {
         case Validation::in_process:
@@ -263,6 +309,32 @@ int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>*
     return 0;
 }
 
+int ResolverController::getResolverStatsSnapshot(int32_t netId, int64_t sinceRevision,
+                                                 ResolverStatsSnapshotParcel* snapshot) {
+    if (sinceRevision < 0) return -EINVAL;
+
+    ResolvStatsSnapshot stats;
+    if (int ret = resolv_stats_get_snapshot(netId, sinceRevision, &stats); ret != 0) {
+        return ret;
+    }
+
+    snapshot->netId = netId;
+    snapshot->revision = stats.revision;
+    snapshot->full = stats.full;
+    snapshot->servers.clear();
+    snapshot->servers.reserve(stats.servers.size());
+    for (const auto& [protocol, data] : stats.servers) {
+        snapshot->servers.push_back(toDnsServerStatsParcel(protocol, data));
+    }
+    snapshot->latencyBucketBoundsMs.assign(kLatencyBucketBoundsMs.begin(),
+                                           kLatencyBucketBoundsMs.end());
+    snapshot->cacheEntries = stats.cacheEntries;
+    snapshot->cacheHits = stats.cacheHits;
+    snapshot->cacheMisses = stats.cacheMisses;
+    snapshot->waitForPendingReqTimeoutCount = stats.waitForPendingReqTimeoutCount;
+    return 0;
+}
+
 void ResolverController::startPrefix64Discovery(int32_t netId) {
     mDns64Configuration.startPrefixDiscovery(netId);
 }
@@ -283,7 +355,7 @@ int ResolverController::getPrefix64(unsigned netId, netdutils::IPPrefix* prefix)
     return 0;
 }
 
-void ResolverController::dump(DumpWriter& dw, unsigned netId) {
+void ResolverController::dump(DumpWriter& dw, unsigned netId, uint32_t sections) {
     // No lock needed since Bionic's resolver locks all accessed data structures internally.
     using android::net::ResolverStats;
     std::vector<std::string> servers;
@@ -298,67 +370,135 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
     if (rv != 0) {
         dw.println("getDnsInfo() failed for netid %u", netId);
     } else {
-        if (servers.empty()) {
-            dw.println("No DNS servers defined");
-        } else {
-            dw.println("DnsEvent subsampling map: " +
-                       android::base::Join(resolv_cache_dump_subsampling_map(netId), ' '));
-            dw.println(
-                    "DNS servers: # IP (total, successes, errors, timeouts, internal errors, "
-                    "RTT avg, last sample)");
-            dw.incIndent();
-            for (size_t i = 0; i < servers.size(); ++i) {
-                if (i < stats.size()) {
-                    const ResolverStats& s = stats[i];
-                    int total = s.successes + s.errors + s.timeouts + s.internal_errors;
-                    if (total > 0) {
-                        int time_delta = (s.last_sample_time > 0) ? now - s.last_sample_time : -1;
-                        dw.println("%s (%d, %d, %d, %d, %d, %dms, %ds)%s", servers[i].c_str(),
-                                   total, s.successes, s.errors, s.timeouts, s.internal_errors,
-                                   s.rtt_avg, time_delta, s.usable ? "" : " BROKEN");
+        if (sections & DUMP_CONFIG) {
+            if (servers.empty()) {
+                dw.println("No DNS servers defined");
+            } else {
+                dw.println("DnsEvent subsampling map: " +
+                           android::base::Join(resolv_cache_dump_subsampling_map(netId), ' '));
+                dw.println(
+                        "DNS servers: # IP (total, successes, errors, timeouts, internal errors, "
+                        "RTT avg, last sample)");
+                dw.incIndent();
+                for (size_t i = 0; i < servers.size(); ++i) {
+                    if (i < stats.size()) {
+                        const ResolverStats& s = stats[i];
+                        int total = s.successes + s.errors + s.timeouts + s.internal_errors;
+                        if (total > 0) {
+                            int time_delta =
+                                    (s.last_sample_time > 0) ? now - s.last_sample_time : -1;
+                            dw.println("%s (%d, %d, %d, %d, %d, %dms, %ds)%s",
+                                       servers[i].c_str(), total, s.successes, s.errors,
+                                       s.timeouts, s.internal_errors, s.rtt_avg, time_delta,
+                                       s.usable ? "" : " BROKEN");
+                        } else {
+                            dw.println("%s <no data>", servers[i].c_str());
+                        }
                     } else {
-                        dw.println("%s <no data>", servers[i].c_str());
+                        dw.println("%s <no stats>", servers[i].c_str());
                     }
-                } else {
-                    dw.println("%s <no stats>", servers[i].c_str());
                 }
+                dw.decIndent();
+            }
+            if (domains.empty()) {
+                dw.println("No search domains defined");
+            } else {
+                std::string domains_str = android::base::Join(domains, ", ");
+                dw.println("search domains: %s", domains_str.c_str());
+            }
+            if (params.sample_validity != 0) {
+                dw.println(
+                        "DNS parameters: sample validity = %us, success threshold = %u%%, "
+                        "samples (min, max) = (%u, %u), base_timeout = %dmsec, retry count = "
+                        "%dtimes",
+                        params.sample_validity, params.success_threshold, params.min_samples,
+                        params.max_samples, params.base_timeout_msec, params.retry_count);
+            }
+        }
+
+        if (sections & DUMP_DNS64) {
+            mDns64Configuration.dump(dw, netId);
+        }
+        if (sections & DUMP_PRIVATE_DNS) {
+            const auto privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
+            dw.println("Private DNS mode: %s", getPrivateDnsModeString(privateDnsStatus.mode));
+            if (privateDnsStatus.serversMap.size() == 0) {
+                dw.println("No Private DNS servers configured");
+            } else {
+                dw.println("Private DNS configuration (%u entries)",
+                           static_cast<uint32_t>(privateDnsStatus.serversMap.size()));
+                dw.incIndent();
+                for (const auto& pair : privateDnsStatus.serversMap) {
+                    dw.println("%s name{%s} status{%s}", addrToString(&pair.first.ss).c_str(),
+                               pair.first.name.c_str(), validationStatusToString(pair.second));
+                }
+                dw.decIndent();
             }
-            dw.decIndent();
         }
-        if (domains.empty()) {
-            dw.println("No search domains defined");
-        } else {
-            std::string domains_str = android::base::Join(domains, ", ");
-            dw.println("search domains: %s", domains_str.c_str());
+        if (sections & DUMP_CONFIG) {
+            dw.println("Concurrent DNS query timeout: %d", wait_for_pending_req_timeout_count[0]);
         }
-        if (params.sample_validity != 0) {
-            dw.println(
-                    "DNS parameters: sample validity = %us, success threshold = %u%%, "
-                    "samples (min, max) = (%u, %u), base_timeout = %dmsec, retry count = "
-                    "%dtimes",
-                    params.sample_validity, params.success_threshold, params.min_samples,
-                    params.max_samples, params.base_timeout_msec, params.retry_count);
+        if (sections & DUMP_STATS) {
+            resolv_stats_dump(dw, netId);
         }
+    }
+    dw.decIndent();
+}
 
-        mDns64Configuration.dump(dw, netId);
-        const auto privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
-        dw.println("Private DNS mode: %s", getPrivateDnsModeString(privateDnsStatus.mode));
-        if (privateDnsStatus.serversMap.size() == 0) {
-            dw.println("No Private DNS servers configured");
-        } else {
-            dw.println("Private DNS configuration (%u entries)",
-                       static_cast<uint32_t>(privateDnsStatus.serversMap.size()));
-            dw.incIndent();
-            for (const auto& pair : privateDnsStatus.serversMap) {
-                dw.println("%s name{%s} status{%s}", addrToString(&pair.first.ss).c_str(),
-                           pair.first.name.c_str(), validationStatusToString(pair.second));
+NetworkDump ResolverController::dumpProto(unsigned netId) {
+    NetworkDump dump;
+    dump.set_net_id(netId);
+
+    std::vector<std::string> servers;
+    std::vector<std::string> domains;
+    res_params params = {};
+    std::vector<ResolverStats> stats;
+    std::vector<int32_t> wait_for_pending_req_timeout_count(1, 0);
+    if (getDnsInfo(netId, &servers, &domains, &params, &stats,
+                   &wait_for_pending_req_timeout_count) == 0) {
+        for (const auto& server : servers) dump.add_servers(server);
+        for (const auto& domain : domains) dump.add_search_domains(domain);
+    }
+
+    ResolvStatsSnapshot snapshot;
+    if (resolv_stats_get_snapshot(netId, 0, &snapshot) == 0) {
+        dump.set_cache_entries(snapshot.cacheEntries);
+        dump.set_cache_hits(snapshot.cacheHits);
+        dump.set_cache_misses(snapshot.cacheMisses);
+        dump.set_wait_for_pending_req_timeout_count(snapshot.waitForPendingReqTimeoutCount);
+        for (const auto& [protocol, data] : snapshot.servers) {
+            DnsServerStats* serverStats = dump.add_server_stats();
+            serverStats->set_address(rawAddress(data.serverSockAddr));
+            serverStats->set_port(data.serverSockAddr.port());
+            serverStats->set_protocol(protocol);
+            serverStats->set_total(data.total);
+            for (const auto& [rcode, count] : data.rcodeCounts) {
+                if (count == 0) continue;
+                DnsServerStats::RcodeCount* rcodeCount = serverStats->add_rcode_counts();
+                rcodeCount->set_rcode(static_cast<NsRcode>(rcode));
+                rcodeCount->set_count(count);
+            }
+            serverStats->set_latency_us_sum(data.latencyUs.count());
+            for (const int count : data.latencyHistogram) {
+                serverStats->add_latency_histogram(count);
             }
-            dw.decIndent();
         }
-        dw.println("Concurrent DNS query timeout: %d", wait_for_pending_req_timeout_count[0]);
-        resolv_stats_dump(dw, netId);
     }
-    dw.decIndent();
+
+    const netdutils::IPPrefix prefix = mDns64Configuration.getPrefix64(netId);
+    if (prefix.family() == AF_INET6 && prefix.length() != 0) {
+        dump.set_nat64_prefix(prefix.toString());
+    }
+
+    const auto privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
+    dump.set_private_dns_mode(toPrivateDnsModes(privateDnsStatus.mode));
+    for (const auto& [server, validation] : privateDnsStatus.serversMap) {
+        NetworkDump::PrivateDnsServer* privateDnsServer = dump.add_private_dns_servers();
+        privateDnsServer->set_address(addrToString(&server.ss));
+        privateDnsServer->set_name(server.name);
+        privateDnsServer->set_status(validationStatusToString(validation));
+    }
+    return dump;
 }
 
 }  // namespace net
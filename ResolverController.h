@@ -22,9 +22,11 @@
 #include <vector>
 
 #include <aidl/android/net/ResolverParamsParcel.h>
+#include <aidl/android/net/ResolverStatsSnapshotParcel.h>
 #include "Dns64Configuration.h"
 #include "netd_resolv/resolv.h"
 #include "netdutils/DumpWriter.h"
+#include "stats.pb.h"
 
 struct res_params;
 
@@ -50,10 +52,26 @@ class ResolverController {
                         std::vector<int32_t>* params, std::vector<int32_t>* stats,
                         std::vector<int32_t>* wait_for_pending_req_timeout_count);
 
+    // Fills |snapshot| with the statistics of |netId| that changed after |sinceRevision|.
+    int getResolverStatsSnapshot(int32_t netId, int64_t sinceRevision,
+                                 aidl::android::net::ResolverStatsSnapshotParcel* snapshot);
+
     void startPrefix64Discovery(int32_t netId);
     void stopPrefix64Discovery(int32_t netId);
 
-    void dump(netdutils::DumpWriter& dw, unsigned netId);
+    // Parts of the dump of a network, which dumpsys arguments can select.
+    enum DumpSection : uint32_t {
+        DUMP_CONFIG = 1 << 0,  // Servers, search domains and parameters.
+        DUMP_DNS64 = 1 << 1,
+        DUMP_PRIVATE_DNS = 1 << 2,
+        DUMP_STATS = 1 << 3,  // DnsStats.
+        DUMP_ALL = ~0U,
+    };
+
+    void dump(netdutils::DumpWriter& dw, unsigned netId, uint32_t sections = DUMP_ALL);
+
+    // Returns the state of |netId| for the machine-readable dump.
+    NetworkDump dumpProto(unsigned netId);
 
   private:
     Dns64Configuration mDns64Configuration;
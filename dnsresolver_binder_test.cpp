@@ -20,9 +20,11 @@
 
 #include <netdb.h>
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/strings.h>
 #include <android/net/IDnsResolver.h>
 #include <binder/IPCThreadState.h>
@@ -37,6 +39,7 @@
 #include "ResolverStats.h"
 #include "dns_responder.h"
 #include "dns_responder_client.h"
+#include "stats.pb.h"
 
 namespace binder = android::binder;
 
@@ -48,6 +51,8 @@ using android::String16;
 using android::String8;
 using android::net::IDnsResolver;
 using android::net::ResolverParamsParcel;
+using android::net::ResolverStatsSnapshotParcel;
+using android::net::ResolverDump;
 using android::net::ResolverStats;
 using android::net::metrics::INetdEventListener;
 using android::net::metrics::TestOnDnsEvent;
@@ -126,6 +131,19 @@ ResolverParamsParcel makeResolverParamsParcel(int netId, const std::vector<int>&
     return paramsParcel;
 }
 
+// Returns the output of "dumpsys dnsresolver |args|".
+std::string dumpResolver(const sp<IDnsResolver>& resolver, const std::vector<std::string>& args) {
+    TemporaryFile file;
+    android::Vector<String16> dumpArgs;
+    for (const auto& arg : args) {
+        dumpArgs.add(String16(arg.c_str()));
+    }
+    EXPECT_EQ(android::OK, android::IInterface::asBinder(resolver)->dump(file.fd, dumpArgs));
+    std::string output;
+    EXPECT_TRUE(android::base::ReadFileToString(file.path, &output));
+    return output;
+}
+
 }  // namespace
 
 TEST_F(DnsResolverBinderTest, IsAlive) {
@@ -345,6 +363,128 @@ TEST_F(DnsResolverBinderTest, GetResolverInfo) {
     EXPECT_THAT(res_domains, testing::UnorderedElementsAreArray(domains));
 }
 
+TEST_F(DnsResolverBinderTest, GetResolverStatsSnapshot) {
+    const std::vector<std::string> servers = {"127.0.0.1", "127.0.0.2"};
+    const std::vector<int> testParams = {300, 25, 8, 8};
+    const auto resolverParams =
+            makeResolverParamsParcel(TEST_NETID, testParams, servers, {"example.com"}, "", {});
+    binder::Status status = mDnsResolver->setResolverConfiguration(resolverParams);
+    EXPECT_TRUE(status.isOk()) << status.exceptionMessage();
+
+    // The first snapshot holds all servers, over UDP and TCP.
+    ResolverStatsSnapshotParcel snapshot;
+    status = mDnsResolver->getResolverStatsSnapshot(TEST_NETID, 0, &snapshot);
+    EXPECT_TRUE(status.isOk()) << status.exceptionMessage();
+    EXPECT_EQ(TEST_NETID, snapshot.netId);
+    EXPECT_TRUE(snapshot.full);
+    EXPECT_EQ(2 * servers.size(), snapshot.servers.size());
+    EXPECT_FALSE(snapshot.latencyBucketBoundsMs.empty());
+    for (const auto& server : snapshot.servers) {
+        EXPECT_EQ(4U, server.address.size());
+        EXPECT_EQ(53, server.port);
+        EXPECT_EQ(snapshot.latencyBucketBoundsMs.size() + 1, server.latencyHistogram.size());
+    }
+
+    // Nothing changed since.
+    const int64_t revision = snapshot.revision;
+    status = mDnsResolver->getResolverStatsSnapshot(TEST_NETID, revision, &snapshot);
+    EXPECT_TRUE(status.isOk()) << status.exceptionMessage();
+    EXPECT_FALSE(snapshot.full);
+    EXPECT_TRUE(snapshot.servers.empty());
+    EXPECT_EQ(revision, snapshot.revision);
+
+    // Unknown network and invalid revision.
+    status = mDnsResolver->getResolverStatsSnapshot(TEST_NETID + 1, 0, &snapshot);
+    EXPECT_EQ(ENONET, status.serviceSpecificErrorCode());
+    status = mDnsResolver->getResolverStatsSnapshot(TEST_NETID, -1, &snapshot);
+    EXPECT_EQ(EINVAL, status.serviceSpecificErrorCode());
+}
+
+TEST_F(DnsResolverBinderTest, Dump) {
+    const std::vector<std::string> servers = {"127.0.0.1", "127.0.0.2"};
+    const std::vector<int> testParams = {300, 25, 8, 8};
+    const auto resolverParams =
+            makeResolverParamsParcel(TEST_NETID, testParams, servers, {"example.com"}, "", {});
+    binder::Status status = mDnsResolver->setResolverConfiguration(resolverParams);
+    EXPECT_TRUE(status.isOk()) << status.exceptionMessage();
+    const std::string netId = std::to_string(TEST_NETID);
+    using testing::HasSubstr;
+    using testing::Not;
+
+    // Without arguments, every section of every network is dumped.
+    std::string output = dumpResolver(mDnsResolver, {});
+    EXPECT_THAT(output, HasSubstr("NetId: " + netId + "\n"));
+    EXPECT_THAT(output, HasSubstr("search domains: example.com"));
+    EXPECT_THAT(output, HasSubstr("Private DNS mode: "));
+    EXPECT_THAT(output, HasSubstr("Server statistics: "));
+
+    output = dumpResolver(mDnsResolver, {"list"});
+    EXPECT_THAT(android::base::Split(output, "\n"), testing::Contains(netId));
+    EXPECT_THAT(output, Not(HasSubstr("NetId: ")));
+
+    // A single section of a single network.
+    output = dumpResolver(mDnsResolver, {"netid", netId, "stats"});
+    EXPECT_TRUE(android::base::StartsWith(output, "NetId: " + netId + "\n")) << output;
+    EXPECT_EQ(output.find("NetId: "), output.rfind("NetId: ")) << output;
+    EXPECT_THAT(output, HasSubstr("Server statistics: "));
+    EXPECT_THAT(output, Not(HasSubstr("search domains")));
+    EXPECT_THAT(output, Not(HasSubstr("Private DNS mode")));
+
+    output = dumpResolver(mDnsResolver, {"netid", netId, "config", "privatedns"});
+    EXPECT_THAT(output, HasSubstr("search domains: example.com"));
+    EXPECT_THAT(output, HasSubstr("Private DNS mode: "));
+    EXPECT_THAT(output, Not(HasSubstr("Server statistics")));
+
+    EXPECT_THAT(dumpResolver(mDnsResolver, {"netid", std::to_string(TEST_NETID + 1)}),
+                HasSubstr("Unknown netId"));
+
+    // Bad arguments print the usage.
+    const std::vector<std::vector<std::string>> badArgs = {
+            {"foo"},
+            {"list", "foo"},
+            {"--proto", "list"},
+            {"netid"},
+            {"netid", "foo"},
+            {"netid", netId, "foo"},
+            {"netid", netId, "stats", "foo"},
+    };
+    for (const auto& args : badArgs) {
+        EXPECT_THAT(dumpResolver(mDnsResolver, args), HasSubstr("Usage: "))
+                << android::base::Join(args, ' ');
+    }
+}
+
+TEST_F(DnsResolverBinderTest, DumpProto) {
+    const std::vector<std::string> servers = {"127.0.0.1", "127.0.0.2"};
+    const std::vector<int> testParams = {300, 25, 8, 8};
+    const auto resolverParams =
+            makeResolverParamsParcel(TEST_NETID, testParams, servers, {"example.com"}, "", {});
+    binder::Status status = mDnsResolver->setResolverConfiguration(resolverParams);
+    EXPECT_TRUE(status.isOk()) << status.exceptionMessage();
+
+    // The stream of messages parses as a single ResolverDump.
+    ResolverDump dump;
+    ASSERT_TRUE(dump.ParseFromString(
+            dumpResolver(mDnsResolver, {"--proto", "netid", std::to_string(TEST_NETID)})));
+    EXPECT_LT(0, dump.latency_bucket_bounds_ms_size());
+    ASSERT_EQ(1, dump.networks_size());
+    const auto& network = dump.networks(0);
+    EXPECT_EQ(TEST_NETID, network.net_id());
+    EXPECT_THAT(network.servers(), testing::UnorderedElementsAreArray(servers));
+    EXPECT_THAT(network.search_domains(), testing::ElementsAre("example.com"));
+    // Each server is dumped over UDP and TCP.
+    ASSERT_EQ(2 * static_cast<int>(servers.size()), network.server_stats_size());
+    for (const auto& serverStats : network.server_stats()) {
+        EXPECT_EQ(dump.latency_bucket_bounds_ms_size() + 1,
+                  serverStats.latency_histogram_size());
+    }
+
+    // Without a netid, all networks are dumped, including the test one.
+    ASSERT_TRUE(dump.ParseFromString(dumpResolver(mDnsResolver, {"--proto"})));
+    EXPECT_TRUE(std::any_of(dump.networks().begin(), dump.networks().end(),
+                            [](const auto& n) { return n.net_id() == TEST_NETID; }));
+}
+
 TEST_F(DnsResolverBinderTest, CreateDestroyNetworkCache) {
     // Must not be the same as TEST_NETID
     const int ANOTHER_TEST_NETID = TEST_NETID + 1;
@@ -53,12 +53,17 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string>
+
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 
 #include "netd_resolv/resolv.h"
 #include "res_init.h"
 #include "resolv_cache.h"
 #include "resolv_private.h"
+#include "util.h"
 
 #define ANY 0
 
@@ -115,11 +120,13 @@ struct res_target {
     int qclass, qtype;                                                 // class and type of query
     std::vector<uint8_t> answer = std::vector<uint8_t>(MAXPACKET, 0);  // buffer to put answer
     int n = 0;                                                         // result length
+    int resplen = 0;  // length of the last answer received, including one without records
 };
 
 static int str2number(const char*);
 static int explore_fqdn(const struct addrinfo*, const char*, const char*, struct addrinfo**,
-                        const struct android_net_context*, NetworkDnsEventReported* event);
+                        const struct android_net_context*, NetworkDnsEventReported* event,
+                        uint32_t* ttl);
 static int explore_null(const struct addrinfo*, const char*, struct addrinfo**);
 static int explore_numeric(const struct addrinfo*, const char*, const char*, struct addrinfo**,
                            const char*);
@@ -136,7 +143,7 @@ static struct addrinfo* getanswer(const std::vector<uint8_t>&, int, const char*,
                                   const struct addrinfo*, int* herrno);
 static int dns_getaddrinfo(const char* name, const addrinfo* pai,
                            const android_net_context* netcontext, addrinfo** rv,
-                           NetworkDnsEventReported* event);
+                           NetworkDnsEventReported* event, uint32_t* ttl);
 static void _sethtent(FILE**);
 static void _endhtent(FILE**);
 static struct addrinfo* _gethtent(FILE**, const char*, const struct addrinfo*);
@@ -205,6 +212,30 @@ void freeaddrinfo(struct addrinfo* ai) {
     }
 }
 
+addrinfo* copy_addrinfo(const addrinfo* ai) {
+    addrinfo sentinel = {};
+    for (addrinfo* cur = &sentinel; ai; ai = ai->ai_next, cur = cur->ai_next) {
+        if (ai->ai_addrlen > sizeof(sockaddr_union)) break;
+        // Same layout as get_ai(): the address is stored right after the addrinfo.
+        cur->ai_next = (addrinfo*) malloc(sizeof(addrinfo) + sizeof(sockaddr_union));
+        if (cur->ai_next == nullptr) break;
+        *cur->ai_next = *ai;
+        cur->ai_next->ai_addr = (sockaddr*) (void*) (cur->ai_next + 1);
+        cur->ai_next->ai_canonname = nullptr;
+        cur->ai_next->ai_next = nullptr;
+        memcpy(cur->ai_next->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        if (ai->ai_canonname &&
+            (cur->ai_next->ai_canonname = strdup(ai->ai_canonname)) == nullptr) {
+            break;
+        }
+    }
+    if (ai != nullptr) {
+        freeaddrinfo(sentinel.ai_next);
+        return nullptr;
+    }
+    return sentinel.ai_next;
+}
+
 static int str2number(const char* p) {
     char* ep;
     unsigned long v;
@@ -309,6 +340,19 @@ int validateHints(const addrinfo* _Nonnull hints) {
     return 0;
 }
 
+// Identifies the result of resolv_getaddrinfo() for the given arguments. Results are per UID, as
+// their sorting and AI_ADDRCONFIG depend on the routes visible to the app.
+std::string addrinfo_cache_key(const char* hostname, const char* servname, const addrinfo& hints,
+                               const android_net_context& netcontext) {
+    std::string key = android::base::StringPrintf(
+            "%u %u %u %d %d %d %d ", netcontext.uid, netcontext.app_mark, netcontext.flags,
+            hints.ai_flags, hints.ai_family, hints.ai_socktype, hints.ai_protocol);
+    // Names may contain any byte but NUL.
+    key.append(servname ? servname : "^").push_back('\0');
+    key.append(hostname);
+    return key;
+}
+
 }  // namespace
 
 int android_getaddrinfofornetcontext(const char* hostname, const char* servname,
@@ -400,7 +444,7 @@ int android_getaddrinfofornetcontext(const char* hostname, const char* servname,
 
 int resolv_getaddrinfo(const char* _Nonnull hostname, const char* servname, const addrinfo* hints,
                        const android_net_context* _Nonnull netcontext, addrinfo** _Nonnull res,
-                       NetworkDnsEventReported* _Nonnull event) {
+                       NetworkDnsEventReported* _Nonnull event, uint32_t* ttl) {
     if (hostname == nullptr && servname == nullptr) return EAI_NONAME;
     if (hostname == nullptr) return EAI_NODATA;
 
@@ -417,8 +461,21 @@ int resolv_getaddrinfo(const char* _Nonnull hostname, const char* servname, cons
     }
 
     addrinfo ai = hints ? *hints : addrinfo{};
+
+    // Repeated lookups are answered from the sorted results of the previous one, when enabled.
+    std::string cacheKey;
+    if (getExperimentFlagInt("addrinfo_cache", 0) != 0) {
+        cacheKey = addrinfo_cache_key(hostname, servname, ai, *netcontext);
+        *res = resolv_cache_lookup_addrinfo(netcontext->dns_netid, cacheKey, ttl);
+        if (*res) return 0;
+    }
+
     addrinfo sentinel = {};
     addrinfo* cur = &sentinel;
+    // Smallest TTL of the answers the results come from, 0 if they can't be cached. It is only
+    // worked out when needed.
+    uint32_t minTtl = UINT32_MAX;
+    uint32_t* const pttl = (cacheKey.empty() && ttl == nullptr) ? nullptr : &minTtl;
     // hostname as alphanumeric name.
     // We would like to prefer AF_INET6 over AF_INET, so we'll make a outer loop by AFs.
     for (const Explore& ex : explore_options) {
@@ -435,13 +492,20 @@ int resolv_getaddrinfo(const char* _Nonnull hostname, const char* servname, cons
 
         LOG(DEBUG) << __func__ << ": explore_fqdn(): ai_family=" << tmp.ai_family
                    << " ai_socktype=" << tmp.ai_socktype << " ai_protocol=" << tmp.ai_protocol;
-        error = explore_fqdn(&tmp, hostname, servname, &cur->ai_next, netcontext, event);
+        error = explore_fqdn(&tmp, hostname, servname, &cur->ai_next, netcontext, event, pttl);
+        if (error) minTtl = 0;
 
         while (cur->ai_next) cur = cur->ai_next;
     }
 
     // Propagate the last error from explore_fqdn(), but only when *all* attempts failed.
-    if ((*res = sentinel.ai_next)) return 0;
+    if ((*res = sentinel.ai_next)) {
+        if (!cacheKey.empty()) {
+            resolv_cache_add_addrinfo(netcontext->dns_netid, cacheKey, *res, minTtl);
+        }
+        if (ttl) *ttl = minTtl;
+        return 0;
+    }
 
     // TODO: consider removing freeaddrinfo.
     freeaddrinfo(sentinel.ai_next);
@@ -452,7 +516,7 @@ int resolv_getaddrinfo(const char* _Nonnull hostname, const char* servname, cons
 // FQDN hostname, DNS lookup
 static int explore_fqdn(const addrinfo* pai, const char* hostname, const char* servname,
                         addrinfo** res, const android_net_context* netcontext,
-                        NetworkDnsEventReported* event) {
+                        NetworkDnsEventReported* event, uint32_t* ttl) {
     assert(pai != nullptr);
     // hostname may be nullptr
     // servname may be nullptr
@@ -465,7 +529,10 @@ static int explore_fqdn(const addrinfo* pai, const char* hostname, const char* s
     if ((error = get_portmatch(pai, servname))) return error;
 
     if (!files_getaddrinfo(hostname, pai, &result)) {
-        error = dns_getaddrinfo(hostname, pai, netcontext, &result, event);
+        error = dns_getaddrinfo(hostname, pai, netcontext, &result, event, ttl);
+    } else if (ttl) {
+        // The hosts file is read on every lookup, don't hide its changes.
+        *ttl = 0;
     }
     if (error) {
         freeaddrinfo(result);
@@ -1383,9 +1450,33 @@ error:
     free(elems);
 }
 
+// Returns how long the answer |answer| of length |anslen| may be cached: the smallest TTL of its
+// answer records or, for a NODATA answer, the TTL of its SOA record (RFC 2308). Returns 0 if the
+// answer can't be parsed, isn't NOERROR or has no such TTL.
+static uint32_t answer_ttl(const std::vector<uint8_t>& answer, int anslen) {
+    ns_msg handle;
+    if (anslen <= 0 || ns_initparse(answer.data(), anslen, &handle) < 0) return 0;
+    if (ns_msg_getflag(handle, ns_f_rcode) != ns_r_noerror) return 0;
+
+    const ns_sect sect = ns_msg_count(handle, ns_s_an) > 0 ? ns_s_an : ns_s_ns;
+    uint32_t ttl = UINT32_MAX;
+    for (int i = 0; i < ns_msg_count(handle, sect); i++) {
+        ns_rr rr;
+        if (ns_parserr(&handle, sect, i, &rr) < 0) return 0;
+        if (sect == ns_s_an) {
+            ttl = std::min(ttl, ns_rr_ttl(rr));
+        } else if (ns_rr_type(rr) == ns_t_soa && ns_rr_rdlen(rr) >= INT32SZ) {
+            // The MINIMUM field ends the SOA RDATA.
+            const uint32_t minimum = ns_get32(ns_rr_rdata(rr) + ns_rr_rdlen(rr) - INT32SZ);
+            return std::min(ns_rr_ttl(rr), minimum);
+        }
+    }
+    return (ttl == UINT32_MAX) ? 0 : ttl;
+}
+
 static int dns_getaddrinfo(const char* name, const addrinfo* pai,
                            const android_net_context* netcontext, addrinfo** rv,
-                           NetworkDnsEventReported* event) {
+                           NetworkDnsEventReported* event, uint32_t* ttl) {
     res_target q = {};
     res_target q2 = {};
 
@@ -1458,6 +1549,12 @@ static int dns_getaddrinfo(const char* name, const addrinfo* pai,
 
     _rfc6724_sort(&sentinel, netcontext->app_mark, netcontext->uid);
 
+    if (ttl) {
+        // A family without records, e.g. AAAA for an IPv4-only name, is still answered, and its
+        // negative TTL bounds how long the result may be reused.
+        *ttl = std::min(*ttl, answer_ttl(q.answer, q.resplen));
+        if (q.next) *ttl = std::min(*ttl, answer_ttl(q2.answer, q2.resplen));
+    }
     *rv = sentinel.ai_next;
     return 0;
 }
@@ -1547,6 +1644,82 @@ static bool files_getaddrinfo(const char* name, const addrinfo* pai, addrinfo**
 
 /* resolver logic */
 
+/* Build in |buf| the query for target |t|. Return its length, or -1 on error. */
+static int res_mkqueryN(const char* name, const res_target* t, res_state res, uint8_t* buf,
+                        int buflen, bool retried) {
+    // TODO:  remove the retry flag and provide a sufficient test coverage.
+    const bool edns0 = (res->netcontext_flags &
+                        (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
+                       !retried;
+    if (t->qclass == ns_c_in && (t->qtype == ns_t_a || t->qtype == ns_t_aaaa)) {
+        return res_nmkquery_in(res, name, t->qtype, buf, buflen, t->answer.size(), edns0);
+    }
+    int n = res_nmkquery(QUERY, name, t->qclass, t->qtype, /*data=*/nullptr, /*datalen=*/0, buf,
+                         buflen, res->netcontext_flags);
+    if (n > 0 && edns0) n = res_nopt(res, n, buf, buflen, t->answer.size());
+    return n;
+}
+
+/*
+ * Like the loop in res_queryN(), but sends the queries for all the targets at once
+ * with res_nsendN(). |retry| is set for the targets whose query choked with EDNS0
+ * and should be retried without it.
+ * Return -1 if a query can't be formulated, 0 otherwise.
+ */
+static int res_queryN_pipelined(const char* name, res_target* target, res_state res, int* rcode,
+                                int* ancount, std::vector<bool>* retry) {
+    std::vector<std::vector<uint8_t>> bufs;
+    for (res_target* t = target; t; t = t->next) {
+        reinterpret_cast<HEADER*>(t->answer.data())->rcode = NOERROR; /* default */
+
+        LOG(DEBUG) << __func__ << ": (" << t->qclass << ", " << t->qtype << ")";
+
+        std::vector<uint8_t> buf(MAXPACKET);
+        const int n = res_mkqueryN(name, t, res, buf.data(), buf.size(), /*retried=*/false);
+        if (n <= 0) {
+            LOG(ERROR) << __func__ << ": res_nmkquery failed";
+            return -1;
+        }
+        buf.resize(n);
+        bufs.push_back(std::move(buf));
+    }
+
+    std::vector<ResSendTarget> sends;
+    size_t i = 0;
+    for (res_target* t = target; t; t = t->next, i++) {
+        sends.push_back({
+                .query = bufs[i].data(),
+                .querylen = static_cast<int>(bufs[i].size()),
+                .answer = t->answer.data(),
+                .anssiz = static_cast<int>(t->answer.size()),
+        });
+    }
+    res_nsendN(res, sends.data(), sends.size(), 0);
+
+    retry->assign(sends.size(), false);
+    i = 0;
+    for (res_target* t = target; t; t = t->next, i++) {
+        const HEADER* hp = reinterpret_cast<const HEADER*>(t->answer.data());
+        const int n = sends[i].resplen;
+        t->resplen = std::clamp(n, 0, static_cast<int>(t->answer.size()));
+        if (n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
+            // Record rcode from DNS response header only if no timeout.
+            // Keep rcode timeout for reporting later if any.
+            *rcode = (sends[i].rcode == RCODE_TIMEOUT) ? RCODE_TIMEOUT : hp->rcode;
+            (*retry)[i] = (res->netcontext_flags &
+                           (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
+                          sends[i].edns0Error;
+            LOG(DEBUG) << __func__ << ": rcode=" << hp->rcode << ", ancount=" << ntohs(hp->ancount);
+            continue;
+        }
+
+        *ancount += ntohs(hp->ancount);
+
+        t->n = n;
+    }
+    return 0;
+}
+
 /*
  * Formulate a normal query, send, and await answer.
  * Returned answer is placed in supplied buffer "answer".
@@ -1570,9 +1743,22 @@ static int res_queryN(const char* name, res_target* target, res_state res, int*
     rcode = NOERROR;
     ancount = 0;
 
-    for (t = target; t; t = t->next) {
+    // If enabled, put all the questions on the wire at once (e.g. A and AAAA), so that they cost
+    // one round trip instead of one per question. Only the questions that need to be retried
+    // without EDNS0 go through the sequential loop below.
+    const bool pipelined =
+            target->next != nullptr && getExperimentFlagInt("pipelined_lookup", 0) != 0;
+    std::vector<bool> retry;
+    if (pipelined && res_queryN_pipelined(name, target, res, &rcode, &ancount, &retry) < 0) {
+        *herrno = NO_RECOVERY;
+        return -1;
+    }
+
+    size_t i = 0;
+    for (t = target; t; t = t->next, i++) {
+        if (pipelined && !retry[i]) continue;
         HEADER* hp = (HEADER*)(void*)t->answer.data();
-        bool retried = false;
+        bool retried = pipelined;
     again:
         hp->rcode = NOERROR; /* default */
 
@@ -1583,13 +1769,7 @@ static int res_queryN(const char* name, res_target* target, res_state res, int*
 
         LOG(DEBUG) << __func__ << ": (" << cl << ", " << type << ")";
 
-        n = res_nmkquery(QUERY, name, cl, type, /*data=*/nullptr, /*datalen=*/0, buf, sizeof(buf),
-                         res->netcontext_flags);
-        if (n > 0 &&
-            (res->netcontext_flags &
-             (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
-            !retried)  // TODO:  remove the retry flag and provide a sufficient test coverage.
-            n = res_nopt(res, n, buf, sizeof(buf), anslen);
+        n = res_mkqueryN(name, t, res, buf, sizeof(buf), retried);
         if (n <= 0) {
             LOG(ERROR) << __func__ << ": res_nmkquery failed";
             *herrno = NO_RECOVERY;
@@ -1597,6 +1777,7 @@ static int res_queryN(const char* name, res_target* target, res_state res, int*
         }
 
         n = res_nsend(res, buf, n, t->answer.data(), anslen, &rcode, 0);
+        t->resplen = std::clamp(n, 0, static_cast<int>(t->answer.size()));
         if (n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
             // Record rcode from DNS response header only if no timeout.
             // Keep rcode timeout for reporting later if any.
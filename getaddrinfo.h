@@ -25,7 +25,8 @@ int android_getaddrinfofornetcontext(const char* hostname, const char* servname,
                                      const addrinfo* hints, const android_net_context* netcontext,
                                      addrinfo** res, android::net::NetworkDnsEventReported*);
 
-// This is the DNS proxy entry point for getaddrinfo().
+// This is the DNS proxy entry point for getaddrinfo(). On success, |*ttl| is set, if |ttl| is not
+// null, to how many seconds the result may be reused, 0 if it shouldn't be.
 int resolv_getaddrinfo(const char* hostname, const char* servname, const addrinfo* hints,
                        const android_net_context* netcontext, addrinfo** res,
-                       android::net::NetworkDnsEventReported*);
+                       android::net::NetworkDnsEventReported*, uint32_t* ttl = nullptr);
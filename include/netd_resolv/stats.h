@@ -28,7 +28,7 @@
 #define RCODE_TIMEOUT 255
 
 struct res_sample {
-    time_t at;      // time in s at which the sample was recorded
+    time_t at;      // time in s at which the sample was recorded, on CLOCK_MONOTONIC_COARSE
     uint16_t rtt;   // round-trip time in ms
     uint8_t rcode;  // the DNS rcode or RCODE_XXX defined above
 };
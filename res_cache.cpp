@@ -36,9 +36,13 @@
 #include <string.h>
 #include <time.h>
 #include <algorithm>
+#include <array>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -55,6 +59,7 @@
 #include <android-base/strings.h>
 #include <android-base/thread_annotations.h>
 #include <android/multinetwork.h>  // ResNsendFlags
+#include <netdutils/ThreadUtil.h>
 
 #include <server_configurable_flags/get_flags.h>
 
@@ -151,11 +156,27 @@ using android::netdutils::IPSockAddr;
 const int CONFIG_MAX_ENTRIES = 64 * 2 * 5;
 constexpr int DNSEVENT_SUBSAMPLING_MAP_DEFAULT_KEY = -1;
 
-static time_t _time_now(void) {
-    struct timeval tv;
+// Cache timestamps are taken from the coarse monotonic clock, in milliseconds, so that entries
+// neither expire early or late nor all at once when the wall clock is set.
+static int64_t _time_now(void) {
+    return coarseMonotonicMs();
+}
+
+// At most 1/CACHE_TTL_JITTER_DIVISOR of a TTL, and at most CACHE_TTL_MAX_JITTER_MS, is randomly
+// taken off the lifetime of a cache entry.
+constexpr uint32_t CACHE_TTL_JITTER_DIVISOR = 32;
+constexpr uint32_t CACHE_TTL_MAX_JITTER_MS = 2000;
 
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec;
+// Returns the time at which an answer with a TTL of |ttl| seconds, cached at |now|, expires.
+// The jitter spreads the expiry of entries that were inserted together, e.g. by a burst of
+// queries after a network change, without ever keeping an answer beyond its TTL.
+static int64_t _cache_expiry(int64_t now, uint32_t ttl) {
+    const int64_t lifetime = int64_t{ttl} * 1000;
+    const uint32_t maxJitter =
+            static_cast<uint32_t>(std::min<int64_t>(lifetime / CACHE_TTL_JITTER_DIVISOR,
+                                                    CACHE_TTL_MAX_JITTER_MS));
+    const uint32_t jitter = (maxJitter > 0) ? arc4random_uniform(maxJitter + 1) : 0;
+    return now + lifetime - jitter;
 }
 
 /* reminder: the general format of a DNS packet is the following:
@@ -685,8 +706,8 @@ struct Entry {
     int querylen;
     const uint8_t* answer;
     int answerlen;
-    time_t expires; /* time_t when the entry isn't valid any more */
-    int id;         /* for debugging purpose */
+    int64_t expires; /* _time_now() when the entry isn't valid any more */
+    int id;          /* for debugging purpose */
 };
 
 /*
@@ -813,6 +834,18 @@ static unsigned entry_hash(const Entry* e) {
     return _dnsPacket_hashQuery(pack);
 }
 
+/* The keys most recently computed on this thread. A lookup is normally followed by an add or a
+ * failure notification for the same query, and a pipelined lookup interleaves a few queries, so
+ * remembering the last keys saves parsing and hashing each packet again every time. The ID is
+ * neither hashed nor checked, so it is not part of the memo. */
+struct QueryKeyMemo {
+    std::vector<uint8_t> query;  // the query without its ID
+    unsigned hash = 0;
+    int valid = 0;
+};
+static thread_local std::array<QueryKeyMemo, 4> sQueryKeyMemo;
+static thread_local size_t sQueryKeyMemoNext = 0;
+
 /* initialize an Entry as a search key, this also checks the input query packet
  * returns 1 on success, or 0 in case of unsupported/malformed data */
 static int entry_init_key(Entry* e, const void* query, int querylen) {
@@ -822,11 +855,32 @@ static int entry_init_key(Entry* e, const void* query, int querylen) {
 
     e->query = (const uint8_t*) query;
     e->querylen = querylen;
-    e->hash = entry_hash(e);
 
+    if (querylen < DNS_HEADER_SIZE) {
+        e->hash = entry_hash(e);
+        _dnsPacket_init(pack, e->query, e->querylen);
+        return _dnsPacket_checkQuery(pack);
+    }
+
+    const uint8_t* body = e->query + 2;
+    const size_t bodylen = querylen - 2;
+    for (const QueryKeyMemo& memo : sQueryKeyMemo) {
+        if (memo.query.size() == bodylen && !memcmp(memo.query.data(), body, bodylen)) {
+            e->hash = memo.hash;
+            return memo.valid;
+        }
+    }
+
+    e->hash = entry_hash(e);
     _dnsPacket_init(pack, e->query, e->querylen);
+    const int valid = _dnsPacket_checkQuery(pack);
 
-    return _dnsPacket_checkQuery(pack);
+    QueryKeyMemo& memo = sQueryKeyMemo[sQueryKeyMemoNext];
+    sQueryKeyMemoNext = (sQueryKeyMemoNext + 1) % sQueryKeyMemo.size();
+    memo.query.assign(body, body + bodylen);
+    memo.hash = e->hash;
+    memo.valid = valid;
+    return valid;
 }
 
 /* allocate a new entry as a cache node */
@@ -872,7 +926,21 @@ static int entry_equals(const Entry* e1, const Entry* e2) {
 /* Maximum time for a thread to wait for an pending request */
 constexpr int PENDING_REQUEST_TIMEOUT = 20;
 
-// lock protecting everything in the resolve_cache_info structs (next ptr, etc)
+// How long queries are sent without EDNS0 to a server that rejected it, or with a reduced UDP
+// payload size to a server that lost answers, before trying the default again.
+constexpr int EDNS_REPROBE_INTERVAL = 30 * 60;
+
+// Limits on the getaddrinfo() results cached per network. Routing changes, which affect how the
+// results are sorted, aren't signalled to the resolver, so results are kept no longer than
+// ADDRINFO_CACHE_MAX_TTL seconds even if the answers they were built from live longer.
+constexpr int ADDRINFO_CACHE_MAX_ENTRIES = 128;
+constexpr uint32_t ADDRINFO_CACHE_MAX_TTL = 60;
+
+struct AddrInfoDeleter {
+    void operator()(addrinfo* ai) const { freeaddrinfo(ai); }
+};
+
+// lock protecting everything in the resolve_cache_info structs and res_cache_map
 static std::mutex cache_mutex;
 static std::condition_variable cv;
 
@@ -900,6 +968,8 @@ struct Cache {
 
         flushPendingRequests();
 
+        addr_index.clear();
+        addrinfo_results.clear();
         mru_list.mru_next = mru_list.mru_prev = &mru_list;
         num_entries = 0;
         last_id = 0;
@@ -920,12 +990,29 @@ struct Cache {
     }
 
     int num_entries = 0;
+    // Lookups that ended in a hit or a miss, and the hits, for resolv_stats_get_snapshot().
+    // Queries that can't be cached, or whose answer doesn't fit in the caller's buffer, are
+    // not counted.
+    int num_lookups = 0;
+    int num_hits = 0;
 
     // TODO: convert to std::list
     Entry mru_list;
     int last_id = 0;
     std::vector<Entry> entries;
 
+    // Reverse index from the raw bytes of an A/AAAA RDATA (4 or 16 bytes) to the entries whose
+    // answer contains that address, in insertion order. Used by resolv_gethostbyaddr_from_cache()
+    // so that reverse lookups don't have to parse every cached answer.
+    std::unordered_map<std::string, std::vector<Entry*>> addr_index;
+
+    // Sorted getaddrinfo() results, see resolv_cache_add_addrinfo().
+    struct AddrInfoEntry {
+        std::unique_ptr<addrinfo, AddrInfoDeleter> ai;
+        int64_t expires;
+    };
+    std::unordered_map<std::string, AddrInfoEntry> addrinfo_results;
+
     // TODO: convert to std::vector
     struct pending_req_info {
         unsigned int hash;
@@ -933,17 +1020,16 @@ struct Cache {
     } pending_requests{};
 };
 
-// TODO: allocate with new
 struct resolv_cache_info {
     unsigned netid;
-    Cache* cache;  // TODO: use unique_ptr or embed
-    struct resolv_cache_info* next;
+    std::unique_ptr<Cache> cache;
     int nscount;
     std::vector<std::string> nameservers;
     std::vector<IPSockAddr> nameserverSockAddrs;
     int revision_id;  // # times the nameservers have been replaced
     res_params params;
     struct res_stats nsstats[MAXNS];
+    res_edns_info nsedns[MAXNS];
     std::vector<std::string> search_domains;
     int wait_for_pending_req_timeout_count;
     // Map format: ReturnCode:rate_denom
@@ -951,6 +1037,41 @@ struct resolv_cache_info {
     std::unique_ptr<DnsStats> dnsStats;
 };
 
+// Calls |fn| with the raw address bytes of each A and AAAA record in the answer section of |e|.
+template <typename Func>
+static void entry_for_each_address(const Entry* e, Func fn) {
+    ns_msg handle;
+    if (ns_initparse(e->answer, e->answerlen, &handle) < 0) return;
+
+    for (int n = 0; n < ns_msg_count(handle, ns_s_an); n++) {
+        ns_rr rr;
+        if (ns_parserr(&handle, ns_s_an, n, &rr)) continue;
+
+        if ((ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == NS_INADDRSZ) ||
+            (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == NS_IN6ADDRSZ)) {
+            fn(std::string(reinterpret_cast<const char*>(ns_rr_rdata(rr)), ns_rr_rdlen(rr)));
+        }
+    }
+}
+
+static void cache_index_entry_locked(Cache* cache, Entry* e) {
+    entry_for_each_address(e, [cache, e](std::string&& addr) {
+        auto& entries = cache->addr_index[std::move(addr)];
+        // The same address may appear more than once in an answer.
+        if (entries.empty() || entries.back() != e) entries.push_back(e);
+    });
+}
+
+static void cache_unindex_entry_locked(Cache* cache, const Entry* e) {
+    entry_for_each_address(e, [cache, e](std::string&& addr) {
+        auto it = cache->addr_index.find(addr);
+        if (it == cache->addr_index.end()) return;
+        auto& entries = it->second;
+        entries.erase(std::remove(entries.begin(), entries.end(), e), entries.end());
+        if (entries.empty()) cache->addr_index.erase(it);
+    });
+}
+
 /* gets cache associated with a network, or NULL if none exists */
 static Cache* find_named_cache_locked(unsigned netid) REQUIRES(cache_mutex);
 
@@ -1068,6 +1189,7 @@ static void _cache_add_p(Cache* cache, Entry** lookup, Entry* e) {
     *lookup = e;
     e->id = ++cache->last_id;
     entry_mru_add(e, &cache->mru_list);
+    cache_index_entry_locked(cache, e);
     cache->num_entries += 1;
 
     LOG(INFO) << __func__ << ": entry " << e->id << " added (count=" << cache->num_entries << ")";
@@ -1084,6 +1206,7 @@ static void _cache_remove_p(Cache* cache, Entry** lookup) {
               << ")";
 
     entry_mru_remove(e);
+    cache_unindex_entry_locked(cache, e);
     *lookup = e->hlink;
     entry_free(e);
     cache->num_entries -= 1;
@@ -1108,7 +1231,7 @@ static void _cache_remove_oldest(Cache* cache) {
  */
 static void _cache_remove_expired(Cache* cache) {
     Entry* e;
-    time_t now = _time_now();
+    const int64_t now = _time_now();
 
     for (e = cache->mru_list.mru_next; e != &cache->mru_list;) {
         // Entry is old, remove
@@ -1141,7 +1264,7 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, const void* query, int que
     Entry key;
     Entry** lookup;
     Entry* e;
-    time_t now;
+    int64_t now;
 
     LOG(INFO) << __func__ << ": lookup";
 
@@ -1168,10 +1291,12 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, const void* query, int que
         LOG(INFO) << __func__ << ": NOT IN CACHE";
         // If it is no-cache-store mode, we won't wait for possible query.
         if (flags & ANDROID_RESOLV_NO_CACHE_STORE) {
+            cache->num_lookups++;
             return RESOLV_CACHE_SKIP;
         }
 
         if (!cache_has_pending_request_locked(cache, &key, true)) {
+            cache->num_lookups++;
             return RESOLV_CACHE_NOTFOUND;
 
         } else {
@@ -1197,6 +1322,7 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, const void* query, int que
             lookup = _cache_lookup_p(cache, &key);
             e = *lookup;
             if (e == NULL) {
+                cache->num_lookups++;
                 return RESOLV_CACHE_NOTFOUND;
             }
         }
@@ -1209,6 +1335,7 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, const void* query, int que
         LOG(INFO) << __func__ << ": NOT IN CACHE (STALE ENTRY " << *lookup << "DISCARDED)";
         res_pquery(e->query, e->querylen);
         _cache_remove_p(cache, lookup);
+        cache->num_lookups++;
         return RESOLV_CACHE_NOTFOUND;
     }
 
@@ -1227,6 +1354,8 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, const void* query, int que
         entry_mru_add(e, &cache->mru_list);
     }
 
+    cache->num_lookups++;
+    cache->num_hits++;
     LOG(INFO) << __func__ << ": FOUND IN CACHE entry=" << e;
     return RESOLV_CACHE_FOUND;
 }
@@ -1282,7 +1411,7 @@ int resolv_cache_add(unsigned netid, const void* query, int querylen, const void
     if (ttl > 0) {
         e = entry_alloc(key, answer, answerlen);
         if (e != NULL) {
-            e->expires = ttl + _time_now();
+            e->expires = _cache_expiry(_time_now(), ttl);
             _cache_add_p(cache, lookup, e);
         }
     }
@@ -1293,6 +1422,50 @@ int resolv_cache_add(unsigned netid, const void* query, int querylen, const void
     return 0;
 }
 
+addrinfo* resolv_cache_lookup_addrinfo(unsigned netid, const std::string& key, uint32_t* ttl) {
+    std::lock_guard guard(cache_mutex);
+    Cache* cache = find_named_cache_locked(netid);
+    if (cache == nullptr) return nullptr;
+
+    const auto it = cache->addrinfo_results.find(key);
+    if (it == cache->addrinfo_results.end()) return nullptr;
+    const int64_t now = _time_now();
+    if (now >= it->second.expires) {
+        cache->addrinfo_results.erase(it);
+        return nullptr;
+    }
+    // Round up, so that a valid result never has a TTL of 0.
+    if (ttl) *ttl = (it->second.expires - now + 999) / 1000;
+    return copy_addrinfo(it->second.ai.get());
+}
+
+void resolv_cache_add_addrinfo(unsigned netid, const std::string& key, const addrinfo* ai,
+                               uint32_t ttl) {
+    ttl = std::min(ttl, ADDRINFO_CACHE_MAX_TTL);
+    if (ai == nullptr || ttl == 0) return;
+    std::unique_ptr<addrinfo, AddrInfoDeleter> copy(copy_addrinfo(ai));
+    if (copy == nullptr) return;
+
+    std::lock_guard guard(cache_mutex);
+    Cache* cache = find_named_cache_locked(netid);
+    if (cache == nullptr) return;
+
+    const int64_t now = _time_now();
+    auto& results = cache->addrinfo_results;
+    if (results.size() >= ADDRINFO_CACHE_MAX_ENTRIES && results.find(key) == results.end()) {
+        for (auto it = results.begin(); it != results.end();) {
+            it = (now >= it->second.expires) ? results.erase(it) : std::next(it);
+        }
+        if (results.size() >= ADDRINFO_CACHE_MAX_ENTRIES) {
+            results.erase(std::min_element(results.begin(), results.end(),
+                                           [](const auto& a, const auto& b) {
+                                               return a.second.expires < b.second.expires;
+                                           }));
+        }
+    }
+    results[key] = {std::move(copy), _cache_expiry(now, ttl)};
+}
+
 bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t domain_name_size,
                                      const char* ip_address, int af) {
     if (domain_name_size > NS_MAXDNAME) {
@@ -1306,68 +1479,42 @@ bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t
         return false;
     }
 
-    Cache* cache = nullptr;
-    Entry* node = nullptr;
-
-    ns_rr rr;
-    ns_msg handle;
-    ns_rr rr_query;
-
-    struct sockaddr_in sa;
-    struct sockaddr_in6 sa6;
-    char* addr_buf = nullptr;
+    uint8_t addr_buf[NS_IN6ADDRSZ];
+    if (inet_pton(af, ip_address, addr_buf) != 1) {
+        LOG(WARNING) << __func__ << ": inet_pton() fail";
+        return false;
+    }
+    const std::string key(reinterpret_cast<const char*>(addr_buf),
+                          (af == AF_INET) ? NS_INADDRSZ : NS_IN6ADDRSZ);
 
     std::lock_guard guard(cache_mutex);
 
-    cache = find_named_cache_locked(netid);
+    Cache* cache = find_named_cache_locked(netid);
     if (cache == nullptr) {
         return false;
     }
 
-    for (node = cache->mru_list.mru_next; node != nullptr && node != &cache->mru_list;
-         node = node->mru_next) {
-        if (node->answer == nullptr) {
-            continue;
-        }
-
-        memset(&handle, 0, sizeof(handle));
+    const auto it = cache->addr_index.find(key);
+    if (it == cache->addr_index.end()) {
+        return false;
+    }
 
-        if (ns_initparse(node->answer, node->answerlen, &handle) < 0) {
+    // Prefer the most recently added answer containing the address.
+    for (auto e = it->second.rbegin(); e != it->second.rend(); ++e) {
+        ns_msg handle;
+        if (ns_initparse((*e)->answer, (*e)->answerlen, &handle) < 0) {
             continue;
         }
 
-        for (int n = 0; n < ns_msg_count(handle, ns_s_an); n++) {
-            memset(&rr, 0, sizeof(rr));
-
-            if (ns_parserr(&handle, ns_s_an, n, &rr)) {
+        int query_count = ns_msg_count(handle, ns_s_qd);
+        for (int i = 0; i < query_count; i++) {
+            ns_rr rr_query;
+            if (ns_parserr(&handle, ns_s_qd, i, &rr_query)) {
                 continue;
             }
-
-            if (ns_rr_type(rr) == ns_t_a && af == AF_INET) {
-                addr_buf = (char*)&(sa.sin_addr);
-            } else if (ns_rr_type(rr) == ns_t_aaaa && af == AF_INET6) {
-                addr_buf = (char*)&(sa6.sin6_addr);
-            } else {
-                continue;
-            }
-
-            if (inet_pton(af, ip_address, addr_buf) != 1) {
-                LOG(WARNING) << __func__ << ": inet_pton() fail";
-                return false;
-            }
-
-            if (memcmp(ns_rr_rdata(rr), addr_buf, ns_rr_rdlen(rr)) == 0) {
-                int query_count = ns_msg_count(handle, ns_s_qd);
-                for (int i = 0; i < query_count; i++) {
-                    memset(&rr_query, 0, sizeof(rr_query));
-                    if (ns_parserr(&handle, ns_s_qd, i, &rr_query)) {
-                        continue;
-                    }
-                    strlcpy(domain_name, ns_rr_name(rr_query), domain_name_size);
-                    if (domain_name[0] != '\0') {
-                        return true;
-                    }
-                }
+            strlcpy(domain_name, ns_rr_name(rr_query), domain_name_size);
+            if (domain_name[0] != '\0') {
+                return true;
             }
         }
     }
@@ -1375,13 +1522,12 @@ bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t
     return false;
 }
 
-// Head of the list of caches.
-static struct resolv_cache_info res_cache_list GUARDED_BY(cache_mutex);
+// The caches of all networks, indexed by netid. Every cache lookup, cache add, stats sample and
+// config read starts with a lookup in this table with cache_mutex held, so it must not degrade
+// with the number of networks.
+static std::unordered_map<unsigned, std::unique_ptr<resolv_cache_info>> res_cache_map
+        GUARDED_BY(cache_mutex);
 
-// insert resolv_cache_info into the list of resolv_cache_infos
-static void insert_cache_info_locked(resolv_cache_info* cache_info);
-// creates a resolv_cache_info
-static resolv_cache_info* create_cache_info();
 // Clears nameservers set for |cache_info| and clears the stats
 static void free_nameservers_locked(resolv_cache_info* cache_info);
 // Order-insensitive comparison for the two set of servers.
@@ -1438,9 +1584,58 @@ std::unordered_map<int, uint32_t> resolv_get_dns_event_subsampling_map() {
     return sampling_rate_map;
 }
 
+// Frees the caches of deleted networks on a background thread, so that tearing down a network
+// with a full cache does not hold cache_mutex, and thus block lookups on every network, while
+// each entry is freed. The thread exits when there is nothing left to free.
+class CacheReclaimer {
+  public:
+    void reclaim(std::unique_ptr<resolv_cache_info> info) EXCLUDES(mLock) {
+        std::lock_guard guard(mLock);
+        mQueue.push_back(std::move(info));
+        if (mRunning) return;
+        mRunning = true;
+        std::thread([this] { run(); }).detach();
+    }
+
+  private:
+    void run() EXCLUDES(mLock) {
+        android::netdutils::setThreadName("CacheReclaim");
+        while (true) {
+            std::vector<std::unique_ptr<resolv_cache_info>> queue;
+            {
+                std::lock_guard guard(mLock);
+                if (mQueue.empty()) {
+                    mRunning = false;
+                    return;
+                }
+                queue.swap(mQueue);
+            }
+            // The caches are freed here, when |queue| goes out of scope.
+        }
+    }
+
+    std::mutex mLock;
+    std::vector<std::unique_ptr<resolv_cache_info>> mQueue GUARDED_BY(mLock);
+    bool mRunning GUARDED_BY(mLock) = false;
+};
+
+CacheReclaimer& getCacheReclaimer() {
+    // Never destroyed, since its thread may still be running at exit.
+    static CacheReclaimer* const reclaimer = new CacheReclaimer;
+    return *reclaimer;
+}
+
 }  // namespace
 
 int resolv_create_cache_for_net(unsigned netid) {
+    // Value-initialized, so that the plain members start zeroed. It is built before locking,
+    // since allocating the hash table of the cache is proportional to its capacity.
+    auto cache_info = std::make_unique<resolv_cache_info>();
+    cache_info->netid = netid;
+    cache_info->cache = std::make_unique<Cache>();
+    cache_info->dns_event_subsampling_map = resolv_get_dns_event_subsampling_map();
+    cache_info->dnsStats.reset(new DnsStats());
+
     std::lock_guard guard(cache_mutex);
     Cache* cache = find_named_cache_locked(netid);
     // Should not happen
@@ -1448,82 +1643,51 @@ int resolv_create_cache_for_net(unsigned netid) {
         LOG(ERROR) << __func__ << ": Cache is already created, netId: " << netid;
         return -EEXIST;
     }
-
-    resolv_cache_info* cache_info = create_cache_info();
-    if (!cache_info) return -ENOMEM;
-    cache_info->netid = netid;
-    cache_info->cache = new Cache;
-    cache_info->dns_event_subsampling_map = resolv_get_dns_event_subsampling_map();
-    cache_info->dnsStats.reset(new DnsStats());
-    insert_cache_info_locked(cache_info);
+    res_cache_map.emplace(netid, std::move(cache_info));
 
     return 0;
 }
 
 void resolv_delete_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-
-    struct resolv_cache_info* prev_cache_info = &res_cache_list;
-
-    while (prev_cache_info->next) {
-        struct resolv_cache_info* cache_info = prev_cache_info->next;
-
-        if (cache_info->netid == netid) {
-            prev_cache_info->next = cache_info->next;
-            delete cache_info->cache;
-            free_nameservers_locked(cache_info);
-
-            // It won't be necessary after the memory of cache_info can be deallocated by the
-            // C++ delete expression.
-            cache_info->dnsStats.reset();
-
-            free(cache_info);
-            break;
-        }
-
-        prev_cache_info = prev_cache_info->next;
+    std::unique_ptr<resolv_cache_info> cache_info;
+    {
+        std::lock_guard guard(cache_mutex);
+
+        // Queries in flight on this network do not keep pointers into it across a release of
+        // cache_mutex: they look the network up again, and find that it is gone.
+        const auto it = res_cache_map.find(netid);
+        if (it == res_cache_map.end()) return;
+
+        cache_info = std::move(it->second);
+        res_cache_map.erase(it);
+        // Wake up the queries waiting for a pending request on this network. They give up on
+        // the cache, since the network is gone.
+        cv.notify_all();
     }
+    getCacheReclaimer().reclaim(std::move(cache_info));
 }
 
 std::vector<unsigned> resolv_list_caches() {
     std::lock_guard guard(cache_mutex);
-    struct resolv_cache_info* cache_info = res_cache_list.next;
     std::vector<unsigned> result;
-    while (cache_info) {
-        result.push_back(cache_info->netid);
-        cache_info = cache_info->next;
+    result.reserve(res_cache_map.size());
+    for (const auto& [netid, _] : res_cache_map) {
+        result.push_back(netid);
     }
+    // Keep dumps stable across calls.
+    std::sort(result.begin(), result.end());
     return result;
 }
 
-static resolv_cache_info* create_cache_info() {
-    return (struct resolv_cache_info*) calloc(sizeof(struct resolv_cache_info), 1);
-}
-
-// TODO: convert this to a simple and efficient C++ container.
-static void insert_cache_info_locked(struct resolv_cache_info* cache_info) {
-    struct resolv_cache_info* last;
-    for (last = &res_cache_list; last->next; last = last->next) {}
-    last->next = cache_info;
-}
-
 static Cache* find_named_cache_locked(unsigned netid) {
     resolv_cache_info* info = find_cache_info_locked(netid);
-    if (info != nullptr) return info->cache;
+    if (info != nullptr) return info->cache.get();
     return nullptr;
 }
 
 static resolv_cache_info* find_cache_info_locked(unsigned netid) {
-    struct resolv_cache_info* cache_info = res_cache_list.next;
-
-    while (cache_info) {
-        if (cache_info->netid == netid) {
-            break;
-        }
-
-        cache_info = cache_info->next;
-    }
-    return cache_info;
+    const auto it = res_cache_map.find(netid);
+    return (it != res_cache_map.end()) ? it->second.get() : nullptr;
 }
 
 static void resolv_set_experiment_params(res_params* params) {
@@ -1635,6 +1799,8 @@ int resolv_set_nameservers(unsigned netid, const std::vector<std::string>& serve
     // Always update the search paths. Cache-flushing however is not necessary,
     // since the stored cache entries do contain the domain, not just the host name.
     cache_info->search_domains = filter_domains(domains);
+    // Unlike answers, getaddrinfo() results depend on the whole configuration.
+    cache_info->cache->addrinfo_results.clear();
 
     // Setup stats for cleartext dns servers.
     if (!cache_info->dnsStats->setServers(cache_info->nameserverSockAddrs, PROTO_TCP) ||
@@ -1715,6 +1881,7 @@ static void res_cache_clear_stats_locked(resolv_cache_info* cache_info) {
     for (int i = 0; i < MAXNS; ++i) {
         cache_info->nsstats[i].sample_count = 0;
         cache_info->nsstats[i].sample_next = 0;
+        cache_info->nsedns[i] = {};
     }
 
     // Increment the revision id to ensure that sample state is not written back if the
@@ -1815,22 +1982,96 @@ int resolv_cache_get_resolver_stats(unsigned netid, res_params* params, res_stat
     return -1;
 }
 
+// Returns the index of the nameserver |sa| of the network |netid|, or -1 if it isn't found or
+// the nameservers have changed since |revision_id|.
+static int find_nameserver_locked(unsigned netid, int revision_id, const sockaddr* sa,
+                                  resolv_cache_info** info) REQUIRES(cache_mutex) {
+    *info = find_cache_info_locked(netid);
+    if (*info == nullptr || (*info)->revision_id != revision_id) return -1;
+
+    const int serverNum = std::min(MAXNS, static_cast<int>((*info)->nameserverSockAddrs.size()));
+    const IPSockAddr ipsa = IPSockAddr::toIPSockAddr(*sa);
+    for (int ns = 0; ns < serverNum; ns++) {
+        if (ipsa == (*info)->nameserverSockAddrs.at(ns)) return ns;
+    }
+    return -1;
+}
+
 void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id, const sockaddr* sa,
                                             const res_sample& sample, int max_samples) {
     if (max_samples <= 0 || sa == nullptr) return;
 
+    std::lock_guard guard(cache_mutex);
+    resolv_cache_info* info;
+    if (int ns = find_nameserver_locked(netid, revision_id, sa, &info); ns >= 0) {
+        res_cache_add_stats_sample_locked(&info->nsstats[ns], sample, max_samples);
+    }
+}
+
+int resolv_cache_get_edns_info(unsigned netid, res_edns_info edns[MAXNS]) {
     std::lock_guard guard(cache_mutex);
     resolv_cache_info* info = find_cache_info_locked(netid);
+    if (info) {
+        memcpy(edns, info->nsedns, sizeof(info->nsedns));
+        return info->revision_id;
+    }
 
-    if (info && info->revision_id == revision_id) {
-        const int serverNum = std::min(MAXNS, static_cast<int>(info->nameserverSockAddrs.size()));
-        const IPSockAddr ipsa = IPSockAddr::toIPSockAddr(*sa);
-        for (int ns = 0; ns < serverNum; ns++) {
-            if (ipsa == info->nameserverSockAddrs.at(ns)) {
-                res_cache_add_stats_sample_locked(&info->nsstats[ns], sample, max_samples);
-                return;
-            }
-        }
+    return -1;
+}
+
+time_t resolv_cache_set_edns_unsupported(unsigned netid, int revision_id, const sockaddr* sa) {
+    if (sa == nullptr) return 0;
+
+    std::lock_guard guard(cache_mutex);
+    resolv_cache_info* info;
+    if (int ns = find_nameserver_locked(netid, revision_id, sa, &info); ns >= 0) {
+        LOG(INFO) << __func__ << ": server " << ns + 1 << " of netid " << netid
+                  << " rejected EDNS0";
+        info->nsedns[ns].no_edns_until = coarseMonotonicSec() + EDNS_REPROBE_INTERVAL;
+        return info->nsedns[ns].no_edns_until;
+    }
+    return 0;
+}
+
+time_t resolv_cache_set_edns_udp_payload(unsigned netid, int revision_id, const sockaddr* sa,
+                                         uint16_t udp_payload) {
+    if (sa == nullptr) return 0;
+
+    std::lock_guard guard(cache_mutex);
+    resolv_cache_info* info;
+    if (int ns = find_nameserver_locked(netid, revision_id, sa, &info); ns >= 0) {
+        info->nsedns[ns].udp_payload = udp_payload;
+        info->nsedns[ns].udp_payload_until = coarseMonotonicSec() + EDNS_REPROBE_INTERVAL;
+        info->nsedns[ns].udp_timeouts = 0;
+        return info->nsedns[ns].udp_payload_until;
+    }
+    return 0;
+}
+
+uint8_t resolv_cache_add_edns_udp_timeout(unsigned netid, int revision_id, const sockaddr* sa) {
+    if (sa == nullptr) return 0;
+
+    std::lock_guard guard(cache_mutex);
+    resolv_cache_info* info;
+    if (int ns = find_nameserver_locked(netid, revision_id, sa, &info); ns >= 0) {
+        uint8_t& timeouts = info->nsedns[ns].udp_timeouts;
+        if (timeouts < UINT8_MAX) ++timeouts;
+        return timeouts;
+    }
+    return 0;
+}
+
+void resolv_cache_set_edns_supported(unsigned netid, int revision_id, const sockaddr* sa,
+                                     uint16_t udp_payload) {
+    if (sa == nullptr) return;
+
+    std::lock_guard guard(cache_mutex);
+    resolv_cache_info* info;
+    if (int ns = find_nameserver_locked(netid, revision_id, sa, &info); ns >= 0) {
+        res_edns_info& edns = info->nsedns[ns];
+        edns.no_edns_until = 0;
+        edns.max_udp_payload = std::max(edns.max_udp_payload, udp_payload);
+        edns.udp_timeouts = 0;
     }
 }
 
@@ -1864,12 +2105,14 @@ int resolv_cache_get_expiration(unsigned netid, const std::vector<char>& query,
         return -ENODATA;
     }
 
-    if (_time_now() >= e->expires) {
+    const int64_t now = _time_now();
+    if (now >= e->expires) {
         LOG(WARNING) << __func__ << ": entry expired";
         return -ENODATA;
     }
 
-    *expiration = e->expires;
+    // Entries expire on the monotonic clock; report the matching wall clock time, rounded up.
+    *expiration = time(nullptr) + (e->expires - now + 999) / 1000;
     return 0;
 }
 
@@ -1904,9 +2147,39 @@ bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& serv
     return false;
 }
 
-void resolv_stats_dump(DumpWriter& dw, unsigned netid) {
+std::optional<std::chrono::microseconds> resolv_stats_get_latency_percentile(
+        unsigned netid, const IPSockAddr& server, android::net::Protocol protocol,
+        int percentile) {
     std::lock_guard guard(cache_mutex);
     if (const auto info = find_cache_info_locked(netid); info != nullptr) {
-        info->dnsStats->dump(dw);
+        return info->dnsStats->getLatencyPercentile(server, protocol, percentile);
+    }
+    return std::nullopt;
+}
+
+int resolv_stats_get_snapshot(unsigned netid, uint64_t sinceRevision,
+                              ResolvStatsSnapshot* snapshot) {
+    std::lock_guard guard(cache_mutex);
+    const auto info = find_cache_info_locked(netid);
+    if (info == nullptr) return -ENONET;
+
+    snapshot->revision = info->dnsStats->getRevision();
+    snapshot->servers = info->dnsStats->getStatsSince(sinceRevision, &snapshot->full);
+    snapshot->cacheEntries = info->cache->num_entries;
+    snapshot->cacheHits = info->cache->num_hits;
+    snapshot->cacheMisses = info->cache->num_lookups - info->cache->num_hits;
+    snapshot->waitForPendingReqTimeoutCount = info->wait_for_pending_req_timeout_count;
+    return 0;
+}
+
+void resolv_stats_dump(DumpWriter& dw, unsigned netid) {
+    // Format a copy, so that cache_mutex is not held while writing to a possibly slow reader.
+    std::optional<DnsStats> stats;
+    {
+        std::lock_guard guard(cache_mutex);
+        if (const auto info = find_cache_info_locked(netid); info != nullptr) {
+            stats = *info->dnsStats;
+        }
     }
+    if (stats) stats->dump(dw);
 }
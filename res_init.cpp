@@ -106,6 +106,7 @@ void res_init(ResState* statp, const struct android_net_context* _Nonnull netcon
 
     statp->ndots = 1;
     statp->_vcsock = -1;
+    statp->cancel_fd = -1;
 
     for (int ns = 0; ns < MAXNS; ns++) {
         statp->nssocks[ns] = -1;
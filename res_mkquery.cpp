@@ -242,3 +242,107 @@ int res_nopt(res_state statp, int n0, /* current offset in buffer */
     hp->arcount = htons(ntohs(hp->arcount) + 1);
     return (cp - buf);
 }
+
+// Header of a recursive QUERY with one question, in wire format. Only the ID, the AD bit and
+// ARCOUNT vary between the queries built by res_nmkquery_in().
+constexpr uint8_t kInQueryHeader[HFIXEDSZ] = {
+        0,    0,     // ID
+        0x01, 0x00,  // QR=0 OPCODE=QUERY AA=0 TC=0 RD=1, RA=0 Z=0 AD=0 CD=0 RCODE=NOERROR
+        0,    1,     // QDCOUNT
+        0,    0,     // ANCOUNT
+        0,    0,     // NSCOUNT
+        0,    0,     // ARCOUNT
+};
+constexpr uint8_t kHeaderAdBit = 0x20;
+// Root name, TYPE, CLASS, extended RCODE, version, flags, RDLEN, OPTION-CODE and OPTION-LENGTH.
+constexpr int kOptFixedSize = 1 + 2 * INT16SZ + 2 + 4 * INT16SZ;
+
+// Encodes |dname| as uncompressed labels at |cp|. Returns the encoded length, or -1 if the name
+// isn't a plain hostname (escapes, empty labels, the root name) or doesn't fit in |len| bytes, in
+// which case it has to go through ns_name_pton().
+static int encode_plain_name(const char* dname, uint8_t* cp, int len) {
+    const int limit = std::min(len, NS_MAXCDNAME);
+    int n = 0;
+    const char* label = dname;
+    while (*label != '\0') {
+        const char* end = label;
+        while (*end != '\0' && *end != '.') {
+            if (*end == '\\') return -1;
+            ++end;
+        }
+        const int labellen = end - label;
+        if (labellen == 0 || labellen > NS_MAXLABEL || n + 1 + labellen >= limit) return -1;
+        cp[n++] = labellen;
+        memcpy(cp + n, label, labellen);
+        n += labellen;
+        label = (*end == '.') ? end + 1 : end;
+    }
+    if (n == 0) return -1;
+    cp[n++] = 0;
+    return n;
+}
+
+template <bool kEdns0>
+static int mkquery_in(res_state statp, const char* dname, int type, uint8_t* buf, int buflen,
+                      int anslen) {
+    if (buf == nullptr || buflen < HFIXEDSZ + QFIXEDSZ) return -1;
+    uint8_t* cp = buf + HFIXEDSZ;
+    const int qnamelen = encode_plain_name(dname, cp, buflen - HFIXEDSZ - QFIXEDSZ);
+    if (qnamelen < 0) return -1;
+
+    int len = HFIXEDSZ + qnamelen + QFIXEDSZ;
+    uint16_t padlen = 0;
+    if constexpr (kEdns0) {
+        // Same padding as res_nopt(); the general path also handles a buffer too small for it.
+        const int minlen = len + kOptFixedSize;
+        padlen = (kEdns0Padding - minlen % kEdns0Padding) % kEdns0Padding;
+        if (minlen + padlen > buflen) return -1;
+        len = minlen + padlen;
+    }
+
+    memcpy(buf, kInQueryHeader, HFIXEDSZ);
+    HEADER* hp = reinterpret_cast<HEADER*>(buf);
+    hp->id = htons(arc4random_uniform(65536));
+    const bool dot = (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_DNS_OVER_TLS) != 0U;
+    if (dot) buf[3] |= kHeaderAdBit;
+    cp += qnamelen;
+    ns_put16(type, cp);
+    cp += INT16SZ;
+    ns_put16(ns_c_in, cp);
+    cp += INT16SZ;
+
+    if constexpr (kEdns0) {
+        if (anslen > 0xffff) anslen = 0xffff;
+        *cp++ = 0;  // "."
+        ns_put16(ns_t_opt, cp);
+        cp += INT16SZ;
+        ns_put16(anslen, cp);
+        cp += INT16SZ;
+        *cp++ = NOERROR;
+        *cp++ = 0;
+        ns_put16(dot ? NS_OPT_DNSSEC_OK : 0, cp);
+        cp += INT16SZ;
+        ns_put16(padlen + 2 * INT16SZ, cp);
+        cp += INT16SZ;
+        ns_put16(NS_OPT_PADDING, cp);
+        cp += INT16SZ;
+        ns_put16(padlen, cp);
+        cp += INT16SZ;
+        memset(cp, 0, padlen);
+        hp->arcount = htons(1);
+    }
+    return len;
+}
+
+int res_nmkquery_in(res_state statp, const char* dname, int type, uint8_t* buf, int buflen,
+                    int anslen, bool edns0) {
+    const int n = edns0 ? mkquery_in<true>(statp, dname, type, buf, buflen, anslen)
+                        : mkquery_in<false>(statp, dname, type, buf, buflen, anslen);
+    if (n > 0) return n;
+
+    // Names and buffers the fast path doesn't cover.
+    int len = res_nmkquery(QUERY, dname, ns_c_in, type, /*data=*/nullptr, /*datalen=*/0, buf,
+                           buflen, statp->netcontext_flags);
+    if (len > 0 && edns0) len = res_nopt(statp, len, buf, buflen, anslen);
+    return len;
+}
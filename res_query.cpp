@@ -117,13 +117,16 @@ again:
 
     LOG(DEBUG) << __func__ << ": (" << cl << ", " << type << ")";
 
-    n = res_nmkquery(QUERY, name, cl, type, /*data=*/nullptr, 0, buf, sizeof(buf),
-                     statp->netcontext_flags);
-    if (n > 0 &&
-        (statp->netcontext_flags &
-         (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
-        !retried)
-        n = res_nopt(statp, n, buf, sizeof(buf), anslen);
+    const bool edns0 = (statp->netcontext_flags &
+                        (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
+                       !retried;
+    if (cl == ns_c_in && (type == ns_t_a || type == ns_t_aaaa)) {
+        n = res_nmkquery_in(statp, name, type, buf, sizeof(buf), anslen, edns0);
+    } else {
+        n = res_nmkquery(QUERY, name, cl, type, /*data=*/nullptr, 0, buf, sizeof(buf),
+                         statp->netcontext_flags);
+        if (n > 0 && edns0) n = res_nopt(statp, n, buf, sizeof(buf), anslen);
+    }
     if (n <= 0) {
         LOG(DEBUG) << __func__ << ": mkquery failed";
         *herrno = NO_RECOVERY;
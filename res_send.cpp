@@ -76,6 +76,7 @@
 
 #define LOG_TAG "resolv"
 
+#include <sys/eventfd.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -94,7 +95,16 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <android-base/logging.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
 #include <android/multinetwork.h>  // ResNsendFlags
 
 #include <netdutils/Slice.h>
@@ -127,28 +137,54 @@ using android::net::NsRcode;
 using android::net::NsType;
 using android::net::PrivateDnsMode;
 using android::net::PrivateDnsModes;
-using android::net::PrivateDnsStatus;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
 using android::netdutils::IPSockAddr;
 using android::netdutils::Slice;
 using android::netdutils::Stopwatch;
 
-static DnsTlsDispatcher sDnsTlsDispatcher;
+static DnsTlsDispatcher& sDnsTlsDispatcher = DnsTlsDispatcher::getInstance();
+
+// A DoT query that keeps running on its own thread while the query is also sent in cleartext,
+// in opportunistic mode. The thread owns everything it touches, so it may outlive the caller.
+struct TlsRace {
+    // When the DoT query was started.
+    std::chrono::steady_clock::time_point start;
+    std::vector<uint8_t> query;
+    std::vector<uint8_t> answer;
+    NetworkDnsEventReported event;
+    // Becomes readable once the DoT query has succeeded, so that the cleartext exchanges can
+    // stop waiting for an answer that is no longer needed.
+    android::base::unique_fd answered;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    bool done GUARDED_BY(lock) = false;
+    DnsTlsTransport::Response response GUARDED_BY(lock) =
+            DnsTlsTransport::Response::internal_error;
+    int resplen GUARDED_BY(lock) = 0;
+};
 
 static struct sockaddr* get_nsaddr(res_state, size_t);
+static struct timespec get_timeout(res_state statp, const res_params* params, const int ns);
 static int send_vc(res_state, res_params* params, const uint8_t*, int, uint8_t*, int, int*, int,
                    time_t*, int*, int*);
 static int send_dg(res_state, res_params* params, const uint8_t*, int, uint8_t*, int, int*, int,
                    int*, int*, time_t*, int*, int*);
+static int setup_dg_socket(res_state statp, int ns, int* terrno);
 static void dump_error(const char*, const struct sockaddr*, int);
 
 static int sock_eq(struct sockaddr*, struct sockaddr*);
 static int connect_with_timeout(int sock, const struct sockaddr* nsap, socklen_t salen,
-                                const struct timespec timeout);
-static int retrying_poll(const int sock, short events, const struct timespec* finish);
+                                const struct timespec timeout, int cancel_fd);
+static int retrying_poll(const int sock, short events, const struct timespec* finish,
+                         int cancel_fd);
+static bool res_cancelled(res_state statp);
 static int res_tls_send(res_state, const Slice query, const Slice answer, int* rcode,
-                        bool* fallback);
+                        bool* fallback, std::shared_ptr<TlsRace>* race);
+static bool res_tls_race_wait(res_state statp, TlsRace* race, const Slice answer,
+                              std::chrono::steady_clock::time_point deadline,
+                              DnsTlsTransport::Response* response, int* resplen);
 
 NsType getQueryType(const uint8_t* msg, size_t msgLen) {
     ns_msg handle;
@@ -273,6 +309,99 @@ static int random_bind(int s, int family) {
 }
 /* BIONIC-END */
 
+// Returns the UDP payload size advertised by the EDNS0 OPT record that ends the query |buf|, or 0
+// if there is no such record. |*optoff| is set to the offset of the record.
+static int res_get_edns_payload(const uint8_t* buf, int buflen, int* optoff) {
+    const HEADER* hp = reinterpret_cast<const HEADER*>(buf);
+    if (buflen < HFIXEDSZ || hp->ancount != 0 || hp->nscount != 0 || ntohs(hp->arcount) != 1) {
+        return 0;
+    }
+    const uint8_t* cp = buf + HFIXEDSZ;
+    const uint8_t* eom = buf + buflen;
+    for (int qdcount = ntohs(hp->qdcount); qdcount > 0; qdcount--) {
+        const int n = dn_skipname(cp, eom);
+        if (n < 0 || eom - cp < n + QFIXEDSZ) return 0;
+        cp += n + QFIXEDSZ;
+    }
+    if (eom - cp < 1 + RRFIXEDSZ || cp[0] != 0 || ns_get16(cp + 1) != ns_t_opt) return 0;
+    *optoff = cp - buf;
+    return ns_get16(cp + 1 + INT16SZ);
+}
+
+// UDP payload size advertised to a server whose answers may have been lost to IP fragmentation.
+// Answers of this size aren't fragmented on common paths (DNS flag day 2020).
+constexpr uint16_t kEdnsSafeUdpPayload = 1232;
+
+// Consecutive timeouts of queries advertising a large UDP payload size after which a server is
+// sent kEdnsSafeUdpPayload instead. A single lost datagram says little about fragmentation.
+constexpr uint8_t kEdnsUdpTimeoutsBeforeSafePayload = 3;
+
+// Builds in |out| the query to send to a server in the EDNS0 state |edns|, which is null if
+// unknown, in place of |buf|. Only queries that carry an OPT record are adapted, so that answers
+// never hold an OPT record the caller didn't ask for. The record is dropped if the server recently
+// rejected EDNS0. Otherwise, over UDP, the payload size learned for the server is advertised.
+// Returns false if |buf| can be sent as is.
+static bool res_query_for_server(const uint8_t* buf, int buflen, const res_edns_info* edns,
+                                 bool udp, int anssiz, std::vector<uint8_t>* out) {
+    if (edns == nullptr) return false;
+    int optoff = 0;
+    const int payload = res_get_edns_payload(buf, buflen, &optoff);
+    if (payload == 0) return false;
+    const time_t now = coarseMonotonicSec();
+    if (edns->no_edns_until > now) {
+        out->assign(buf, buf + optoff);
+        reinterpret_cast<HEADER*>(out->data())->arcount = 0;
+        return true;
+    }
+
+    const int udpPayload = std::min<int>(edns->udp_payload, anssiz);
+    if (!udp || edns->udp_payload_until <= now || udpPayload <= PACKETSZ || udpPayload == payload) {
+        return false;
+    }
+    out->assign(buf, buf + buflen);
+    ns_put16(udpPayload, out->data() + optoff + 1 + INT16SZ);
+    return true;
+}
+
+// Records what the server |ns| told about its EDNS0 support when it was sent the query |buf| over
+// UDP: it |rejected| EDNS0, or send_dg() returned |resplen| and |rcode|, with a |truncated|
+// answer. The learned state is also applied to |edns|, so that the next attempt benefits from it.
+static void res_update_edns_info(res_state statp, int revision_id, res_edns_info* edns, int ns,
+                                 const uint8_t* buf, int buflen, bool rejected, int resplen,
+                                 bool truncated, int rcode) {
+    if (edns == nullptr) return;
+    int optoff = 0;
+    const int payload = res_get_edns_payload(buf, buflen, &optoff);
+    const sockaddr* nsap = get_nsaddr(statp, ns);
+    if (rejected) {
+        if (payload != 0) {
+            edns->no_edns_until =
+                    resolv_cache_set_edns_unsupported(statp->netid, revision_id, nsap);
+        }
+        return;
+    }
+
+    if (resplen == 0 && rcode == RCODE_TIMEOUT && payload > kEdnsSafeUdpPayload) {
+        edns->udp_timeouts = resolv_cache_add_edns_udp_timeout(statp->netid, revision_id, nsap);
+        // Advertise a payload size that doesn't risk fragmentation.
+        if (edns->udp_timeouts >= kEdnsUdpTimeoutsBeforeSafePayload &&
+            (edns->udp_payload != kEdnsSafeUdpPayload ||
+             edns->udp_payload_until <= coarseMonotonicSec())) {
+            edns->udp_payload_until = resolv_cache_set_edns_udp_payload(
+                    statp->netid, revision_id, nsap, kEdnsSafeUdpPayload);
+            edns->udp_payload = kEdnsSafeUdpPayload;
+            edns->udp_timeouts = 0;
+        }
+    } else if (resplen > 0 && !truncated && payload != 0 &&
+               (edns->no_edns_until != 0 || edns->max_udp_payload < payload ||
+                edns->udp_timeouts != 0)) {
+        resolv_cache_set_edns_supported(statp->netid, revision_id, nsap, payload);
+        edns->no_edns_until = 0;
+        edns->max_udp_payload = std::max<int>(edns->max_udp_payload, payload);
+        edns->udp_timeouts = 0;
+    }
+}
+
 // Disables all nameservers other than selectedServer
 static void res_set_usable_server(int selectedServer, int nscount, bool usable_servers[]) {
     int usableIndex = 0;
@@ -395,31 +524,29 @@ static DnsQueryEvent* addDnsQueryEvent(NetworkDnsEventReported* event) {
     return event->mutable_dns_query_events()->add_dns_query_event();
 }
 
-int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int anssiz, int* rcode,
-              uint32_t flags) {
-    LOG(DEBUG) << __func__;
-
-    // Should not happen
-    if (anssiz < HFIXEDSZ) {
-        // TODO: Remove errno once callers stop using it
-        errno = EINVAL;
-        return -EINVAL;
-    }
+// Looks up |buf| in the cache and, if private DNS is in use, sends it over TLS. Returns the length
+// of the answer if one was found, a negative errno if the query failed and must not be retried
+// in cleartext, or 0 if it should be sent to the cleartext nameservers. In the latter case, if
+// |race| is not null, it may be set to a DoT query that is still running and can still provide
+// an answer.
+static int res_nsend_cache_or_tls(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans,
+                                  int anssiz, int* rcode, uint32_t flags,
+                                  ResolvCacheStatus* cache_status,
+                                  std::shared_ptr<TlsRace>* race) {
     res_pquery(buf, buflen);
 
     int anslen = 0;
     Stopwatch cacheStopwatch;
-    ResolvCacheStatus cache_status =
-            resolv_cache_lookup(statp->netid, buf, buflen, ans, anssiz, &anslen, flags);
+    *cache_status = resolv_cache_lookup(statp->netid, buf, buflen, ans, anssiz, &anslen, flags);
     const int32_t cacheLatencyUs = saturate_cast<int32_t>(cacheStopwatch.timeTakenUs());
-    if (cache_status == RESOLV_CACHE_FOUND) {
+    if (*cache_status == RESOLV_CACHE_FOUND) {
         HEADER* hp = (HEADER*)(void*)ans;
         *rcode = hp->rcode;
         DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
         dnsQueryEvent->set_latency_micros(cacheLatencyUs);
-        dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
+        dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(*cache_status));
         return anslen;
-    } else if (cache_status != RESOLV_CACHE_UNSUPPORTED) {
+    } else if (*cache_status != RESOLV_CACHE_UNSUPPORTED) {
         // had a cache miss for a known network, so populate the thread private
         // data so the normal resolve path can do its thing
         resolv_populate_res_for_net(statp);
@@ -439,11 +566,11 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
     if (!(statp->netcontext_flags & NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS)) {
         bool fallback = false;
         int resplen = res_tls_send(statp, Slice(const_cast<uint8_t*>(buf), buflen),
-                                   Slice(ans, anssiz), rcode, &fallback);
+                                   Slice(ans, anssiz), rcode, &fallback, race);
         if (resplen > 0) {
             LOG(DEBUG) << __func__ << ": got answer from DoT";
             res_pquery(ans, resplen);
-            if (cache_status == RESOLV_CACHE_NOTFOUND) {
+            if (*cache_status == RESOLV_CACHE_NOTFOUND) {
                 resolv_cache_add(statp->netid, buf, buflen, ans, resplen);
             }
             return resplen;
@@ -453,7 +580,58 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
             return -ETIMEDOUT;
         }
     }
+    return 0;
+}
+
+// Records the outcome of one attempt to send |buf| to nameserver |ns|. The sample is only added
+// to the server statistics if |shouldRecordStats| is true.
+static void res_record_attempt(res_state statp, const res_params& params, int revision_id,
+                               ResolvCacheStatus cache_status, const uint8_t* buf, int buflen,
+                               int ns, int attempt, ::android::net::Protocol query_proto,
+                               int64_t latencyUs, time_t now, int rcode, int delay,
+                               bool shouldRecordStats) {
+    const sockaddr* nsap = get_nsaddr(statp, ns);
+    DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
+    dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
+    dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(latencyUs));
+    dnsQueryEvent->set_dns_server_index(ns);
+    dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(nsap->sa_family));
+    dnsQueryEvent->set_retry_times(attempt);
+    dnsQueryEvent->set_rcode(static_cast<NsRcode>(rcode));
+    dnsQueryEvent->set_protocol(query_proto);
+    dnsQueryEvent->set_type(getQueryType(buf, buflen));
+
+    // Only record stats the first time we try a query. This ensures that
+    // queries that deterministically fail (e.g., a name that always returns
+    // SERVFAIL or times out) do not unduly affect the stats.
+    if (shouldRecordStats) {
+        res_sample sample;
+        _res_stats_set_sample(&sample, now, rcode, delay);
+        resolv_cache_add_resolver_stats_sample(statp->netid, revision_id, nsap, sample,
+                                               params.max_samples);
+        resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(*nsap), dnsQueryEvent);
+    }
+}
+
+// Returns the longest time res_nsend_cleartext() may wait for answers to a query: the timeouts
+// of all the nameservers, over all the retries.
+static std::chrono::milliseconds res_query_timeout(res_state statp, const res_params& params,
+                                                   uint32_t flags) {
+    const int retryTimes = (flags & ANDROID_RESOLV_NO_RETRY) ? 1 : params.retry_count;
+    std::chrono::milliseconds timeout(0);
+    for (int ns = 0; ns < statp->nscount; ++ns) {
+        const timespec t = get_timeout(statp, &params, ns);
+        timeout += std::chrono::seconds(t.tv_sec) +
+                   std::chrono::duration_cast<std::chrono::milliseconds>(
+                           std::chrono::nanoseconds(t.tv_nsec));
+    }
+    return timeout * retryTimes;
+}
 
+// Sends |buf| to the cleartext nameservers, one server at a time, retrying as configured.
+static int res_nsend_cleartext(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans,
+                               int anssiz, int* rcode, uint32_t flags,
+                               ResolvCacheStatus cache_status) {
     res_stats stats[MAXNS];
     res_params params;
     int revision_id = resolv_cache_get_resolver_stats(statp->netid, &params, stats);
@@ -474,6 +652,10 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
         res_set_usable_server(selectedServer, statp->nscount, usable_servers);
     }
 
+    res_edns_info edns[MAXNS];
+    const bool ednsKnown = resolv_cache_get_edns_info(statp->netid, edns) == revision_id;
+    std::vector<uint8_t> serverQuery;
+
     // Send request, RETRY times, or until successful.
     int retryTimes = (flags & ANDROID_RESOLV_NO_RETRY) ? 1 : params.retry_count;
     int useTcp = buflen > PACKETSZ;
@@ -502,41 +684,45 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
             bool fallbackTCP = false;
             const bool shouldRecordStats = (attempt == 0);
             int resplen;
+            // Adapt the EDNS0 OPT record to what is known of the server.
+            res_edns_info* nsEdns = ednsKnown ? &edns[ns] : nullptr;
+            const bool adapted =
+                    res_query_for_server(buf, buflen, nsEdns, !useTcp, anssiz, &serverQuery);
+            const uint8_t* sendbuf = adapted ? serverQuery.data() : buf;
+            const int sendlen = adapted ? serverQuery.size() : buflen;
             Stopwatch queryStopwatch;
             if (useTcp) {
                 // TCP; at most one attempt per server.
                 attempt = retryTimes;
-                resplen = send_vc(statp, &params, buf, buflen, ans, anssiz, &terrno, ns, &now,
+                resplen = send_vc(statp, &params, sendbuf, sendlen, ans, anssiz, &terrno, ns, &now,
                                   rcode, &delay);
             } else {
                 // UDP
-                resplen = send_dg(statp, &params, buf, buflen, ans, anssiz, &terrno, ns, &useTcp,
-                                  &gotsomewhere, &now, rcode, &delay);
+                const uint32_t ednsErr = statp->_flags & RES_F_EDNS0ERR;
+                statp->_flags &= ~RES_F_EDNS0ERR;
+                resplen = send_dg(statp, &params, sendbuf, sendlen, ans, anssiz, &terrno, ns,
+                                  &useTcp, &gotsomewhere, &now, rcode, &delay);
                 fallbackTCP = useTcp ? true : false;
+                res_update_edns_info(statp, revision_id, nsEdns, ns, sendbuf, sendlen,
+                                     statp->_flags & RES_F_EDNS0ERR, resplen, fallbackTCP,
+                                     *rcode);
+                statp->_flags |= ednsErr;
             }
             LOG(INFO) << __func__ << ": used send_" << ((useTcp) ? "vc " : "dg ") << resplen;
 
-            DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
-            dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
-            dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(queryStopwatch.timeTakenUs()));
-            dnsQueryEvent->set_dns_server_index(ns);
-            dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(nsap->sa_family));
-            dnsQueryEvent->set_retry_times(attempt);
-            dnsQueryEvent->set_rcode(static_cast<NsRcode>(*rcode));
-            dnsQueryEvent->set_protocol(query_proto);
-            dnsQueryEvent->set_type(getQueryType(buf, buflen));
-
-            // Only record stats the first time we try a query. This ensures that
-            // queries that deterministically fail (e.g., a name that always returns
-            // SERVFAIL or times out) do not unduly affect the stats.
-            if (shouldRecordStats) {
-                res_sample sample;
-                _res_stats_set_sample(&sample, now, *rcode, delay);
-                resolv_cache_add_resolver_stats_sample(statp->netid, revision_id, nsap, sample,
-                                                       params.max_samples);
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(*nsap), dnsQueryEvent);
+            if (resplen == 0 && res_cancelled(statp)) {
+                // The racing DoT query got the answer. This attempt was cut short, so it says
+                // nothing about the server.
+                LOG(DEBUG) << __func__ << ": cancelled";
+                res_nclose(statp);
+                errno = ECANCELED;
+                return -ECANCELED;
             }
 
+            res_record_attempt(statp, params, revision_id, cache_status, buf, buflen, ns, attempt,
+                               query_proto, queryStopwatch.timeTakenUs(), now, *rcode, delay,
+                               shouldRecordStats);
+
             if (resplen == 0) continue;
             if (fallbackTCP) {
                 ns--;
@@ -569,6 +755,421 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
     return -terrno;
 }
 
+int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int anssiz, int* rcode,
+              uint32_t flags) {
+    LOG(DEBUG) << __func__;
+
+    // Should not happen
+    if (anssiz < HFIXEDSZ) {
+        // TODO: Remove errno once callers stop using it
+        errno = EINVAL;
+        return -EINVAL;
+    }
+
+    ResolvCacheStatus cache_status;
+    std::shared_ptr<TlsRace> race;
+    if (int resplen = res_nsend_cache_or_tls(statp, buf, buflen, ans, anssiz, rcode, flags,
+                                             &cache_status, &race);
+        resplen != 0) {
+        return resplen;
+    }
+    // Cleartext stops waiting for answers as soon as the DoT query that is racing it succeeds.
+    if (race != nullptr) statp->cancel_fd = race->answered.get();
+    const int resplen =
+            res_nsend_cleartext(statp, buf, buflen, ans, anssiz, rcode, flags, cache_status);
+    statp->cancel_fd = -1;
+    if (resplen > 0 || race == nullptr) return resplen;
+
+    // Cleartext failed or was cancelled, but the DoT query that was racing it may still succeed.
+    // It gets as long as the query may take in cleartext, counted from when it was started.
+    res_stats stats[MAXNS];
+    res_params params;
+    const auto timeout = resolv_cache_get_resolver_stats(statp->netid, &params, stats) < 0
+                                 ? std::chrono::milliseconds(0)
+                                 : res_query_timeout(statp, params, flags);
+    DnsTlsTransport::Response response = DnsTlsTransport::Response::internal_error;
+    int tlsResplen = 0;
+    res_tls_race_wait(statp, race.get(), Slice(ans, anssiz), race->start + timeout, &response,
+                      &tlsResplen);
+    if (response == DnsTlsTransport::Response::success) {
+        LOG(DEBUG) << __func__ << ": got answer from racing DoT query";
+        *rcode = reinterpret_cast<HEADER*>(ans)->rcode;
+        res_pquery(ans, tlsResplen);
+        if (cache_status == RESOLV_CACHE_NOTFOUND) {
+            resolv_cache_add(statp->netid, buf, buflen, ans, tlsResplen);
+        }
+        return tlsResplen;
+    }
+    return resplen;
+}
+
+// State of one query sent by res_nsend_cleartext_pipelined().
+struct PipelinedQuery {
+    ResSendTarget* target;
+    ResolvCacheStatus cache_status;
+    int terrno = ETIMEDOUT;
+    bool gotsomewhere = false;
+    bool done = false;
+    // Set once the query got a truncated answer. Like res_nsend(), it is then sent over TCP to
+    // each remaining server of the same attempt, and not retried after that.
+    bool useTcp = false;
+    int tcpAttempt = 0;
+    // State of the current UDP exchange. The query sent may have been adapted to the EDNS0
+    // support of the server, see res_query_for_server().
+    std::vector<uint8_t> serverQuery;
+    bool adapted = false;
+    bool sent = false;
+    bool waiting = false;
+    int resplen = 0;
+    int delay = 0;
+    timespec start = {};
+    timespec finish = {};
+
+    const uint8_t* sendbuf() const { return adapted ? serverQuery.data() : target->query; }
+    int sendlen() const { return adapted ? serverQuery.size() : target->querylen; }
+};
+
+// Sends all of |queries| over UDP to each nameserver in turn. All of them are put on the same
+// socket before waiting, and the answers are matched to the queries by ID and question, so that
+// the lookup costs about one round trip instead of one per query.
+static void res_nsend_cleartext_pipelined(res_state statp, std::vector<PipelinedQuery>& queries) {
+    res_stats stats[MAXNS];
+    res_params params;
+    int revision_id = resolv_cache_get_resolver_stats(statp->netid, &params, stats);
+    if (revision_id < 0) {
+        for (auto& q : queries) {
+            q.done = true;
+            q.target->resplen = -ESRCH;
+        }
+        // TODO: Remove errno once callers stop using it
+        errno = ESRCH;
+        return;
+    }
+    bool usable_servers[MAXNS];
+    android_net_res_stats_get_usable_servers(&params, stats, statp->nscount, usable_servers);
+    res_edns_info edns[MAXNS];
+    const bool ednsKnown = resolv_cache_get_edns_info(statp->netid, edns) == revision_id;
+
+    int anssiz = 0;
+    for (const auto& q : queries) anssiz = std::max(anssiz, q.target->anssiz);
+    // One receive buffer per query, so that recvmmsg() can return all pending answers at once.
+    std::vector<uint8_t> ans(queries.size() * anssiz);
+    std::vector<sockaddr_storage> from(queries.size());
+
+    const auto allDone = [&queries]() {
+        return std::all_of(queries.begin(), queries.end(),
+                           [](const PipelinedQuery& q) { return q.done; });
+    };
+
+    for (int attempt = 0; attempt < params.retry_count && !allDone(); ++attempt) {
+        for (int ns = 0; ns < statp->nscount && !allDone(); ++ns) {
+            if (!usable_servers[ns]) continue;
+            const bool shouldRecordStats = (attempt == 0);
+            const time_t now = coarseMonotonicSec();
+            const timespec timeout = get_timeout(statp, &params, ns);
+            res_edns_info* nsEdns = ednsKnown ? &edns[ns] : nullptr;
+
+            int sock = -1;
+            bool sendError = false;
+            bool sockError = false;
+            if (std::any_of(queries.begin(), queries.end(),
+                            [](const PipelinedQuery& q) { return !q.done && !q.useTcp; })) {
+                int terrno = ETIMEDOUT;
+                if (int ret = setup_dg_socket(statp, ns, &terrno); ret > 0) {
+                    sock = statp->nssocks[ns];
+                } else if (ret < 0) {
+                    for (auto& q : queries) {
+                        if (q.done || q.useTcp) continue;
+                        q.done = true;
+                        q.target->resplen = -terrno;
+                    }
+                }
+            }
+
+            // Put all the queries on the wire with as few sendmmsg() calls as possible.
+            std::vector<PipelinedQuery*> batch;
+            for (auto& q : queries) {
+                q.sent = q.waiting = false;
+                if (sock < 0 || q.done || q.useTcp) continue;
+                ResSendTarget* t = q.target;
+                t->rcode = RCODE_INTERNAL_ERROR;
+                q.resplen = 0;
+                q.delay = 0;
+                q.start = evNowTime();
+                q.finish = evAddTime(q.start, timeout);
+                q.sent = true;
+                q.adapted = res_query_for_server(t->query, t->querylen, nsEdns, /*udp=*/true,
+                                                 t->anssiz, &q.serverQuery);
+                batch.push_back(&q);
+            }
+            std::vector<iovec> iovs(batch.size());
+            std::vector<mmsghdr> msgs(batch.size());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                const PipelinedQuery& q = *batch[i];
+                iovs[i] = {.iov_base = const_cast<uint8_t*>(q.sendbuf()),
+                           .iov_len = static_cast<size_t>(q.sendlen())};
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int waiting = 0;
+            for (size_t i = 0; i < batch.size();) {
+                const int n = sendmmsg(sock, &msgs[i], batch.size() - i, 0);
+                if (n <= 0) {
+                    // Skip the datagram that couldn't be sent and carry on with the rest.
+                    PLOG(DEBUG) << __func__ << ": sendmmsg: ";
+                    sendError = true;
+                    ++i;
+                    continue;
+                }
+                for (const size_t end = i + n; i < end; ++i) {
+                    batch[i]->waiting = true;
+                    ++waiting;
+                }
+            }
+
+            // Handles one datagram received from the server.
+            const auto handleAnswer = [&](const uint8_t* answer, int resplen, const sockaddr* src) {
+                const HEADER* anhp = reinterpret_cast<const HEADER*>(answer);
+                for (auto& q : queries) {
+                    if (q.waiting) q.gotsomewhere = true;
+                }
+                if (resplen < HFIXEDSZ) {
+                    LOG(DEBUG) << __func__ << ": undersized: " << resplen;
+                    return;
+                }
+                if (!res_ourserver_p(statp, src)) {
+                    LOG(DEBUG) << __func__ << ": not our server:";
+                    res_pquery(answer, std::min(resplen, anssiz));
+                    return;
+                }
+
+                // FORMERR answers don't carry the question section, see send_dg().
+                const bool ednsFormErr = anhp->rcode == FORMERR &&
+                                         (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_EDNS);
+                auto match = std::find_if(
+                        queries.begin(), queries.end(), [&](const PipelinedQuery& q) {
+                            const ResSendTarget* t = q.target;
+                            return q.waiting &&
+                                   reinterpret_cast<const HEADER*>(t->query)->id == anhp->id &&
+                                   (ednsFormErr ||
+                                    res_queriesmatch(t->query, t->query + t->querylen, answer,
+                                                     answer + anssiz) > 0);
+                        });
+                if (match == queries.end()) {
+                    LOG(DEBUG) << __func__ << ": old answer or wrong query name:";
+                    res_pquery(answer, std::min(resplen, anssiz));
+                    return;
+                }
+
+                PipelinedQuery& q = *match;
+                ResSendTarget* t = q.target;
+                q.waiting = false;
+                --waiting;
+                // Like send_dg(), leave even rejected answers in the answer buffer for the caller.
+                memcpy(t->answer, answer, std::min(resplen, t->anssiz));
+                if (ednsFormErr) {
+                    LOG(DEBUG) << __func__ << ": server rejected query with EDNS0:";
+                    res_pquery(answer, std::min(resplen, anssiz));
+                    t->edns0Error = true;
+                    statp->_flags |= RES_F_EDNS0ERR;
+                    res_update_edns_info(statp, revision_id, nsEdns, ns, q.sendbuf(), q.sendlen(),
+                                         /*rejected=*/true, 0, false, anhp->rcode);
+                    return;
+                }
+                const timespec done = evNowTime();
+                q.delay = _res_stats_calculate_rtt(&done, &q.start);
+                t->rcode = anhp->rcode;
+                if (anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED) {
+                    LOG(DEBUG) << __func__ << ": server rejected query:";
+                    res_pquery(answer, std::min(resplen, anssiz));
+                    return;
+                }
+                res_update_edns_info(statp, revision_id, nsEdns, ns, q.sendbuf(), q.sendlen(),
+                                     /*rejected=*/false, resplen, anhp->tc, anhp->rcode);
+                if (anhp->tc) {
+                    LOG(DEBUG) << __func__ << ": truncated answer";
+                    q.useTcp = true;
+                    q.tcpAttempt = attempt;
+                    return;
+                }
+                // The receive buffer is sized for the largest answer buffer, so the answer may
+                // not fit in the one of this query. Only the part copied to it is returned.
+                q.resplen = std::min(resplen, t->anssiz);
+            };
+
+            // Wait for the answers. Each query gives up when its own deadline expires. Every
+            // wakeup drains all the datagrams already queued on the socket with one recvmmsg().
+            while (waiting > 0 && !sockError) {
+                timespec finish = {};
+                for (const auto& q : queries) {
+                    if (!q.waiting) continue;
+                    if (finish.tv_sec == 0 || evCmpTime(q.finish, finish) < 0) finish = q.finish;
+                }
+                const int n = retrying_poll(sock, POLLIN, &finish, statp->cancel_fd);
+                if (n < 0) {
+                    PLOG(DEBUG) << __func__ << ": poll: ";
+                    sockError = true;
+                    break;
+                }
+                if (n == 0) {
+                    const timespec tnow = evNowTime();
+                    for (auto& q : queries) {
+                        if (!q.waiting || evCmpTime(q.finish, tnow) > 0) continue;
+                        LOG(DEBUG) << __func__ << ": timeout";
+                        q.target->rcode = RCODE_TIMEOUT;
+                        res_update_edns_info(statp, revision_id, nsEdns, ns, q.sendbuf(),
+                                             q.sendlen(), /*rejected=*/false, 0, false,
+                                             RCODE_TIMEOUT);
+                        q.gotsomewhere = true;
+                        q.waiting = false;
+                        --waiting;
+                    }
+                    continue;
+                }
+
+                const int nbufs = waiting;
+                for (int i = 0; i < nbufs; ++i) {
+                    iovs[i] = {.iov_base = &ans[i * anssiz],
+                               .iov_len = static_cast<size_t>(anssiz)};
+                    msgs[i] = {};
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_hdr.msg_name = &from[i];
+                    msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+                }
+                const int received = recvmmsg(sock, msgs.data(), nbufs, MSG_DONTWAIT, nullptr);
+                if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    // Spurious wakeup, or the datagram was dropped (e.g. bad checksum).
+                    continue;
+                }
+                if (received <= 0) {
+                    PLOG(DEBUG) << __func__ << ": recvmmsg: ";
+                    sockError = true;
+                    break;
+                }
+                for (int i = 0; i < received; ++i) {
+                    handleAnswer(&ans[i * anssiz], msgs[i].msg_len,
+                                 reinterpret_cast<const sockaddr*>(&from[i]));
+                }
+            }
+
+            for (auto& q : queries) {
+                if (!q.sent) continue;
+                ResSendTarget* t = q.target;
+                const timespec elapsed = evSubTime(evNowTime(), q.start);
+                res_record_attempt(statp, params, revision_id, q.cache_status, t->query,
+                                   t->querylen, ns, attempt, PROTO_UDP,
+                                   elapsed.tv_sec * 1000000LL + elapsed.tv_nsec / 1000, now,
+                                   t->rcode, q.delay, shouldRecordStats);
+                if (q.resplen > 0) {
+                    q.done = true;
+                    t->resplen = q.resplen;
+                }
+            }
+            if (sendError || sockError) res_nclose(statp);
+
+            // Queries with truncated answers are retried over TCP with the same server right
+            // away, one at a time.
+            for (auto& q : queries) {
+                if (q.done || !q.useTcp || q.tcpAttempt != attempt) continue;
+                ResSendTarget* t = q.target;
+                time_t at = 0;
+                Stopwatch queryStopwatch;
+                t->rcode = RCODE_INTERNAL_ERROR;
+                const int resplen = send_vc(statp, &params, t->query, t->querylen, t->answer,
+                                            t->anssiz, &q.terrno, ns, &at, &t->rcode, &q.delay);
+                res_record_attempt(statp, params, revision_id, q.cache_status, t->query,
+                                   t->querylen, ns, attempt, PROTO_TCP,
+                                   queryStopwatch.timeTakenUs(), at, t->rcode, q.delay,
+                                   shouldRecordStats);
+                if (resplen != 0) {
+                    q.done = true;
+                    t->resplen = (resplen > 0) ? resplen : -q.terrno;
+                }
+            }
+        }  // for each ns
+    }  // for each retry
+    res_nclose(statp);
+
+    for (auto& q : queries) {
+        if (q.done) continue;
+        const int terrno = q.useTcp ? q.terrno : q.gotsomewhere ? ETIMEDOUT : ECONNREFUSED;
+        q.target->resplen = -terrno;
+        // TODO: Remove errno once callers stop using it
+        errno = terrno;
+    }
+}
+
+int res_nsendN(res_state statp, ResSendTarget* targets, int ntargets, uint32_t flags) {
+    LOG(DEBUG) << __func__ << ": " << ntargets << " queries";
+
+    // RES_F_EDNS0ERR is shared by all the queries, so it is cleared before each query sent on its
+    // own and saved in the target, then set again at the end if any query was rejected.
+    const uint32_t ednsErr = statp->_flags & RES_F_EDNS0ERR;
+    const auto sendOne = [statp](ResSendTarget* t, const auto& send) {
+        statp->_flags &= ~RES_F_EDNS0ERR;
+        t->resplen = send();
+        t->edns0Error = statp->_flags & RES_F_EDNS0ERR;
+    };
+
+    std::vector<PipelinedQuery> pending;
+    for (int i = 0; i < ntargets; i++) {
+        ResSendTarget* t = &targets[i];
+        t->rcode = NOERROR;
+        t->edns0Error = false;
+        if (t->anssiz < HFIXEDSZ) {
+            t->resplen = -EINVAL;
+            continue;
+        }
+        ResolvCacheStatus cache_status;
+        sendOne(t, [&] {
+            return res_nsend_cache_or_tls(statp, t->query, t->querylen, t->answer, t->anssiz,
+                                          &t->rcode, flags, &cache_status, nullptr);
+        });
+        if (t->resplen != 0) continue;
+
+        // Queries that need TCP from the start are not worth pipelining.
+        if (t->querylen > PACKETSZ || (flags & ANDROID_RESOLV_NO_RETRY)) {
+            sendOne(t, [&] {
+                return res_nsend_cleartext(statp, t->query, t->querylen, t->answer, t->anssiz,
+                                           &t->rcode, flags, cache_status);
+            });
+            continue;
+        }
+        pending.push_back({.target = t, .cache_status = cache_status});
+    }
+
+    if (pending.size() == 1) {
+        ResSendTarget* t = pending[0].target;
+        sendOne(t, [&] {
+            return res_nsend_cleartext(statp, t->query, t->querylen, t->answer, t->anssiz,
+                                       &t->rcode, flags, pending[0].cache_status);
+        });
+    } else if (!pending.empty()) {
+        res_nsend_cleartext_pipelined(statp, pending);
+        for (const auto& q : pending) {
+            const ResSendTarget* t = q.target;
+            if (t->resplen > 0) {
+                LOG(DEBUG) << __func__ << ": got answer:";
+                res_pquery(t->answer, std::min(t->resplen, t->anssiz));
+                if (q.cache_status == RESOLV_CACHE_NOTFOUND) {
+                    resolv_cache_add(statp->netid, t->query, t->querylen, t->answer, t->resplen);
+                }
+            } else {
+                _resolv_cache_query_failed(statp->netid, t->query, t->querylen, flags);
+            }
+        }
+    }
+
+    int answered = 0;
+    statp->_flags |= ednsErr;
+    for (int i = 0; i < ntargets; i++) {
+        if (targets[i].resplen > 0) ++answered;
+        if (targets[i].edns0Error) statp->_flags |= RES_F_EDNS0ERR;
+    }
+    return answered;
+}
+
 /* Private */
 
 static struct sockaddr* get_nsaddr(res_state statp, size_t n) {
@@ -599,7 +1200,7 @@ static struct timespec get_timeout(res_state statp, const res_params* params, co
 static int send_vc(res_state statp, res_params* params, const uint8_t* buf, int buflen,
                    uint8_t* ans, int anssiz, int* terrno, int ns, time_t* at, int* rcode,
                    int* delay) {
-    *at = time(NULL);
+    *at = coarseMonotonicSec();
     *delay = 0;
     const HEADER* hp = (const HEADER*) (const void*) buf;
     HEADER* anhp = (HEADER*) (void*) ans;
@@ -637,7 +1238,7 @@ same_ns:
     if (statp->_vcsock < 0 || (statp->_flags & RES_F_VC) == 0) {
         if (statp->_vcsock >= 0) res_nclose(statp);
 
-        statp->_vcsock = socket(nsap->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        statp->_vcsock = socket(nsap->sa_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
         if (statp->_vcsock < 0) {
             switch (errno) {
                 case EPROTONOSUPPORT:
@@ -668,7 +1269,7 @@ same_ns:
             return (0);
         }
         if (connect_with_timeout(statp->_vcsock, nsap, (socklen_t) nsaplen,
-                                 get_timeout(statp, params, ns)) < 0) {
+                                 get_timeout(statp, params, ns), statp->cancel_fd) < 0) {
             *terrno = errno;
             dump_error("connect/vc", nsap, nsaplen);
             res_nclose(statp);
@@ -704,6 +1305,14 @@ same_ns:
      * Receive length & response
      */
 read_len:
+    // The socket is blocking, so only wait for the answer in poll() when it may be cancelled.
+    if (statp->cancel_fd != -1 && retrying_poll(statp->_vcsock, POLLIN, nullptr,
+                                                statp->cancel_fd) < 0) {
+        *terrno = errno;
+        PLOG(DEBUG) << __func__ << ": poll: ";
+        res_nclose(statp);
+        return (0);
+    }
     cp = ans;
     len = INT16SZ;
     while ((n = read(statp->_vcsock, (char*) cp, (size_t) len)) > 0) {
@@ -802,12 +1411,11 @@ read_len:
 
 /* return -1 on error (errno set), 0 on success */
 static int connect_with_timeout(int sock, const sockaddr* nsap, socklen_t salen,
-                                const timespec timeout) {
-    int res, origflags;
-
-    origflags = fcntl(sock, F_GETFL, 0);
-    fcntl(sock, F_SETFL, origflags | O_NONBLOCK);
+                                const timespec timeout, int cancel_fd) {
+    int res;
 
+    // The socket is created with SOCK_NONBLOCK and no other status flags, so switching back to
+    // blocking mode only needs a single F_SETFL.
     res = connect(sock, nsap, salen);
     if (res < 0 && errno != EINPROGRESS) {
         res = -1;
@@ -817,30 +1425,44 @@ static int connect_with_timeout(int sock, const sockaddr* nsap, socklen_t salen,
         timespec now = evNowTime();
         timespec finish = evAddTime(now, timeout);
         LOG(INFO) << __func__ << ": " << sock << " send_vc";
-        res = retrying_poll(sock, POLLIN | POLLOUT, &finish);
+        res = retrying_poll(sock, POLLIN | POLLOUT, &finish, cancel_fd);
         if (res <= 0) {
             res = -1;
         }
     }
 done:
-    fcntl(sock, F_SETFL, origflags);
+    if (fcntl(sock, F_SETFL, 0) < 0 && res >= 0) {
+        res = -1;
+    }
     LOG(INFO) << __func__ << ": " << sock << " connect_with_const timeout returning " << res;
     return res;
 }
 
-static int retrying_poll(const int sock, const short events, const struct timespec* finish) {
+// Waits for |events| on |sock| until |finish|, or forever if |finish| is null. Fails with
+// ECANCELED as soon as |cancel_fd| is readable, unless it is -1.
+static int retrying_poll(const int sock, const short events, const struct timespec* finish,
+                         int cancel_fd) {
     struct timespec now, timeout;
 
 retry:
     LOG(INFO) << __func__ << ": " << sock << " retrying_poll";
 
-    now = evNowTime();
-    if (evCmpTime(*finish, now) > 0)
-        timeout = evSubTime(*finish, now);
-    else
-        timeout = evConsTime(0L, 0L);
-    struct pollfd fds = {.fd = sock, .events = events};
-    int n = ppoll(&fds, 1, &timeout, /*sigmask=*/NULL);
+    if (finish != nullptr) {
+        now = evNowTime();
+        if (evCmpTime(*finish, now) > 0)
+            timeout = evSubTime(*finish, now);
+        else
+            timeout = evConsTime(0L, 0L);
+    }
+    // poll() ignores the entry of a negative |cancel_fd|.
+    struct pollfd pfds[] = {{.fd = sock, .events = events}, {.fd = cancel_fd, .events = POLLIN}};
+    int n = ppoll(pfds, std::size(pfds), finish != nullptr ? &timeout : nullptr,
+                  /*sigmask=*/NULL);
+    if (n > 0 && (pfds[1].revents & POLLIN)) {
+        LOG(INFO) << __func__ << ": " << sock << " retrying_poll cancelled";
+        errno = ECANCELED;
+        return -1;
+    }
     if (n == 0) {
         LOG(INFO) << __func__ << ": " << sock << "retrying_poll timeout";
         errno = ETIMEDOUT;
@@ -851,7 +1473,11 @@ retry:
         PLOG(INFO) << __func__ << ": " << sock << " retrying_poll failed";
         return n;
     }
-    if (fds.revents & (POLLIN | POLLOUT | POLLERR)) {
+    // A pending socket error always sets POLLERR, so plain readability on a datagram socket
+    // doesn't need the extra getsockopt(); recvfrom() reports any error that races with it.
+    // Connection completion (POLLOUT) is only visible through SO_ERROR.
+    const short revents = pfds[0].revents;
+    if ((revents & POLLERR) || ((events & POLLOUT) && (revents & (POLLIN | POLLOUT)))) {
         int error;
         socklen_t len = sizeof(error);
         if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
@@ -864,22 +1490,11 @@ retry:
     return n;
 }
 
-static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int buflen,
-                   uint8_t* ans, int anssiz, int* terrno, int ns, int* v_circuit, int* gotsomewhere,
-                   time_t* at, int* rcode, int* delay) {
-    *at = time(NULL);
-    *delay = 0;
-    const HEADER* hp = (const HEADER*) (const void*) buf;
-    HEADER* anhp = (HEADER*) (void*) ans;
-    const struct sockaddr* nsap;
-    int nsaplen;
-    struct timespec now, timeout, finish, done;
-    struct sockaddr_storage from;
-    socklen_t fromlen;
-    int resplen, n, s;
-
-    nsap = get_nsaddr(statp, (size_t) ns);
-    nsaplen = sockaddrSize(nsap);
+// Opens and connects the UDP socket to nameserver |ns| if it isn't open yet. Returns 1 on success,
+// 0 if the next nameserver should be tried, or -1 on a fatal error.
+static int setup_dg_socket(res_state statp, int ns, int* terrno) {
+    const sockaddr* nsap = get_nsaddr(statp, (size_t) ns);
+    const int nsaplen = sockaddrSize(nsap);
     if (statp->nssocks[ns] == -1) {
         statp->nssocks[ns] = socket(nsap->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
         if (statp->nssocks[ns] < 0) {
@@ -920,6 +1535,24 @@ static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int
         }
         LOG(DEBUG) << __func__ << ": new DG socket";
     }
+    return 1;
+}
+
+static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int buflen,
+                   uint8_t* ans, int anssiz, int* terrno, int ns, int* v_circuit, int* gotsomewhere,
+                   time_t* at, int* rcode, int* delay) {
+    *at = coarseMonotonicSec();
+    *delay = 0;
+    const HEADER* hp = (const HEADER*) (const void*) buf;
+    HEADER* anhp = (HEADER*) (void*) ans;
+    struct timespec now, timeout, finish, done;
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    int resplen, n, s;
+
+    if (int ret = setup_dg_socket(statp, ns, terrno); ret <= 0) {
+        return ret;
+    }
     s = statp->nssocks[ns];
     if (send(s, (const char*) buf, (size_t) buflen, 0) != buflen) {
         PLOG(DEBUG) << __func__ << ": send: ";
@@ -932,7 +1565,7 @@ static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int
     now = evNowTime();
     finish = evAddTime(now, timeout);
 retry:
-    n = retrying_poll(s, POLLIN, &finish);
+    n = retrying_poll(s, POLLIN, &finish, statp->cancel_fd);
 
     if (n == 0) {
         *rcode = RCODE_TIMEOUT;
@@ -1089,46 +1722,42 @@ PrivateDnsModes convertEnumType(PrivateDnsMode privateDnsmode) {
     return PrivateDnsModes::PDM_UNKNOWN;
 }
 
+// How long a query waits for a private DNS server to validate in strict mode.
+constexpr std::chrono::milliseconds kStrictModeWaitTime{4200};
+
 static int res_tls_send(res_state statp, const Slice query, const Slice answer, int* rcode,
-                        bool* fallback) {
+                        bool* fallback, std::shared_ptr<TlsRace>* race) {
     int resplen = 0;
     const unsigned netId = statp->netid;
 
-    PrivateDnsStatus privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
-    statp->event->set_private_dns_modes(convertEnumType(privateDnsStatus.mode));
+    // An atomic load of the current state, so that the common case costs no lock or copy.
+    auto privateDnsStatus = gPrivateDnsConfiguration.getSnapshot(netId);
+    statp->event->set_private_dns_modes(convertEnumType(privateDnsStatus->mode));
 
-    if (privateDnsStatus.mode == PrivateDnsMode::OFF) {
+    if (privateDnsStatus->mode == PrivateDnsMode::OFF) {
         *fallback = true;
         return -1;
     }
 
-    if (privateDnsStatus.validatedServers().empty()) {
-        if (privateDnsStatus.mode == PrivateDnsMode::OPPORTUNISTIC) {
+    if (privateDnsStatus->validatedServers.empty()) {
+        if (privateDnsStatus->mode == PrivateDnsMode::OPPORTUNISTIC) {
             *fallback = true;
             return -1;
         } else {
-            // Sleep and iterate some small number of times checking for the
-            // arrival of resolved and validated server IP addresses, instead
-            // of returning an immediate error.
+            // Wait for the arrival of resolved and validated server IP addresses, instead of
+            // returning an immediate error.
             // This is needed because as soon as a network becomes the default network, apps will
             // send DNS queries on that network. If no servers have yet validated, and we do not
             // block those queries, they would immediately fail, causing application-visible errors.
             // Note that this can happen even before the network validates, since an unvalidated
             // network can become the default network if no validated networks are available.
             //
-            // TODO: see if there is a better way to address this problem, such as buffering the
-            // queries in a queue or only blocking queries for the first few seconds after a default
-            // network change.
-            for (int i = 0; i < 42; i++) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                // Calling getStatus() to merely check if there's any validated server seems
-                // wasteful. Consider adding a new method in PrivateDnsConfiguration for speed ups.
-                if (!gPrivateDnsConfiguration.getStatus(netId).validatedServers().empty()) {
-                    privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
-                    break;
-                }
+            // The queries resume as soon as a server validates.
+            if (!gPrivateDnsConfiguration.waitForValidatedServer(netId, kStrictModeWaitTime)) {
+                return -1;
             }
-            if (privateDnsStatus.validatedServers().empty()) {
+            privateDnsStatus = gPrivateDnsConfiguration.getSnapshot(netId);
+            if (privateDnsStatus->validatedServers.empty()) {
                 return -1;
             }
         }
@@ -1136,12 +1765,58 @@ static int res_tls_send(res_state statp, const Slice query, const Slice answer,
 
     LOG(INFO) << __func__ << ": performing query over TLS";
 
-    const auto response = sDnsTlsDispatcher.query(privateDnsStatus.validatedServers(), statp, query,
-                                                  answer, &resplen);
+    DnsTlsTransport::Response response;
+    if (race != nullptr && privateDnsStatus->mode == PrivateDnsMode::OPPORTUNISTIC &&
+        getExperimentFlagInt("opportunistic_race", 0) != 0) {
+        // Run the query on its own thread, and let the caller send it in cleartext as well if
+        // it is slower than DoT usually is.
+        auto state = std::make_shared<TlsRace>();
+        state->start = std::chrono::steady_clock::now();
+        state->query.assign(query.base(), query.limit());
+        state->answer.resize(answer.size());
+        state->answered.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+        if (state->answered == -1) {
+            PLOG(WARNING) << __func__ << ": eventfd failed";
+        }
+        ResState tlsState = {};
+        tlsState.netid = netId;
+        tlsState._mark = statp->_mark;
+        tlsState.cancel_fd = -1;
+        std::thread([state, privateDnsStatus, tlsState]() mutable {
+            tlsState.event = &state->event;
+            int tlsResplen = 0;
+            const auto tlsResponse = sDnsTlsDispatcher.query(
+                    privateDnsStatus->validatedServers, &tlsState,
+                    android::netdutils::makeSlice(state->query),
+                    android::netdutils::makeSlice(state->answer), &tlsResplen);
+            std::lock_guard guard(state->lock);
+            state->response = tlsResponse;
+            state->resplen = tlsResplen;
+            state->done = true;
+            state->cv.notify_all();
+            if (tlsResponse == DnsTlsTransport::Response::success && state->answered != -1) {
+                eventfd_write(state->answered.get(), 1);
+            }
+        }).detach();
+
+        const auto threshold = DnsTlsDispatcher::getSlowQueryThreshold(
+                netId, privateDnsStatus->validatedServers.front());
+        if (!res_tls_race_wait(statp, state.get(), answer,
+                               std::chrono::steady_clock::now() + threshold, &response,
+                               &resplen)) {
+            LOG(INFO) << __func__ << ": TLS query is slow, racing it against cleartext";
+            *race = std::move(state);
+            *fallback = true;
+            return -1;
+        }
+    } else {
+        response = sDnsTlsDispatcher.query(privateDnsStatus->validatedServers, statp, query,
+                                           answer, &resplen);
+    }
 
     LOG(INFO) << __func__ << ": TLS query result: " << static_cast<int>(response);
 
-    if (privateDnsStatus.mode == PrivateDnsMode::OPPORTUNISTIC) {
+    if (privateDnsStatus->mode == PrivateDnsMode::OPPORTUNISTIC) {
         // In opportunistic mode, handle falling back to cleartext in some
         // cases (DNS shouldn't fail if a validated opportunistic mode server
         // becomes unreachable for some reason).
@@ -1177,6 +1852,36 @@ static int res_tls_send(res_state statp, const Slice query, const Slice answer,
     }
 }
 
+// Returns true if the cleartext exchanges of |statp| have been cancelled.
+static bool res_cancelled(res_state statp) {
+    if (statp->cancel_fd == -1) return false;
+    struct pollfd fds = {.fd = statp->cancel_fd, .events = POLLIN};
+    return poll(&fds, 1, /*timeout=*/0) > 0;
+}
+
+// Waits until |deadline| for the racing DoT query |race| to complete. Returns false if it is
+// still running. Otherwise adds its events to |statp|, stores its result in |response| and, if it
+// succeeded, copies its answer into |answer| and stores the length in |resplen|.
+static bool res_tls_race_wait(res_state statp, TlsRace* race, const Slice answer,
+                              std::chrono::steady_clock::time_point deadline,
+                              DnsTlsTransport::Response* response, int* resplen) {
+    std::unique_lock lock(race->lock);
+    android::base::ScopedLockAssertion assume_lock(race->lock);
+    while (!race->done) {
+        if (race->cv.wait_until(lock, deadline) == std::cv_status::timeout && !race->done) {
+            return false;
+        }
+    }
+    statp->event->mutable_dns_query_events()->MergeFrom(race->event.dns_query_events());
+    *response = race->response;
+    if (race->response == DnsTlsTransport::Response::success) {
+        // |race->answer| is as large as |answer|, so the response fits.
+        memcpy(answer.base(), race->answer.data(), race->resplen);
+        *resplen = race->resplen;
+    }
+    return true;
+}
+
 int resolv_res_nsend(const android_net_context* netContext, const uint8_t* msg, int msgLen,
                      uint8_t* ans, int ansLen, int* rcode, uint32_t flags,
                      NetworkDnsEventReported* event) {
@@ -22,6 +22,7 @@
 #include <android-base/logging.h>
 
 #include "netd_resolv/stats.h"
+#include "util.h"
 
 
 // Calculate the round-trip-time from start time t0 and end time t1.
@@ -45,6 +46,14 @@ void _res_stats_clear_samples(res_stats* stats) {
     stats->sample_count = stats->sample_next = 0;
 }
 
+// Returns the time at which the last sample of |stats|, which must have one, was recorded.
+static time_t res_stats_last_sample_at(const res_stats* stats) {
+    if (stats->sample_next > 0) {
+        return stats->samples[stats->sample_next - 1].at;
+    }
+    return stats->samples[stats->sample_count - 1].at;
+}
+
 /* Aggregates the reachability statistics for the given server based on on the stored samples. */
 void android_net_res_stats_aggregate(res_stats* stats, int* successes, int* errors, int* timeouts,
                                      int* internal_errors, int* rtt_avg, time_t* last_sample_time) {
@@ -97,11 +106,8 @@ void android_net_res_stats_aggregate(res_stats* stats, int* successes, int* erro
     }
     /* If we had at least one sample, populate last sample time. */
     if (stats->sample_count > 0) {
-        if (stats->sample_next > 0) {
-            last = stats->samples[stats->sample_next - 1].at;
-        } else {
-            last = stats->samples[stats->sample_count - 1].at;
-        }
+        // Samples are recorded on the monotonic clock; report the wall clock time.
+        last = time(nullptr) - (coarseMonotonicSec() - res_stats_last_sample_at(stats));
     }
     *last_sample_time = last;
 }
@@ -127,8 +133,9 @@ static bool res_stats_usable_server(const res_params* params, res_stats* stats)
             int success_rate = successes * 100 / total;
             LOG(INFO) << __func__ << ": success rate " << success_rate;
             if (success_rate < params->success_threshold) {
-                time_t now = time(NULL);
-                if (now - last_sample_time > params->sample_validity) {
+                // Compare on the monotonic clock of the samples, not the wall clock.
+                const time_t now = coarseMonotonicSec();
+                if (now - res_stats_last_sample_at(stats) > params->sample_validity) {
                     // Note: It might be worth considering to expire old servers after their expiry
                     // date has been reached, however the code for returning the ring buffer to its
                     // previous non-circular state would induce additional complexity.
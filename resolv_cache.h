@@ -28,6 +28,9 @@
 
 #pragma once
 
+#include <chrono>
+#include <optional>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -35,6 +38,7 @@
 #include <netdutils/InternetAddresses.h>
 #include <stats.pb.h>
 
+#include "DnsStats.h"
 #include "ResolverStats.h"
 #include "netd_resolv/params.h"
 
@@ -65,6 +69,18 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, const void* query, int que
 int resolv_cache_add(unsigned netid, const void* query, int querylen, const void* answer,
                      int answerlen);
 
+// Returns a copy of the sorted getaddrinfo() result cached as |key| for |netid|, to be released
+// with freeaddrinfo(), or nullptr if there is none or it expired. If |ttl| is not null, it is set
+// to the remaining lifetime of the result.
+struct addrinfo;
+addrinfo* resolv_cache_lookup_addrinfo(unsigned netid, const std::string& key,
+                                       uint32_t* ttl = nullptr);
+
+// Caches a copy of the sorted getaddrinfo() result |ai| as |key| for |netid|, for at most |ttl|
+// seconds. Cached results are dropped whenever the resolver configuration of |netid| is set.
+void resolv_cache_add_addrinfo(unsigned netid, const std::string& key, const addrinfo* ai,
+                               uint32_t ttl);
+
 /* Notify the cache a request failed */
 void _resolv_cache_query_failed(unsigned netid, const void* query, int querylen, uint32_t flags);
 
@@ -83,8 +99,8 @@ void resolv_delete_cache_for_net(unsigned netid);
 bool has_named_cache(unsigned netid);
 
 // For test only.
-// Get the expiration time of a cache entry. Return 0 on success; otherwise, an negative error is
-// returned if the expiration time can't be acquired.
+// Get the expiration time of a cache entry, in wall clock seconds. Return 0 on success; otherwise,
+// an negative error is returned if the expiration time can't be acquired.
 int resolv_cache_get_expiration(unsigned netid, const std::vector<char>& query, time_t* expiration);
 
 // Set private DNS servers to DnsStats for a given network.
@@ -94,4 +110,30 @@ int resolv_stats_set_servers_for_dot(unsigned netid, const std::vector<std::stri
 bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& server,
                       const android::net::DnsQueryEvent* record);
 
+// Returns the |percentile|th percentile of the latency of |server| with |protocol| on the given
+// network, or std::nullopt if there are no usable statistics.
+std::optional<std::chrono::microseconds> resolv_stats_get_latency_percentile(
+        unsigned netid, const android::netdutils::IPSockAddr& server,
+        android::net::Protocol protocol, int percentile);
+
+// A snapshot of the statistics of a network, see resolv_stats_get_snapshot().
+struct ResolvStatsSnapshot {
+    // The revision to pass back to get only what changed after this snapshot.
+    uint64_t revision = 0;
+    // Whether |servers| holds all the servers of the network, rather than only those whose
+    // stats changed.
+    bool full = true;
+    std::vector<std::pair<android::net::Protocol, android::net::StatsData>> servers;
+    int cacheEntries = 0;
+    int cacheHits = 0;
+    int cacheMisses = 0;
+    int waitForPendingReqTimeoutCount = 0;
+};
+
+// Fills |snapshot| with the cache metrics of the given network, and the statistics of its
+// servers that changed after |sinceRevision|. Returns 0 on success, or -ENONET if there is no
+// cache for the network.
+int resolv_stats_get_snapshot(unsigned netid, uint64_t sinceRevision,
+                              ResolvStatsSnapshot* snapshot);
+
 void resolv_stats_dump(android::netdutils::DumpWriter& dw, unsigned netid);
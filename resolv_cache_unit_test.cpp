@@ -16,10 +16,12 @@
 
 #include <netdb.h>
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <chrono>
 #include <ctime>
+#include <set>
 #include <thread>
 
 #include <android-base/logging.h>
@@ -37,6 +39,8 @@
 
 using namespace std::chrono_literals;
 
+using android::netdutils::ScopedAddrinfo;
+
 constexpr int TEST_NETID = 30;
 constexpr int TEST_NETID_2 = 31;
 
@@ -257,6 +261,37 @@ TEST_F(ResolvCacheTest, CreateAndDeleteCache) {
     EXPECT_TRUE(has_named_cache(TEST_NETID_2));
 }
 
+TEST_F(ResolvCacheTest, CreateAndDeleteManyCaches) {
+    constexpr unsigned kFirstNetId = 1000;
+    constexpr unsigned kNumNetworks = 200;
+
+    // Create in reverse order, to check that resolv_list_caches() sorts the netids.
+    std::vector<unsigned> netIds;
+    for (unsigned i = 0; i < kNumNetworks; i++) {
+        const unsigned netId = kFirstNetId + kNumNetworks - 1 - i;
+        EXPECT_EQ(0, cacheCreate(netId));
+        netIds.insert(netIds.begin(), netId);
+    }
+    const std::vector<unsigned> listed = resolv_list_caches();
+    EXPECT_TRUE(std::includes(listed.begin(), listed.end(), netIds.begin(), netIds.end()));
+    EXPECT_TRUE(std::is_sorted(listed.begin(), listed.end()));
+
+    // Delete every other network, and check that the others are untouched.
+    for (unsigned i = 0; i < kNumNetworks; i += 2) {
+        cacheDelete(netIds[i]);
+    }
+    for (unsigned i = 0; i < kNumNetworks; i++) {
+        EXPECT_EQ(i % 2 != 0, has_named_cache(netIds[i])) << netIds[i];
+    }
+
+    for (unsigned i = 1; i < kNumNetworks; i += 2) {
+        cacheDelete(netIds[i]);
+    }
+    for (const unsigned netId : netIds) {
+        EXPECT_FALSE(has_named_cache(netId)) << netId;
+    }
+}
+
 // Missing checks for the argument 'answer'.
 TEST_F(ResolvCacheTest, CacheAdd_InvalidArgs) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
@@ -369,6 +404,41 @@ TEST_F(ResolvCacheTest, CacheLookup_Types) {
     }
 }
 
+TEST_F(ResolvCacheTest, CacheLookup_RepeatedQueries) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const CacheEntry ce = makeCacheEntry(QUERY, "repeated.cache", ns_c_in, ns_t_a, "1.2.3.4");
+
+    // The query ID is not part of the key, whether the key is computed or remembered.
+    CacheEntry other = ce;
+    other.query[0] ^= 0x5a;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, other));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, other));
+
+    // An unsupported query stays unsupported when it is seen again.
+    CacheEntry unsupported = ce;
+    unsupported.query[2] |= 0x80;  // QR
+    for (int i = 0; i < 2; i++) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_UNSUPPORTED, TEST_NETID, unsupported));
+        EXPECT_EQ(-EINVAL, cacheAdd(TEST_NETID, unsupported));
+    }
+
+    // Interleaving more queries than the thread remembers still gives the right answers.
+    std::vector<CacheEntry> entries;
+    for (int i = 0; i < 8; i++) {
+        const std::string name = android::base::StringPrintf("interleaved%d.cache", i);
+        entries.push_back(makeCacheEntry(QUERY, name.c_str(), ns_c_in, ns_t_a, "1.2.3.4"));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, entries.back()));
+    }
+    for (const auto& entry : entries) {
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, entry));
+    }
+    for (const auto& entry : entries) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, entry));
+    }
+}
+
 TEST_F(ResolvCacheTest, CacheLookup_InvalidArgs) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -397,6 +467,40 @@ TEST_F(ResolvCacheTest, CacheLookup_InvalidArgs) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_UNSUPPORTED, TEST_NETID_2, ce));
 }
 
+TEST_F(ResolvCacheTest, CacheLookup_Counters) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const CacheEntry ce = makeCacheEntry(QUERY, "counted.cache", ns_c_in, ns_t_a, "1.2.3.4");
+    const auto expectCounters = [](int hits, int misses) {
+        ResolvStatsSnapshot snapshot;
+        ASSERT_EQ(0, resolv_stats_get_snapshot(TEST_NETID, 0, &snapshot));
+        EXPECT_EQ(hits, snapshot.cacheHits);
+        EXPECT_EQ(misses, snapshot.cacheMisses);
+    };
+
+    // Lookups that don't look into the cache are not counted.
+    CacheEntry unsupported = ce;
+    unsupported.query[2] |= 0x80;  // QR
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_UNSUPPORTED, TEST_NETID, unsupported));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce, ANDROID_RESOLV_NO_CACHE_LOOKUP));
+    expectCounters(0, 0);
+
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_SKIP, TEST_NETID, ce, ANDROID_RESOLV_NO_CACHE_STORE));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    expectCounters(0, 2);
+
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    expectCounters(1, 2);
+
+    // Neither are hits whose answer doesn't fit in the caller's buffer.
+    std::vector<char> answer(ce.answer.size() - 1);
+    int anslen = 0;
+    EXPECT_EQ(RESOLV_CACHE_UNSUPPORTED,
+              resolv_cache_lookup(TEST_NETID, ce.query.data(), ce.query.size(), answer.data(),
+                                  answer.size(), &anslen, 0));
+    expectCounters(1, 2);
+}
+
 TEST_F(ResolvCacheTest, CacheLookup_Expired) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -420,6 +524,71 @@ TEST_F(ResolvCacheTest, CacheLookup_Expired) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
 }
 
+TEST_F(ResolvCacheTest, CacheLookup_ExpiryJitter) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // Entries inserted together expire within the last 2 seconds of their TTL, not all at once.
+    const time_t now = currentTime();
+    std::set<time_t> expirations;
+    for (int i = 0; i < 20; i++) {
+        const std::string name = android::base::StringPrintf("jitter%d.example", i);
+        const CacheEntry ce = makeCacheEntry(QUERY, name.c_str(), ns_c_in, ns_t_a, "1.2.3.4", 100s);
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        time_t expiration;
+        EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration));
+        EXPECT_GE(expiration, now + 98);
+        EXPECT_LE(expiration, currentTime() + 100);
+        expirations.insert(expiration);
+    }
+    EXPECT_GT(expirations.size(), 1U);
+}
+
+TEST_F(ResolvCacheTest, AddrInfoResults) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    addrinfo* v6 = nullptr;
+    addrinfo* v4 = nullptr;
+    ASSERT_EQ(0, getaddrinfo_numeric("2001:db8::1", "80", {.ai_socktype = SOCK_STREAM}, &v6));
+    ASSERT_EQ(0, getaddrinfo_numeric("192.0.2.1", "80", {.ai_socktype = SOCK_STREAM}, &v4));
+    v6->ai_next = v4;
+    ScopedAddrinfo result(v6);
+    const std::string key = "example.com";
+
+    // Results with a zero TTL aren't cached.
+    resolv_cache_add_addrinfo(TEST_NETID, key, result.get(), 0);
+    EXPECT_EQ(nullptr, resolv_cache_lookup_addrinfo(TEST_NETID, key));
+
+    // The cached result is a copy, in the same order, of what was added for the same network.
+    resolv_cache_add_addrinfo(TEST_NETID, key, result.get(), 10);
+    ScopedAddrinfo cached(resolv_cache_lookup_addrinfo(TEST_NETID, key));
+    ASSERT_NE(nullptr, cached);
+    const addrinfo* ai = result.get();
+    for (const addrinfo* copy = cached.get(); ai && copy; ai = ai->ai_next, copy = copy->ai_next) {
+        EXPECT_NE(ai, copy);
+        EXPECT_EQ(ai->ai_socktype, copy->ai_socktype);
+        ASSERT_EQ(ai->ai_addrlen, copy->ai_addrlen);
+        EXPECT_EQ(0, memcmp(ai->ai_addr, copy->ai_addr, ai->ai_addrlen));
+        EXPECT_EQ(ai->ai_next == nullptr, copy->ai_next == nullptr);
+    }
+    EXPECT_EQ(nullptr, resolv_cache_lookup_addrinfo(TEST_NETID_2, key));
+    EXPECT_EQ(nullptr, resolv_cache_lookup_addrinfo(TEST_NETID, "example.org"));
+
+    // Setting the resolver configuration drops the results.
+    const SetupParams setup = {
+            .servers = {"127.0.0.1"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    EXPECT_EQ(nullptr, resolv_cache_lookup_addrinfo(TEST_NETID, key));
+
+    // Results expire after the TTL.
+    resolv_cache_add_addrinfo(TEST_NETID, key, result.get(), 2);
+    EXPECT_NE(nullptr, ScopedAddrinfo(resolv_cache_lookup_addrinfo(TEST_NETID, key)));
+    std::this_thread::sleep_for(3s);
+    EXPECT_EQ(nullptr, resolv_cache_lookup_addrinfo(TEST_NETID, key));
+}
+
 TEST_F(ResolvCacheTest, PendingRequest_QueryDeferred) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
@@ -533,6 +702,35 @@ TEST_F(ResolvCacheTest, PendingRequest_CacheDestroyed) {
     }
 }
 
+TEST_F(ResolvCacheTest, DeleteAndRecreateFullCache) {
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        std::string qname = android::base::StringPrintf("cache.%04d", i);
+        ces.push_back(makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4"));
+    }
+
+    for (int round = 0; round < 3; round++) {
+        SCOPED_TRACE(round);
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+        for (const CacheEntry& ce : ces) {
+            EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        }
+        EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ces[0]));
+
+        // The deleted cache is freed in the background, but is gone as soon as the call returns,
+        // and the network can be created again right away. Other networks are not affected.
+        cacheDelete(TEST_NETID);
+        EXPECT_FALSE(has_named_cache(TEST_NETID));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ces[0]));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ces[0]));
+
+        cacheDelete(TEST_NETID);
+        cacheDelete(TEST_NETID_2);
+    }
+}
+
 TEST_F(ResolvCacheTest, MaxEntries) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     std::vector<CacheEntry> ces;
@@ -792,6 +990,48 @@ TEST_F(ResolvCacheTest, GetHostByAddrFromCache) {
     EXPECT_STREQ(answer, domain_name);
 }
 
+TEST_F(ResolvCacheTest, GetHostByAddrFromCache_RemovedEntry) {
+    char domain_name[NS_MAXDNAME] = {};
+    const char query_v4[] = "1.2.3.5";
+    const char answer1[] = "first.in.cache";
+    const char answer2[] = "second.in.cache";
+
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // Two entries share the same address. The most recently added one is preferred.
+    CacheEntry ce1 = makeCacheEntry(QUERY, answer1, ns_c_in, ns_t_a, query_v4);
+    CacheEntry ce2 = makeCacheEntry(QUERY, answer2, ns_c_in, ns_t_a, query_v4);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce2));
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                AF_INET));
+    EXPECT_STREQ(answer2, domain_name);
+
+    // Evict both entries by stuffing the cache with other names.
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        std::string qname = android::base::StringPrintf("cache.%04d", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                 AF_INET));
+    EXPECT_STREQ("", domain_name);
+
+    // Recreating the cache starts with an empty index.
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                AF_INET));
+    EXPECT_STREQ(answer1, domain_name);
+    cacheDelete(TEST_NETID);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                 AF_INET));
+    EXPECT_STREQ("", domain_name);
+}
+
 namespace {
 
 constexpr int EAI_OK = 0;
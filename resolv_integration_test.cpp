@@ -2493,6 +2493,61 @@ TEST_F(ResolverTest, GetAddrInfo_Dns64QueryUnspecifiedNoV6) {
     EXPECT_EQ(result_str, "64:ff9b::102:304");
 }
 
+TEST_F(ResolverTest, GetAddrInfo_Dns64QueryUnspecifiedCached) {
+    constexpr char dns64_name[] = "ipv4only.arpa.";
+    constexpr char host_name[] = "v4only.example.com.";
+    // A response holding the single record |rdata| of |type| for |name|.
+    const auto makeResponse = [](const std::string& name, ns_type type, const std::string& rdata) {
+        test::DNSHeader header(kDefaultDnsHeader);
+        header.questions.push_back({.qname = {.name = name}, .qtype = type, .qclass = ns_c_in});
+        test::DNSRecord record{
+                .name = {.name = name},
+                .rtype = type,
+                .rclass = ns_c_in,
+                .ttl = kAnswerRecordTtlSec,
+        };
+        EXPECT_TRUE(test::DNSResponder::fillRdata(rdata, record));
+        header.answers.push_back(std::move(record));
+        return header;
+    };
+
+    // The AAAA answer has no records, but its SOA record lets the synthesized result be cached.
+    test::DNSResponder dns(test::DNSResponder::MappingType::DNS_HEADER);
+    dns.addMappingDnsHeader(dns64_name, ns_type::ns_t_aaaa,
+                            makeResponse(dns64_name, ns_type::ns_t_aaaa, "64:ff9b::192.0.0.170"));
+    dns.addMappingDnsHeader(host_name, ns_type::ns_t_a,
+                            makeResponse(host_name, ns_type::ns_t_a, "1.2.3.4"));
+    dns.addMappingDnsHeader(host_name, ns_type::ns_t_aaaa,
+                            MakeNoDataResponse(host_name, ns_type::ns_t_aaaa, "example.com.", 300));
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork());
+    ScopedExperimentFlag flag("addrinfo_cache", "1");
+
+    // Start NAT64 prefix discovery and wait for it to complete.
+    EXPECT_TRUE(mDnsClient.resolvService()->startPrefix64Discovery(TEST_NETID).isOk());
+    EXPECT_TRUE(WaitForNat64Prefix(EXPECT_FOUND));
+    dns.clearQueries();
+
+    const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    ScopedAddrinfo result = safe_getaddrinfo("v4only", nullptr, &hints);
+    EXPECT_EQ("64:ff9b::102:304", ToString(result));
+    EXPECT_LE(2U, GetNumQueries(dns, host_name));
+
+    // The second request is answered from the synthesized result, without even looking up the
+    // answer cache.
+    android::net::ResolverStatsSnapshotParcel before;
+    ASSERT_TRUE(
+            mDnsClient.resolvService()->getResolverStatsSnapshot(TEST_NETID, 0, &before).isOk());
+    dns.clearQueries();
+    result = safe_getaddrinfo("v4only", nullptr, &hints);
+    EXPECT_EQ("64:ff9b::102:304", ToString(result));
+    EXPECT_EQ(0U, GetNumQueries(dns, host_name));
+    android::net::ResolverStatsSnapshotParcel after;
+    ASSERT_TRUE(mDnsClient.resolvService()->getResolverStatsSnapshot(TEST_NETID, 0, &after).isOk());
+    EXPECT_EQ(before.cacheHits, after.cacheHits);
+    EXPECT_EQ(before.cacheMisses, after.cacheMisses);
+}
+
 TEST_F(ResolverTest, GetAddrInfo_Dns64QuerySpecialUseIPv4Addresses) {
     constexpr char THIS_NETWORK[] = "this_network";
     constexpr char LOOPBACK[] = "loopback";
@@ -3490,6 +3545,84 @@ TEST_F(ResolverTest, ConnectTlsServerTimeout) {
     EXPECT_LE(1000, std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
 }
 
+// In opportunistic mode with the opportunistic_race experiment, a slow DoT query is raced against
+// cleartext, and the first answer wins.
+TEST_F(ResolverTest, TlsRace_SlowTlsFastCleartext) {
+    constexpr char listen_addr[] = "127.0.0.3";
+    constexpr char backend_addr[] = "127.0.0.4";
+    constexpr char listen_udp[] = "53";
+    constexpr char listen_tls[] = "853";
+    constexpr char host_name[] = "race1.example.com.";
+    const std::vector<std::string> servers = {listen_addr};
+
+    // The cleartext server and the one behind the DoT frontend give different answers.
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, {{host_name, ns_type::ns_t_a, "1.2.3.4"}});
+    test::DNSResponder backend(backend_addr);
+    StartDns(backend, {{host_name, ns_type::ns_t_a, "1.2.3.5"}});
+    test::DnsTlsFrontend tls(listen_addr, listen_tls, backend_addr, listen_udp);
+    ASSERT_TRUE(tls.startServer());
+    ScopedExperimentFlag flag("opportunistic_race", "1");
+    ASSERT_TRUE(mDnsClient.SetResolversWithTls(servers, kDefaultSearchDomains, kDefaultParams, ""));
+    EXPECT_TRUE(WaitForPrivateDnsValidation(tls.listen_address(), true));
+    tls.clearQueries();
+
+    backend.setDeferredResp(true);
+    const auto start = std::chrono::steady_clock::now();
+    const hostent* result = gethostbyname("race1");
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+    backend.setDeferredResp(false);
+
+    // The answer comes from cleartext once DoT passes its slow query threshold, at most 2s.
+    ASSERT_FALSE(result == nullptr);
+    EXPECT_EQ("1.2.3.4", ToString(result));
+    EXPECT_EQ(1U, GetNumQueries(dns, host_name));
+    EXPECT_TRUE(tls.waitForQueries(1, 5000));
+    EXPECT_GT(3000, elapsed.count());
+}
+
+TEST_F(ResolverTest, TlsRace_SlowTlsBlackholedCleartext) {
+    constexpr char listen_addr[] = "127.0.0.3";
+    constexpr char backend_addr[] = "127.0.0.4";
+    constexpr char listen_udp[] = "53";
+    constexpr char listen_tls[] = "853";
+    constexpr char host_name[] = "race2.example.com.";
+    const std::vector<std::string> servers = {listen_addr};
+    // Cleartext alone would wait 10s for an answer.
+    const std::vector<int> params = {300, 25, 8, 8, 5000, 2};
+
+    test::DNSResponder dns(listen_addr, listen_udp, static_cast<ns_rcode>(-1));
+    StartDns(dns, {{host_name, ns_type::ns_t_a, "1.2.3.4"}});
+    dns.setResponseProbability(0.0);
+    test::DNSResponder backend(backend_addr);
+    StartDns(backend, {{host_name, ns_type::ns_t_a, "1.2.3.5"}});
+    test::DnsTlsFrontend tls(listen_addr, listen_tls, backend_addr, listen_udp);
+    ASSERT_TRUE(tls.startServer());
+    ScopedExperimentFlag flag("opportunistic_race", "1");
+    ASSERT_TRUE(mDnsClient.SetResolversWithTls(servers, kDefaultSearchDomains, params, ""));
+    EXPECT_TRUE(WaitForPrivateDnsValidation(tls.listen_address(), true));
+
+    // The DoT server answers 3s after the query, while cleartext is still waiting.
+    backend.setDeferredResp(true);
+    std::thread releaser([&backend]() {
+        std::this_thread::sleep_for(std::chrono::seconds(3));
+        backend.setDeferredResp(false);
+    });
+    const auto start = std::chrono::steady_clock::now();
+    const hostent* result = gethostbyname("race2");
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+    releaser.join();
+
+    // Cleartext stops waiting as soon as the DoT answer arrives.
+    ASSERT_FALSE(result == nullptr);
+    EXPECT_EQ("1.2.3.5", ToString(result));
+    EXPECT_EQ(1U, GetNumQueries(dns, host_name));
+    EXPECT_LE(3000, elapsed.count());
+    EXPECT_GT(5000, elapsed.count());
+}
+
 // Parameterized tests.
 // TODO: Merge the existing tests as parameterized test if possible.
 // TODO: Perhaps move parameterized tests to an independent file.
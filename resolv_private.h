@@ -103,6 +103,8 @@ struct ResState {
     uint32_t _flags;                          // See RES_F_* defines below
     android::net::NetworkDnsEventReported* event;
     uint32_t netcontext_flags;
+    int cancel_fd;                            // If readable, cleartext exchanges stop waiting
+                                              // for an answer. -1 if unused
 };
 
 // TODO: remove these legacy aliases
@@ -119,6 +121,47 @@ int resolv_cache_get_resolver_stats(unsigned netid, res_params* params, res_stat
 void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id, const sockaddr* sa,
                                             const res_sample& sample, int max_samples);
 
+// What has been learned about the EDNS0 support of a nameserver.
+struct res_edns_info {
+    time_t no_edns_until;      // queries are sent to the server without EDNS0 until this time,
+                               // in coarseMonotonicSec()
+    uint16_t max_udp_payload;  // largest advertised UDP payload size that got a full answer
+    uint16_t udp_payload;      // UDP payload size to advertise to the server instead of the
+                               // query's own, until udp_payload_until
+    time_t udp_payload_until;
+    uint8_t udp_timeouts;      // consecutive timeouts of queries advertising a UDP payload
+                               // size larger than the safe one
+};
+
+/* Retrieve a local copy of the EDNS0 state of the servers for the given netid. Returns the
+ * revision id of the resolvers used, or -1 if the netid has no resolvers.
+ */
+int resolv_cache_get_edns_info(unsigned netid, res_edns_info edns[MAXNS]);
+
+/* Record that the given server rejected a query with EDNS0. For a while, queries will be sent to
+ * it without EDNS0, provided that the revision_id of the stored servers has not changed. Returns
+ * the time until which EDNS0 won't be used with the server, or 0 if nothing was recorded.
+ */
+time_t resolv_cache_set_edns_unsupported(unsigned netid, int revision_id, const sockaddr* sa);
+
+/* Record that the UDP payload size |udp_payload| should be advertised to the given server for a
+ * while, to avoid fragmented answers. Returns the time until which it is used, or 0 if nothing
+ * was recorded.
+ */
+time_t resolv_cache_set_edns_udp_payload(unsigned netid, int revision_id, const sockaddr* sa,
+                                         uint16_t udp_payload);
+
+/* Record that a query advertising a large UDP payload size to the given server timed out. Returns
+ * the number of consecutive such timeouts, or 0 if nothing was recorded.
+ */
+uint8_t resolv_cache_add_edns_udp_timeout(unsigned netid, int revision_id, const sockaddr* sa);
+
+/* Record that the given server answered a query with EDNS0 advertising |udp_payload| without
+ * truncating it.
+ */
+void resolv_cache_set_edns_supported(unsigned netid, int revision_id, const sockaddr* sa,
+                                     uint16_t udp_payload);
+
 // Calculate the round-trip-time from start time t0 and end time t1.
 int _res_stats_calculate_rtt(const timespec* t1, const timespec* t0);
 
@@ -160,12 +203,36 @@ int res_nquerydomain(res_state, const char*, const char*, int, int, uint8_t*, in
 int res_nmkquery(int op, const char* qname, int cl, int type, const uint8_t* data, int datalen,
                  uint8_t* buf, int buflen, int netcontext_flags);
 int res_nsend(res_state, const uint8_t*, int, uint8_t*, int, int*, uint32_t);
+
+// A query sent by res_nsendN().
+struct ResSendTarget {
+    const uint8_t* query;  // query to send
+    int querylen;          // length of query
+    uint8_t* answer;       // buffer to put answer
+    int anssiz;            // size of answer buffer
+    int resplen = 0;       // out: answer length, or a negative errno on failure
+    int rcode = NOERROR;   // out: rcode of the answer, or RCODE_* on failure
+    bool edns0Error = false;  // out: whether a server rejected this query with EDNS0
+};
+
+// Like res_nsend(), but for several queries at once. Queries that go to the cleartext nameservers
+// over UDP are all outstanding on the same socket, so that they cost about one round trip in
+// total. Returns the number of queries that got an answer.
+int res_nsendN(res_state, ResSendTarget* targets, int ntargets, uint32_t flags);
 void res_nclose(res_state);
 int res_nopt(res_state, int, uint8_t*, int, int);
+// Same as res_nmkquery(QUERY, qname, ns_c_in, type, ...) followed by res_nopt() when |edns0| is
+// true, but common hostnames are written in a single pass. |type| is ns_t_a or ns_t_aaaa.
+int res_nmkquery_in(res_state, const char* qname, int type, uint8_t* buf, int buflen, int anslen,
+                    bool edns0);
 
 int getaddrinfo_numeric(const char* hostname, const char* servname, addrinfo hints,
                         addrinfo** result);
 
+// Returns a copy of the list |ai|, allocated like the results of getaddrinfo() so that it is
+// released with freeaddrinfo(), or nullptr if memory runs out.
+addrinfo* copy_addrinfo(const addrinfo* ai);
+
 // Helper function for converting h_errno to the error codes visible to netd
 int herrnoToAiErrno(int herrno);
 
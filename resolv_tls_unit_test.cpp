@@ -17,6 +17,7 @@
 #define LOG_TAG "resolv"
 
 #include <arpa/inet.h>
+#include <arpa/nameser.h>
 
 #include <chrono>
 
@@ -34,7 +35,11 @@
 #include "IDnsTlsSocket.h"
 #include "IDnsTlsSocketFactory.h"
 #include "IDnsTlsSocketObserver.h"
+#include "PrivateDnsConfiguration.h"
+#include "resolv_cache.h"
+#include "stats.pb.h"
 #include "tests/dns_responder/dns_tls_frontend.h"
+#include "tests/resolv_test_utils.h"
 
 namespace android {
 namespace net {
@@ -99,6 +104,7 @@ bytevec make_query(uint16_t id, size_t size) {
 
 // Query constants
 const unsigned MARK = 123;
+const unsigned NETID = 30;
 const uint16_t ID = 52;
 const uint16_t SIZE = 22;
 const bytevec QUERY = make_query(ID, SIZE);
@@ -698,6 +704,554 @@ TEST_F(DispatcherTest, Dispatching) {
     }
 }
 
+TEST_F(DispatcherTest, ManyKeysConcurrently) {
+    auto factory = std::make_unique<TrackingFakeSocketFactory<FakeSocketEcho>>();
+    auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+    DnsTlsDispatcher dispatcher(std::move(factory));
+
+    // More keys than shards, so that some shards hold several transports.
+    std::vector<std::pair<unsigned, DnsTlsServer>> keys;
+    for (unsigned i = 0; i < 24; ++i) {
+        keys.emplace_back(MARK + i, SERVER1);
+        keys.emplace_back(MARK + i, V6ADDR1);
+    }
+
+    constexpr int kQueriesPerKey = 10;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < keys.size() * kQueriesPerKey; ++i) {
+        threads.emplace_back([key = keys[i % keys.size()], i, &dispatcher]() {
+            auto q = make_query(i, SIZE);
+            bytevec ans(4096);
+            int resplen = 0;
+            auto r = dispatcher.query(key.second, key.first, makeSlice(q), makeSlice(ans),
+                                      &resplen);
+            EXPECT_EQ(DnsTlsTransport::Response::success, r);
+            ans.resize(resplen);
+            EXPECT_EQ(q, ans);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    // Each key got exactly one transport, whichever shard it landed on.
+    EXPECT_EQ(keys.size(), weak_factory->keys.size());
+    for (const auto& key : keys) {
+        EXPECT_EQ(1U, weak_factory->keys.count(key));
+    }
+}
+
+TEST_F(DispatcherTest, IdleTransportsAreReaped) {
+    auto factory = std::make_unique<TrackingFakeSocketFactory<FakeSocketEcho>>();
+    auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+    constexpr std::chrono::milliseconds kIdleTimeout(200);
+    DnsTlsDispatcher dispatcher(std::move(factory), kIdleTimeout);
+
+    bytevec ans(4096);
+    int resplen = 0;
+    const auto query = [&]() {
+        return dispatcher.query(SERVER1, MARK, makeSlice(QUERY), makeSlice(ans), &resplen);
+    };
+
+    // A transport used again before the idle timeout is reused.
+    EXPECT_EQ(DnsTlsTransport::Response::success, query());
+    EXPECT_EQ(DnsTlsTransport::Response::success, query());
+    EXPECT_EQ(1U, weak_factory->keys.size());
+
+    // Once idle for longer, it is destroyed and the next query needs a new one.
+    std::this_thread::sleep_for(kIdleTimeout * 3);
+    EXPECT_EQ(DnsTlsTransport::Response::success, query());
+    EXPECT_EQ(2U, weak_factory->keys.count({MARK, SERVER1}));
+}
+
+// A server that answers each query after a fixed delay, or closes the connection instead if
+// it is failing.
+class FakeSocketSlow : public IDnsTlsSocket {
+  public:
+    FakeSocketSlow(IDnsTlsSocketObserver* observer, std::chrono::milliseconds delay, bool fail)
+        : mObserver(observer), mDelay(delay), mFail(fail) {}
+    ~FakeSocketSlow() {
+        std::lock_guard guard(mLock);
+        for (auto& thread : mThreads) {
+            thread.join();
+        }
+    }
+    bool query(uint16_t id, const Slice query) override {
+        std::lock_guard guard(mLock);
+        mThreads.emplace_back([this, response = make_echo(id, query)]() {
+            std::this_thread::sleep_for(mDelay);
+            if (mFail) {
+                mObserver->onClosed();
+            } else {
+                mObserver->onResponse(response);
+            }
+        });
+        return true;
+    }
+
+  private:
+    std::mutex mLock;
+    IDnsTlsSocketObserver* const mObserver;
+    const std::chrono::milliseconds mDelay;
+    const bool mFail;
+    std::vector<std::thread> mThreads GUARDED_BY(mLock);
+};
+
+// Creates a FakeSocketSlow for each configured server. Connecting to other servers, or
+// reconnecting to a failing one, fails.
+class SlowFakeSocketFactory : public IDnsTlsSocketFactory {
+  public:
+    struct Behavior {
+        std::chrono::milliseconds delay;
+        bool fail;
+    };
+    explicit SlowFakeSocketFactory(std::map<DnsTlsServer, Behavior, AddressComparator> servers)
+        : mServers(std::move(servers)) {}
+    std::unique_ptr<IDnsTlsSocket> createDnsTlsSocket(
+            const DnsTlsServer& server,
+            unsigned mark ATTRIBUTE_UNUSED,
+            IDnsTlsSocketObserver* observer,
+            DnsTlsSessionCache* cache ATTRIBUTE_UNUSED) override {
+        std::lock_guard guard(mLock);
+        const auto it = mServers.find(server);
+        if (it == mServers.end()) return nullptr;
+        const Behavior behavior = it->second;
+        if (behavior.fail) mServers.erase(it);
+        return std::make_unique<FakeSocketSlow>(observer, behavior.delay, behavior.fail);
+    }
+
+  private:
+    std::mutex mLock;
+    std::map<DnsTlsServer, Behavior, AddressComparator> mServers GUARDED_BY(mLock);
+};
+
+// Without latency statistics, a query is hedged after 500ms, so the slow server takes longer.
+constexpr std::chrono::milliseconds kSlowDelay(1000);
+
+class HedgingTest : public DispatcherTest {
+  protected:
+    HedgingTest() {
+        parseServer("192.0.2.3", 853, &V4ADDR3);
+        mRes.netid = NETID;
+        mRes._mark = MARK;
+        mRes.event = &mEvent;
+    }
+
+    void SetUp() override {
+        ASSERT_EQ(0, resolv_create_cache_for_net(NETID));
+        ASSERT_EQ(0, resolv_stats_set_servers_for_dot(NETID, {"192.0.2.1", "192.0.2.2"}));
+    }
+
+    void TearDown() override { resolv_delete_cache_for_net(NETID); }
+
+    // Creates a dispatcher whose fast servers are V6ADDR1, V6ADDR2 and V4ADDR3, and whose
+    // SERVER1 answers, or fails if |primaryFails|, after kSlowDelay. V4ADDR2 is fast unless
+    // |secondaryFails|, in which case it can't be reached.
+    std::unique_ptr<DnsTlsDispatcher> makeDispatcher(bool primaryFails, bool secondaryFails) {
+        std::map<DnsTlsServer, SlowFakeSocketFactory::Behavior, AddressComparator> servers;
+        servers[V6ADDR1] = {std::chrono::milliseconds(0), false};
+        servers[V6ADDR2] = {std::chrono::milliseconds(0), false};
+        servers[V4ADDR3] = {std::chrono::milliseconds(0), false};
+        servers[SERVER1] = {kSlowDelay, primaryFails};
+        if (!secondaryFails) servers[V4ADDR2] = {std::chrono::milliseconds(0), false};
+        return std::make_unique<DnsTlsDispatcher>(
+                std::make_unique<SlowFakeSocketFactory>(std::move(servers)));
+    }
+
+    DnsTlsTransport::Response query(DnsTlsDispatcher& dispatcher,
+                                    const std::list<DnsTlsServer>& servers) {
+        bytevec ans(4096);
+        int resplen = 0;
+        return dispatcher.query(servers, &mRes, makeSlice(QUERY), makeSlice(ans), &resplen);
+    }
+
+    // Every query earns a hedge credit, and a hedge costs 10 of them. Earns all but the last
+    // one with queries to fast servers, so that the next query may be hedged.
+    void earnHedgeCredits(DnsTlsDispatcher& dispatcher) {
+        for (int i = 0; i < 9; ++i) {
+            EXPECT_EQ(DnsTlsTransport::Response::success,
+                      query(dispatcher, {V6ADDR1, V6ADDR2}));
+        }
+        mEvent.Clear();
+    }
+
+    const DnsQueryEvents& events() const { return mEvent.dns_query_events(); }
+
+    sockaddr_storage V4ADDR3 = {};
+    ResState mRes = {};
+    NetworkDnsEventReported mEvent;
+    ScopedExperimentFlag mHedging{"dot_query_hedging", "1"};
+};
+
+TEST_F(HedgingTest, SecondaryWins) {
+    auto dispatcher = makeDispatcher(false, false);
+    earnHedgeCredits(*dispatcher);
+
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(DnsTlsTransport::Response::success, query(*dispatcher, {SERVER1, V4ADDR2}));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, kSlowDelay);
+    ASSERT_EQ(1, events().dns_query_event_size());
+    EXPECT_EQ(1, events().dns_query_event(0).dns_server_index());
+    EXPECT_EQ(NS_R_NO_ERROR, events().dns_query_event(0).rcode());
+
+    // The slow answer of the primary server is recorded once it arrives, although nobody
+    // waits for it anymore.
+    const auto primary = netdutils::IPSockAddr::toIPSockAddr(V4ADDR1);
+    std::optional<std::chrono::microseconds> latency;
+    for (int i = 0; i < 50 && !latency; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        latency = resolv_stats_get_latency_percentile(NETID, primary, PROTO_DOT, 90);
+    }
+    ASSERT_TRUE(latency);
+    EXPECT_GE(*latency, kSlowDelay);
+    EXPECT_GE(DnsTlsDispatcher::getSlowQueryThreshold(NETID, SERVER1), kSlowDelay);
+}
+
+TEST_F(HedgingTest, BothFailAndNextServerIsTried) {
+    auto dispatcher = makeDispatcher(true, true);
+    earnHedgeCredits(*dispatcher);
+
+    EXPECT_EQ(DnsTlsTransport::Response::success,
+              query(*dispatcher, {SERVER1, V4ADDR2, V4ADDR3}));
+    ASSERT_EQ(3, events().dns_query_event_size());
+    // The secondary server fails first.
+    EXPECT_EQ(1, events().dns_query_event(0).dns_server_index());
+    EXPECT_EQ(NS_R_TIMEOUT, events().dns_query_event(0).rcode());
+    EXPECT_EQ(0, events().dns_query_event(1).dns_server_index());
+    EXPECT_EQ(NS_R_TIMEOUT, events().dns_query_event(1).rcode());
+    EXPECT_EQ(2, events().dns_query_event(2).dns_server_index());
+    EXPECT_EQ(NS_R_NO_ERROR, events().dns_query_event(2).rcode());
+}
+
+TEST_F(HedgingTest, BudgetRunsOut) {
+    auto dispatcher = makeDispatcher(false, false);
+    earnHedgeCredits(*dispatcher);
+
+    // The first slow query is hedged and spends the whole budget.
+    EXPECT_EQ(DnsTlsTransport::Response::success, query(*dispatcher, {SERVER1, V4ADDR2}));
+    ASSERT_EQ(1, events().dns_query_event_size());
+    EXPECT_EQ(1, events().dns_query_event(0).dns_server_index());
+    mEvent.Clear();
+
+    // The next one has to wait for the slow server.
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(DnsTlsTransport::Response::success, query(*dispatcher, {SERVER1, V4ADDR2}));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, kSlowDelay);
+    ASSERT_EQ(1, events().dns_query_event_size());
+    EXPECT_EQ(0, events().dns_query_event(0).dns_server_index());
+}
+
+TEST_F(DispatcherTest, ValidationConnectionIsReused) {
+    auto factory = std::make_unique<TrackingFakeSocketFactory<FakeSocketEcho>>();
+    auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+    DnsTlsDispatcher dispatcher(std::move(factory));
+
+    EXPECT_TRUE(dispatcher.validate(SERVER1, NETID, MARK));
+
+    bytevec ans(4096);
+    int resplen = 0;
+    auto r = dispatcher.query(SERVER1, MARK, makeSlice(QUERY), makeSlice(ans), &resplen);
+    EXPECT_EQ(DnsTlsTransport::Response::success, r);
+
+    // The query must have been sent over the socket opened for validation.
+    EXPECT_EQ(1U, weak_factory->keys.size());
+}
+
+// Holds the answers of FakeSocketBlocked until it is opened.
+struct Gate {
+    std::mutex lock;
+    std::condition_variable cv;
+    bool open = false;
+    int held = 0;
+};
+
+// A server that doesn't answer until the gate is opened, like an unreachable one whose
+// connection attempts take until the SYN retry limit.
+class FakeSocketBlocked : public IDnsTlsSocket {
+  public:
+    FakeSocketBlocked(IDnsTlsSocketObserver* observer, Gate* gate)
+        : mObserver(observer), mGate(gate) {}
+    ~FakeSocketBlocked() {
+        {
+            std::lock_guard guard(mGate->lock);
+            mClosed = true;
+            mGate->cv.notify_all();
+        }
+        for (auto& thread : mThreads) {
+            thread.join();
+        }
+    }
+    bool query(uint16_t id, const Slice query) override {
+        std::lock_guard guard(mGate->lock);
+        mGate->held++;
+        mThreads.emplace_back([this, response = make_echo(id, query)]() {
+            {
+                std::unique_lock lock(mGate->lock);
+                mGate->cv.wait(lock, [this]() { return mGate->open || mClosed; });
+                if (!mGate->open) return;
+            }
+            mObserver->onResponse(response);
+        });
+        return true;
+    }
+
+  private:
+    IDnsTlsSocketObserver* const mObserver;
+    Gate* const mGate;
+    bool mClosed = false;
+    std::vector<std::thread> mThreads;
+};
+
+// Creates a FakeSocketBlocked for the |blocked| servers, and fails to connect to the |failing|
+// ones. Other servers answer right away.
+class BlockingFakeSocketFactory : public IDnsTlsSocketFactory {
+  public:
+    BlockingFakeSocketFactory(std::set<DnsTlsServer, AddressComparator> blocked,
+                              std::set<DnsTlsServer, AddressComparator> failing)
+        : mBlocked(std::move(blocked)), mFailing(std::move(failing)) {}
+    std::unique_ptr<IDnsTlsSocket> createDnsTlsSocket(
+            const DnsTlsServer& server,
+            unsigned mark ATTRIBUTE_UNUSED,
+            IDnsTlsSocketObserver* observer,
+            DnsTlsSessionCache* cache ATTRIBUTE_UNUSED) override {
+        if (mFailing.count(server)) return nullptr;
+        if (mBlocked.count(server)) return std::make_unique<FakeSocketBlocked>(observer, &mGate);
+        return std::make_unique<FakeSocketEcho>(observer);
+    }
+
+    // Number of queries sent to the blocked servers so far.
+    int heldQueries() {
+        std::lock_guard guard(mGate.lock);
+        return mGate.held;
+    }
+
+    // Answers the held queries, and the next ones right away.
+    void release() {
+        std::lock_guard guard(mGate.lock);
+        mGate.open = true;
+        mGate.cv.notify_all();
+    }
+
+  private:
+    const std::set<DnsTlsServer, AddressComparator> mBlocked;
+    const std::set<DnsTlsServer, AddressComparator> mFailing;
+    Gate mGate;
+};
+
+// Polls |condition| until it holds, for up to 5 seconds.
+template <typename Predicate>
+static bool waitFor(Predicate condition) {
+    for (int i = 0; i < 100; ++i) {
+        if (condition()) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return condition();
+}
+
+static DnsTlsServer makeServer(const char* addr) {
+    sockaddr_storage ss = {};
+    parseServer(addr, 853, &ss);
+    return DnsTlsServer(ss);
+}
+
+class PrivateDnsConfigurationTest : public BaseTest {
+  protected:
+    static constexpr unsigned NETID2 = NETID + 1;
+    static constexpr std::chrono::milliseconds kIdleTimeout{200};
+    const std::string kStrictName = "dns.example.com";
+
+    void SetUp() override {
+        ASSERT_EQ(0, resolv_create_cache_for_net(NETID));
+        ASSERT_EQ(0, resolv_create_cache_for_net(NETID2));
+    }
+
+    void TearDown() override {
+        if (mConfig != nullptr) {
+            mFactory->release();
+            mConfig->clear(NETID);
+            mConfig->clear(NETID2);
+            // The pool threads use the configuration, so they must be gone before it is.
+            EXPECT_TRUE(waitFor([this]() { return mConfig->validationThreads() == 0; }));
+        }
+        resolv_delete_cache_for_net(NETID);
+        resolv_delete_cache_for_net(NETID2);
+    }
+
+    void init(const std::vector<std::string>& blocked, const std::vector<std::string>& failing) {
+        std::set<DnsTlsServer, AddressComparator> blockedServers;
+        for (const auto& addr : blocked) blockedServers.insert(makeServer(addr.c_str()));
+        std::set<DnsTlsServer, AddressComparator> failingServers;
+        for (const auto& addr : failing) failingServers.insert(makeServer(addr.c_str()));
+        auto factory = std::make_unique<BlockingFakeSocketFactory>(std::move(blockedServers),
+                                                                   std::move(failingServers));
+        mFactory = factory.get();
+        mDispatcher = std::make_unique<DnsTlsDispatcher>(std::move(factory));
+        mConfig = std::make_unique<PrivateDnsConfiguration>(*mDispatcher, kIdleTimeout);
+    }
+
+    size_t validatedServers(unsigned netId) {
+        return mConfig->getStatus(netId).validatedServers().size();
+    }
+
+    Validation validation(unsigned netId, const char* addr) {
+        const auto status = mConfig->getStatus(netId);
+        const auto it = status.serversMap.find(makeServer(addr));
+        return (it == status.serversMap.end()) ? Validation::unknown_server : it->second;
+    }
+
+    BlockingFakeSocketFactory* mFactory = nullptr;  // Owned by mDispatcher.
+    std::unique_ptr<DnsTlsDispatcher> mDispatcher;
+    std::unique_ptr<PrivateDnsConfiguration> mConfig;
+};
+
+TEST_F(PrivateDnsConfigurationTest, ValidationsAreCappedPerNetwork) {
+    const std::vector<std::string> blocked = {"192.0.2.1", "192.0.2.2", "192.0.2.3", "192.0.2.4",
+                                              "192.0.2.5"};
+    static_assert(PrivateDnsConfiguration::kMaxValidationsPerNetwork == 4);
+    init(blocked, {});
+
+    // Only kMaxValidationsPerNetwork of the unreachable servers are validated at once.
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, blocked, "", "", 0));
+    EXPECT_TRUE(waitFor([this]() { return mFactory->heldQueries() == 4; }));
+    std::this_thread::sleep_for(kIdleTimeout);
+    EXPECT_EQ(4, mFactory->heldQueries());
+
+    // They don't delay the validation of another network.
+    ASSERT_EQ(0, mConfig->set(NETID2, MARK, {"192.0.2.6"}, "", "", 0));
+    EXPECT_TRUE(waitFor([this]() { return mConfig->hasValidatedServer(NETID2); }));
+    EXPECT_EQ(0U, validatedServers(NETID));
+
+    // The last server is validated once the others are done.
+    mFactory->release();
+    EXPECT_TRUE(waitFor([this]() { return validatedServers(NETID) == 5; }));
+    EXPECT_EQ(5, mFactory->heldQueries());
+}
+
+TEST_F(PrivateDnsConfigurationTest, FailedValidationIsQueuedAgain) {
+    init({}, {"192.0.2.1", "192.0.2.2"});
+
+    // In strict mode, a failed validation is queued again after a backoff of a minute. No thread
+    // runs it meanwhile, but one stays to wait for it past the idle timeout.
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, {"192.0.2.1"}, kStrictName, "", 0));
+    EXPECT_TRUE(waitFor([this]() { return mConfig->queuedValidations() == 1; }));
+    EXPECT_EQ(Validation::in_process, validation(NETID, "192.0.2.1"));
+    std::this_thread::sleep_for(kIdleTimeout * 3);
+    EXPECT_EQ(1U, mConfig->queuedValidations());
+    EXPECT_EQ(1, mConfig->validationThreads());
+
+    // In opportunistic mode, it isn't.
+    ASSERT_EQ(0, mConfig->set(NETID2, MARK, {"192.0.2.2"}, "", "", 0));
+    EXPECT_TRUE(waitFor([this]() { return validation(NETID2, "192.0.2.2") == Validation::fail; }));
+    EXPECT_EQ(1U, mConfig->queuedValidations());
+}
+
+TEST_F(PrivateDnsConfigurationTest, IdleThreadsExit) {
+    init({}, {});
+
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, {"192.0.2.1", "192.0.2.2", "192.0.2.3"}, "", "", 0));
+    EXPECT_TRUE(waitFor([this]() { return validatedServers(NETID) == 3; }));
+
+    // With nothing queued, all the threads exit after the idle timeout.
+    EXPECT_TRUE(waitFor([this]() { return mConfig->validationThreads() == 0; }));
+
+    // And new ones are started for the next validations.
+    ASSERT_EQ(0, mConfig->set(NETID2, MARK, {"192.0.2.4"}, "", "", 0));
+    EXPECT_TRUE(waitFor([this]() { return mConfig->hasValidatedServer(NETID2); }));
+}
+
+TEST_F(PrivateDnsConfigurationTest, ClearDropsQueuedValidations) {
+    init({"192.0.2.2"}, {"192.0.2.1"});
+
+    // A queued validation is dropped with its network, so the waiting thread exits.
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, {"192.0.2.1"}, kStrictName, "", 0));
+    EXPECT_TRUE(waitFor([this]() { return mConfig->queuedValidations() == 1; }));
+    mConfig->clear(NETID);
+    EXPECT_EQ(0U, mConfig->queuedValidations());
+    EXPECT_TRUE(waitFor([this]() { return mConfig->validationThreads() == 0; }));
+
+    // A validation that is running when its network is cleared isn't queued again.
+    ASSERT_EQ(0, mConfig->set(NETID2, MARK, {"192.0.2.2"}, kStrictName, "", 0));
+    EXPECT_TRUE(waitFor([this]() { return mFactory->heldQueries() == 1; }));
+    mConfig->clear(NETID2);
+    mFactory->release();
+    EXPECT_TRUE(waitFor([this]() { return mConfig->validationThreads() == 0; }));
+    EXPECT_EQ(0U, mConfig->queuedValidations());
+    EXPECT_EQ(PrivateDnsMode::OFF, mConfig->getStatus(NETID2).mode);
+}
+
+TEST_F(PrivateDnsConfigurationTest, StrictModeWaitsForValidation) {
+    init({"192.0.2.1"}, {});
+    using std::chrono::milliseconds;
+
+    // Without strict mode, nobody waits.
+    EXPECT_FALSE(mConfig->waitForValidatedServer(NETID, milliseconds(5000)));
+    ASSERT_EQ(0, mConfig->set(NETID2, MARK, {"192.0.2.1"}, "", "", 0));
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(mConfig->waitForValidatedServer(NETID2, milliseconds(5000)));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, milliseconds(1000));
+
+    // In strict mode, the wait ends when it times out...
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, {"192.0.2.1"}, kStrictName, "", 0));
+    start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(mConfig->waitForValidatedServer(NETID, milliseconds(200)));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, milliseconds(200));
+
+    // ... or as soon as a server is validated.
+    std::thread releaser([this]() {
+        std::this_thread::sleep_for(milliseconds(200));
+        mFactory->release();
+    });
+    start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(mConfig->waitForValidatedServer(NETID, milliseconds(5000)));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, milliseconds(2000));
+    releaser.join();
+}
+
+TEST_F(PrivateDnsConfigurationTest, StrictModeWaitEndsWhenModeChanges) {
+    init({"192.0.2.1"}, {});
+    using std::chrono::milliseconds;
+
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, {"192.0.2.1"}, kStrictName, "", 0));
+    std::thread switcher([this]() {
+        std::this_thread::sleep_for(milliseconds(200));
+        EXPECT_EQ(0, mConfig->set(NETID, MARK, {}, "", "", 0));
+    });
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(mConfig->waitForValidatedServer(NETID, milliseconds(5000)));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, milliseconds(2000));
+    switcher.join();
+}
+
+TEST_F(PrivateDnsConfigurationTest, SnapshotIsReplacedNotModified) {
+    init({"192.0.2.2"}, {});
+
+    // Networks without private DNS are off.
+    auto snapshot = mConfig->getSnapshot(NETID);
+    EXPECT_EQ(PrivateDnsMode::OFF, snapshot->mode);
+    EXPECT_TRUE(snapshot->validatedServers.empty());
+
+    // Only validated servers are published.
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, {"192.0.2.1", "192.0.2.2"}, "", "", 0));
+    EXPECT_TRUE(waitFor([this]() { return mConfig->hasValidatedServer(NETID); }));
+    const auto validated = mConfig->getSnapshot(NETID);
+    EXPECT_EQ(PrivateDnsMode::OPPORTUNISTIC, validated->mode);
+    ASSERT_EQ(1U, validated->validatedServers.size());
+    EXPECT_TRUE(validated->validatedServers.front() == makeServer("192.0.2.1"));
+    EXPECT_EQ(validated, mConfig->getSnapshot(NETID));
+
+    // Each change publishes a new snapshot, and the ones already handed out stay as they were.
+    mFactory->release();
+    EXPECT_TRUE(waitFor(
+            [this]() { return mConfig->getSnapshot(NETID)->validatedServers.size() == 2; }));
+    EXPECT_EQ(1U, validated->validatedServers.size());
+    ASSERT_EQ(0, mConfig->set(NETID, MARK, {}, "", "", 0));
+    EXPECT_EQ(PrivateDnsMode::OFF, mConfig->getSnapshot(NETID)->mode);
+    EXPECT_EQ(PrivateDnsMode::OPPORTUNISTIC, validated->mode);
+
+    // Clearing the network removes its snapshot.
+    mConfig->clear(NETID);
+    EXPECT_EQ(PrivateDnsMode::OFF, mConfig->getSnapshot(NETID)->mode);
+}
+
 // Check DnsTlsServer's comparison logic.
 AddressComparator ADDRESS_COMPARATOR;
 bool isAddressEqual(const DnsTlsServer& s1, const DnsTlsServer& s2) {
@@ -903,6 +1457,392 @@ TEST(QueryMapTest, FillHole) {
     EXPECT_FALSE(map.recordQuery(makeSlice(QUERY)));
 }
 
+TEST(QueryMapTest, CleanupExpiresStaleQueries) {
+    DnsTlsQueryMap map;
+    auto f0 = map.recordQuery(makeSlice(QUERY));
+    auto f1 = map.recordQuery(makeSlice(QUERY));
+    ASSERT_TRUE(f0);
+    ASSERT_TRUE(f1);
+
+    // A query that hit the retry limit is expired, but a fresh one is still wanted.
+    for (int i = 0; i < 3; ++i) {
+        map.markTried(f0->query.newId);
+    }
+    map.cleanup();
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f0->result.get().code);
+    ASSERT_EQ(1U, map.getAll().size());
+    EXPECT_EQ(f1->query.newId, map.getAll()[0].newId);
+
+    // A query that is too old is expired even though it was never tried.
+    map.cleanup(std::chrono::steady_clock::now() + std::chrono::minutes(1));
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f1->result.get().code);
+    EXPECT_TRUE(map.empty());
+
+    // A late answer to an expired query is ignored.
+    map.onResponse(make_query(f1->query.newId, SIZE));
+    EXPECT_TRUE(map.empty());
+}
+
+TEST(QueryMapTest, StalledQueries) {
+    DnsTlsQueryMap map;
+    auto f = map.recordQuery(makeSlice(QUERY));
+    ASSERT_TRUE(f);
+    const auto later = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+    // A query that was never sent is not stalled.
+    EXPECT_FALSE(map.hasStalledQuery(later));
+    map.markTried(f->query.newId);
+    EXPECT_FALSE(map.hasStalledQuery(std::chrono::steady_clock::now() - std::chrono::seconds(1)));
+    EXPECT_TRUE(map.hasStalledQuery(later));
+}
+
+// Returns an A query for "<label>.example." with |id|.
+static bytevec makeDnsQuery(uint16_t id, char label) {
+    return {static_cast<uint8_t>(id >> 8), static_cast<uint8_t>(id), 0x01, 0x00, 0, 1, 0, 0,
+            0, 0, 0, 0, 1, static_cast<uint8_t>(label), 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+            0, 0, ns_t_a, 0, ns_c_in};
+}
+
+TEST(QueryMapTest, LateResponsesNeedTheSameQuestion) {
+    DnsTlsQueryMap map;
+    const bytevec query = makeDnsQuery(ID, 'b');
+    auto f = map.recordQuery(makeSlice(query));
+    ASSERT_TRUE(f);
+    const uint16_t newId = f->query.newId;
+
+    // A late answer to another query that had the same ID is ignored.
+    map.onResponse(makeDnsQuery(newId, 'a'), /*late=*/true);
+    map.onResponse(bytevec(query.begin(), query.begin() + 16), /*late=*/true);
+    EXPECT_FALSE(map.empty());
+
+    // A late answer to this query is used.
+    map.onResponse(makeDnsQuery(newId, 'b'), /*late=*/true);
+    EXPECT_TRUE(map.empty());
+    const auto r = f->result.get();
+    EXPECT_EQ(DnsTlsQueryMap::Response::success, r.code);
+    EXPECT_EQ(query, r.response);
+}
+
+// Returns a new session that was created at |time| and is valid for |timeout| seconds.
+bssl::UniquePtr<SSL_SESSION> makeSession(uint64_t time, uint32_t timeout) {
+    bssl::UniquePtr<SSL_CTX> ctx(SSL_CTX_new(TLS_method()));
+    bssl::UniquePtr<SSL_SESSION> session(SSL_SESSION_new(ctx.get()));
+    SSL_SESSION_set_time(session.get(), time);
+    SSL_SESSION_set_timeout(session.get(), timeout);
+    return session;
+}
+
+// The shared session store is process-wide, so each test uses its own server names.
+class SessionCacheTest : public BaseTest {
+  protected:
+    DnsTlsServer makeServer(const std::string& name) {
+        DnsTlsServer server(V4ADDR1);
+        server.name = name;
+        return server;
+    }
+};
+
+TEST_F(SessionCacheTest, SharedBetweenCachesOfSameServer) {
+    const DnsTlsServer server = makeServer("shared.example.com");
+    DnsTlsSessionCache cache1(server);
+    DnsTlsSessionCache cache2(server);
+
+    auto session = makeSession(time(nullptr), 3600);
+    SSL_SESSION* const raw = session.get();
+    cache1.recordSession(session.release());
+    auto resumed = cache2.getSession();
+    EXPECT_EQ(raw, resumed.get());
+    // Each session is only returned once.
+    EXPECT_EQ(nullptr, cache1.getSession());
+}
+
+TEST_F(SessionCacheTest, NotSharedWithOtherIdentities) {
+    const DnsTlsServer server = makeServer("identity.example.com");
+    DnsTlsServer otherName = makeServer("identity.example.org");
+    DnsTlsServer otherCertificate = server;
+    otherCertificate.certificate = "certificate";
+    DnsTlsSessionCache cache(server);
+    DnsTlsSessionCache otherNameCache(otherName);
+    DnsTlsSessionCache otherCertificateCache(otherCertificate);
+    DnsTlsSessionCache privateCache;
+
+    cache.recordSession(makeSession(time(nullptr), 3600).release());
+    EXPECT_EQ(nullptr, otherNameCache.getSession());
+    EXPECT_EQ(nullptr, otherCertificateCache.getSession());
+    EXPECT_EQ(nullptr, privateCache.getSession());
+    EXPECT_NE(nullptr, cache.getSession());
+
+    // Servers with the same name at another address don't share either.
+    DnsTlsServer otherAddress(V4ADDR2);
+    otherAddress.name = server.name;
+    DnsTlsSessionCache otherAddressCache(otherAddress);
+    cache.recordSession(makeSession(time(nullptr), 3600).release());
+    EXPECT_EQ(nullptr, otherAddressCache.getSession());
+}
+
+TEST_F(SessionCacheTest, LeastRecentlyUsedServerIsEvicted) {
+    const DnsTlsServer oldest = makeServer("lru-oldest.example.com");
+    const DnsTlsServer recent = makeServer("lru-recent.example.com");
+    {
+        DnsTlsSessionCache cache(oldest);
+        cache.recordSession(makeSession(time(nullptr), 3600).release());
+    }
+    {
+        DnsTlsSessionCache cache(recent);
+        cache.recordSession(makeSession(time(nullptr), 3600).release());
+    }
+    // Fill the store with other servers, pushing out the oldest one only.
+    for (size_t i = 0; i < DnsTlsSessionCache::kMaxSharedServers - 1; ++i) {
+        DnsTlsSessionCache cache(makeServer("lru" + std::to_string(i) + ".example.com"));
+    }
+
+    EXPECT_NE(nullptr, DnsTlsSessionCache(recent).getSession());
+    EXPECT_EQ(nullptr, DnsTlsSessionCache(oldest).getSession());
+}
+
+TEST_F(SessionCacheTest, ExpiredSessionsAreDropped) {
+    DnsTlsSessionCache cache(makeServer("expiry.example.com"));
+    const uint64_t now = time(nullptr);
+
+    auto fresh = makeSession(now, 3600);
+    SSL_SESSION* const raw = fresh.get();
+    cache.recordSession(fresh.release());
+    // The expired session is the most recent one, but it is skipped.
+    cache.recordSession(makeSession(now - 100, 10).release());
+
+    EXPECT_EQ(raw, cache.getSession().get());
+    EXPECT_EQ(nullptr, cache.getSession());
+}
+
+// Returns the body of a query for "a." without its ID. If |optRdata| is set, the query ends
+// with an OPT record with that RDATA.
+bytevec makeQueryBody(std::optional<bytevec> optRdata) {
+    bytevec body = {
+            0x01, 0x00,       // Flags: RD
+            0x00, 0x01,       // QDCOUNT
+            0x00, 0x00,       // ANCOUNT
+            0x00, 0x00,       // NSCOUNT
+            0x00, 0x00,       // ARCOUNT
+            0x01, 'a', 0x00,  // QNAME
+            0x00, 0x01,       // QTYPE: A
+            0x00, 0x01,       // QCLASS: IN
+    };
+    if (optRdata) {
+        body[9] = 1;  // ARCOUNT
+        const bytevec opt = {
+                0x00,                    // NAME: root
+                0x00, 0x29,              // TYPE: OPT
+                0x10, 0x00,              // CLASS: UDP payload size 4096
+                0x00, 0x00, 0x00, 0x00,  // TTL: extended RCODE and flags
+        };
+        body.insert(body.end(), opt.begin(), opt.end());
+        body.push_back(optRdata->size() >> 8);
+        body.push_back(optRdata->size());
+        body.insert(body.end(), optRdata->begin(), optRdata->end());
+    }
+    return body;
+}
+
+// Returns a DNS message with ID |ID| whose body is makeQueryBody(|optRdata|).
+bytevec makeMessage(std::optional<bytevec> optRdata) {
+    bytevec msg = {ID >> 8, ID & 0xff};
+    const bytevec body = makeQueryBody(std::move(optRdata));
+    msg.insert(msg.end(), body.begin(), body.end());
+    return msg;
+}
+
+// Returns the RDLENGTH of the OPT record that ends |msg|, which has RDATA of |rdlen| bytes.
+uint16_t getOptRdlen(const bytevec& msg, size_t rdlen) {
+    const size_t offset = msg.size() - rdlen - 2;
+    return (msg[offset] << 8) | msg[offset + 1];
+}
+
+class KeepaliveTest : public BaseTest {};
+
+TEST_F(KeepaliveTest, OptionIsAddedToQueries) {
+    const bytevec keepalive = {0x00, 0x0b, 0x00, 0x00};
+    const bytevec cookie = {0x00, 0x0a, 0x00, 0x08, 1, 2, 3, 4, 5, 6, 7, 8};
+    for (const auto& rdata : {bytevec{}, cookie}) {
+        SCOPED_TRACE(rdata.size());
+        const bytevec body = makeQueryBody(rdata);
+        const bytevec msg = DnsTlsSocket::makeQueryMessage(ID, makeSlice(body));
+
+        ASSERT_EQ(2 + 2 + body.size() + keepalive.size(), msg.size());
+        // The length prefix covers the ID, the body and the new option.
+        EXPECT_EQ(msg.size() - 2, size_t((msg[0] << 8) | msg[1]));
+        EXPECT_EQ(ID, (msg[2] << 8) | msg[3]);
+        // The body is unchanged, except for the RDLENGTH of the OPT record.
+        const size_t rdlenOffset = 4 + body.size() - rdata.size() - 2;
+        EXPECT_TRUE(std::equal(body.begin(), body.begin() + rdlenOffset - 4, msg.begin() + 4));
+        EXPECT_EQ(rdata.size() + keepalive.size(), getOptRdlen(msg, rdata.size() + 4));
+        EXPECT_TRUE(std::equal(rdata.begin(), rdata.end(), msg.begin() + rdlenOffset + 2));
+        EXPECT_TRUE(std::equal(keepalive.begin(), keepalive.end(), msg.end() - 4));
+
+        // The result is a valid DNS message.
+        ns_msg handle;
+        EXPECT_EQ(0, ns_initparse(msg.data() + 2, msg.size() - 2, &handle));
+    }
+}
+
+TEST_F(KeepaliveTest, QueriesWithoutOptAreUnchanged) {
+    const bytevec body = makeQueryBody(std::nullopt);
+    const bytevec msg = DnsTlsSocket::makeQueryMessage(ID, makeSlice(body));
+
+    ASSERT_EQ(2 + 2 + body.size(), msg.size());
+    EXPECT_EQ(msg.size() - 2, size_t((msg[0] << 8) | msg[1]));
+    EXPECT_EQ(ID, (msg[2] << 8) | msg[3]);
+    EXPECT_TRUE(std::equal(body.begin(), body.end(), msg.begin() + 4));
+
+    // Neither are queries that don't parse.
+    const bytevec garbage = {1, 2, 3};
+    EXPECT_EQ(2U + 2 + garbage.size(),
+              DnsTlsSocket::makeQueryMessage(ID, makeSlice(garbage)).size());
+}
+
+TEST_F(KeepaliveTest, TimeoutIsReadFromResponses) {
+    // The timeout is in units of 100ms.
+    EXPECT_EQ(std::chrono::milliseconds(30000),
+              DnsTlsSocket::getTcpKeepaliveTimeout(makeMessage(bytevec{0x00, 0x0b, 0x00, 0x02,
+                                                                        0x01, 0x2c})));
+    // Other options are skipped.
+    EXPECT_EQ(std::chrono::milliseconds(0),
+              DnsTlsSocket::getTcpKeepaliveTimeout(makeMessage(bytevec{
+                      0x00, 0x0a, 0x00, 0x02, 0xab, 0xcd, 0x00, 0x0b, 0x00, 0x02, 0x00, 0x00})));
+
+    EXPECT_EQ(std::nullopt, DnsTlsSocket::getTcpKeepaliveTimeout(makeMessage(std::nullopt)));
+    EXPECT_EQ(std::nullopt, DnsTlsSocket::getTcpKeepaliveTimeout(makeMessage(bytevec{})));
+}
+
+TEST_F(KeepaliveTest, MalformedOptionsAreIgnored) {
+    const std::vector<bytevec> rdatas = {
+            // The client form of the option, without a timeout.
+            {0x00, 0x0b, 0x00, 0x00},
+            // A timeout of the wrong length.
+            {0x00, 0x0b, 0x00, 0x01, 0x01},
+            {0x00, 0x0b, 0x00, 0x04, 0x00, 0x01, 0x00, 0x01},
+            // An option that is longer than the RDATA.
+            {0x00, 0x0b, 0x00, 0x02, 0x01},
+            {0x00, 0x0a, 0x00, 0x08, 0x00, 0x0b, 0x00, 0x02, 0x01, 0x2c},
+            // A truncated option header.
+            {0x00, 0x0b, 0x00},
+    };
+    for (const auto& rdata : rdatas) {
+        SCOPED_TRACE(rdata.size());
+        EXPECT_EQ(std::nullopt, DnsTlsSocket::getTcpKeepaliveTimeout(makeMessage(rdata)));
+    }
+
+    // An OPT record whose RDLENGTH exceeds the message, and truncated messages.
+    bytevec msg = makeMessage(bytevec{0x00, 0x0b, 0x00, 0x02, 0x01, 0x2c});
+    ASSERT_EQ(6, getOptRdlen(msg, 6));
+    msg[msg.size() - 6 - 1] = 7;
+    EXPECT_EQ(std::nullopt, DnsTlsSocket::getTcpKeepaliveTimeout(msg));
+    msg = makeMessage(bytevec{0x00, 0x0b, 0x00, 0x02, 0x01, 0x2c});
+    for (size_t size = 0; size < msg.size(); ++size) {
+        EXPECT_EQ(std::nullopt,
+                  DnsTlsSocket::getTcpKeepaliveTimeout(bytevec(msg.begin(), msg.begin() + size)));
+    }
+}
+
+TEST_F(TransportTest, IdleTimeoutAdaptsToQueryGaps) {
+    FakeSocketFactory<FakeSocketEcho> factory;
+    DnsTlsTransport transport(SERVER1, MARK, &factory);
+    const std::chrono::milliseconds kDefault = DnsTlsServer().idleTimeout;
+    using std::chrono::seconds;
+
+    auto now = std::chrono::steady_clock::now();
+    EXPECT_EQ(kDefault, transport.updateIdleTimeout(now));
+    // Gaps shorter than the timeout leave it alone.
+    now += kDefault / 2;
+    EXPECT_EQ(kDefault, transport.updateIdleTimeout(now));
+    // A longer gap raises it to 1.5 times the gap.
+    now += seconds(30);
+    EXPECT_EQ(seconds(45), transport.updateIdleTimeout(now));
+    now += seconds(40);
+    EXPECT_EQ(seconds(45), transport.updateIdleTimeout(now));
+    // Up to a minute.
+    now += seconds(50);
+    EXPECT_EQ(seconds(60), transport.updateIdleTimeout(now));
+    // A gap longer than that resets it.
+    now += seconds(61);
+    EXPECT_EQ(kDefault, transport.updateIdleTimeout(now));
+}
+
+TEST_F(TransportTest, IdleTimeoutIsPassedToNewConnections) {
+    TrackingFakeSocketFactory<FakeSocketEcho> factory;
+    DnsTlsTransport transport(SERVER1, MARK, &factory);
+
+    // Pretend that the last query was sent 30s ago.
+    transport.updateIdleTimeout(std::chrono::steady_clock::now() - std::chrono::seconds(30));
+    EXPECT_EQ(DnsTlsTransport::Response::success, transport.query(makeSlice(QUERY)).get().code);
+
+    ASSERT_EQ(1U, factory.keys.size());
+    const auto idleTimeout = factory.keys.begin()->second.idleTimeout;
+    EXPECT_GE(idleTimeout, std::chrono::seconds(45));
+    EXPECT_LT(idleTimeout, std::chrono::seconds(46));
+}
+
+// The first socket it creates doesn't answer until released.  The next ones answer right away.
+class StallingFakeSocketFactory : public IDnsTlsSocketFactory {
+  public:
+    std::unique_ptr<IDnsTlsSocket> createDnsTlsSocket(
+            const DnsTlsServer& server ATTRIBUTE_UNUSED,
+            unsigned mark ATTRIBUTE_UNUSED,
+            IDnsTlsSocketObserver* observer,
+            DnsTlsSessionCache* cache ATTRIBUTE_UNUSED) override {
+        std::lock_guard guard(mLock);
+        if (mSockets++ == 0) return std::make_unique<FakeSocketBlocked>(observer, &mGate);
+        return std::make_unique<FakeSocketEcho>(observer);
+    }
+
+    int sockets() {
+        std::lock_guard guard(mLock);
+        return mSockets;
+    }
+
+  private:
+    std::mutex mLock;
+    int mSockets GUARDED_BY(mLock) = 0;
+    Gate mGate;
+};
+
+TEST_F(TransportTest, StalledQueriesMoveToNewConnection) {
+    StallingFakeSocketFactory factory;
+    DnsTlsTransport transport(SERVER1, MARK, &factory, std::chrono::milliseconds(100));
+
+    auto result = transport.query(makeSlice(QUERY));
+    ASSERT_EQ(std::future_status::timeout, result.wait_for(std::chrono::milliseconds(200)));
+    EXPECT_EQ(1, factory.sockets());
+
+    // The query is reissued on a new connection, which answers it.
+    transport.moveStalledQueries();
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(1)));
+    const auto r = result.get();
+    EXPECT_EQ(DnsTlsTransport::Response::success, r.code);
+    EXPECT_EQ(QUERY, r.response);
+    EXPECT_EQ(2, factory.sockets());
+
+    // Later queries use the new connection, without opening another one.
+    EXPECT_EQ(DnsTlsTransport::Response::success, transport.query(makeSlice(QUERY)).get().code);
+    transport.moveStalledQueries();
+    EXPECT_EQ(2, factory.sockets());
+}
+
+TEST_F(DispatcherTest, StalledQueryIsAnswered) {
+    auto factory = std::make_unique<StallingFakeSocketFactory>();
+    auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+    DnsTlsDispatcher dispatcher(std::move(factory));
+
+    // The caller waiting for the result moves the query off the stalled connection.
+    bytevec ans(4096);
+    int resplen = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto r = dispatcher.query(SERVER1, MARK, makeSlice(QUERY), makeSlice(ans), &resplen);
+    EXPECT_EQ(DnsTlsTransport::Response::success, r);
+    EXPECT_EQ(int(QUERY.size()), resplen);
+    EXPECT_GT(std::chrono::seconds(5), std::chrono::steady_clock::now() - start);
+    EXPECT_EQ(2, weak_factory->sockets());
+}
+
 class StubObserver : public IDnsTlsSocketObserver {
   public:
     bool closed = false;
@@ -942,5 +1882,86 @@ TEST(DnsTlsSocketTest, SlowDestructor) {
     EXPECT_LT(delay, std::chrono::seconds{5});
 }
 
+// Records the responses and the closure of a DnsTlsSocket, in order.
+class RecordingObserver : public IDnsTlsSocketObserver {
+  public:
+    void onResponse(std::vector<uint8_t>) override {
+        std::lock_guard guard(mLock);
+        if (!mClosed) mResponses++;
+    }
+    void onClosed() override {
+        std::lock_guard guard(mLock);
+        mClosed = true;
+    }
+
+    int responses() {
+        std::lock_guard guard(mLock);
+        return mResponses;
+    }
+    bool closed() {
+        std::lock_guard guard(mLock);
+        return mClosed;
+    }
+
+  private:
+    std::mutex mLock;
+    int mResponses GUARDED_BY(mLock) = 0;
+    bool mClosed GUARDED_BY(mLock) = false;
+};
+
+TEST(DnsTlsSocketTest, ShortServerIdleTimeoutWaitsForSlowAnswers) {
+    constexpr char tls_addr[] = "127.0.0.3";
+    constexpr char tls_port[] = "8530";  // High-numbered port so root isn't required.
+    constexpr char backend_addr[] = "127.0.0.4";
+    constexpr char backend_port[] = "5300";
+    constexpr char host_name[] = "keepalive.example.com.";
+
+    // The server announces an idle timeout of 0, which DnsTlsSocket raises to 1 second.
+    test::DNSHeader response(kDefaultDnsHeader);
+    response.questions.push_back({.qname = {.name = host_name}, .qtype = ns_t_a,
+                                  .qclass = ns_c_in});
+    response.additionals.push_back({.name = {.name = ""}, .rtype = ns_t_opt, .rclass = 4096,
+                                    .ttl = 0, .rdata = {0x00, 0x0b, 0x00, 0x02, 0x00, 0x00}});
+    test::DNSResponder backend(backend_addr, backend_port, ns_rcode::ns_r_servfail,
+                               test::DNSResponder::MappingType::DNS_HEADER);
+    backend.addMappingDnsHeader(host_name, ns_t_a, response);
+    ASSERT_TRUE(backend.startServer());
+    test::DnsTlsFrontend tls(tls_addr, tls_port, backend_addr, backend_port);
+    ASSERT_TRUE(tls.startServer());
+
+    test::DNSHeader query(kDefaultDnsHeader);
+    query.qr = false;
+    query.rd = true;
+    query.questions.push_back({.qname = {.name = host_name}, .qtype = ns_t_a,
+                               .qclass = ns_c_in});
+    bytevec queryBytes;
+    ASSERT_TRUE(query.write(&queryBytes));
+    const Slice body = netdutils::drop(makeSlice(queryBytes), 2);
+
+    DnsTlsServer server;
+    parseServer(tls_addr, 8530, &server.ss);
+    RecordingObserver observer;
+    DnsTlsSessionCache cache;
+    auto socket = std::make_unique<DnsTlsSocket>(server, MARK, &observer, &cache);
+    ASSERT_TRUE(socket->initialize());
+
+    // Learn the server's idle timeout.
+    ASSERT_TRUE(socket->query(1, body));
+    ASSERT_TRUE(waitFor([&observer]() { return observer.responses() == 1; }));
+
+    // An answer that takes longer than that timeout still arrives.
+    backend.setDeferredResp(true);
+    ASSERT_TRUE(socket->query(2, body));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+    backend.setDeferredResp(false);
+    EXPECT_TRUE(waitFor([&observer]() { return observer.responses() == 2; }));
+
+    // Once idle, the connection is closed after the server's timeout.
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(waitFor([&observer]() { return observer.closed(); }));
+    EXPECT_GT(std::chrono::seconds(3), std::chrono::steady_clock::now() - start);
+    EXPECT_EQ(2, observer.responses());
+}
+
 } // end of namespace net
 } // end of namespace android
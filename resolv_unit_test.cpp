@@ -26,6 +26,7 @@
 #include "dns_responder.h"
 #include "getaddrinfo.h"
 #include "gethnamaddr.h"
+#include "res_init.h"
 #include "resolv_cache.h"
 #include "stats.pb.h"
 #include "tests/resolv_test_utils.h"
@@ -141,6 +142,7 @@ class TestBase : public ::testing::Test {
 
 class ResolvGetAddrInfoTest : public TestBase {};
 class GetHostByNameForNetContextTest : public TestBase {};
+class ResNsendNTest : public TestBase {};
 
 TEST_F(ResolvGetAddrInfoTest, InvalidParameters) {
     // Both null "netcontext" and null "res" of resolv_getaddrinfo() are not tested
@@ -438,6 +440,43 @@ TEST_F(ResolvGetAddrInfoTest, AlphabeticalHostname) {
     }
 }
 
+TEST_F(ResolvGetAddrInfoTest, EdnsRejectedByServer) {
+    constexpr char v4addr[] = "1.2.3.4";
+
+    test::DNSResponder dns;
+    dns.addMapping("edns1.example.com.", ns_type::ns_t_a, v4addr);
+    dns.addMapping("edns2.example.com.", ns_type::ns_t_a, v4addr);
+    dns.setEdns(test::DNSResponder::Edns::FORMERR_ON_EDNS);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+
+    android_net_context netcontext = mNetcontext;
+    netcontext.flags |= NET_CONTEXT_FLAG_USE_EDNS;
+
+    static const struct TestConfig {
+        std::string name;
+        int expectedAttempts;
+    } testConfigs[]{
+            // The first query with EDNS0 is rejected, and the retry goes without it.
+            {"edns1", 2},
+            // The server is known not to support EDNS0, so the first query goes without it.
+            {"edns2", 1},
+    };
+
+    for (const auto& config : testConfigs) {
+        SCOPED_TRACE(config.name);
+        addrinfo* result = nullptr;
+        const addrinfo hints = {.ai_family = AF_INET};
+        NetworkDnsEventReported event;
+        int rv = resolv_getaddrinfo(config.name.c_str(), nullptr, &hints, &netcontext, &result,
+                                    &event);
+        ScopedAddrinfo result_cleanup(result);
+        EXPECT_EQ(0, rv);
+        EXPECT_EQ(v4addr, ToString(result));
+        EXPECT_EQ(config.expectedAttempts, event.dns_query_events().dns_query_event_size());
+    }
+}
+
 TEST_F(ResolvGetAddrInfoTest, IllegalHostname) {
     test::DNSResponder dns;
     ASSERT_TRUE(dns.startServer());
@@ -686,6 +725,42 @@ TEST_F(ResolvGetAddrInfoTest, MultiAnswerSections) {
     }
 }
 
+TEST_F(ResolvGetAddrInfoTest, ResultCacheSingleStackName) {
+    constexpr char host_name[] = "v4only.example.com.";
+    constexpr unsigned kNegativeTtl = 200;
+    test::DNSResponder dns(test::DNSResponder::MappingType::DNS_HEADER);
+    StartDns(dns, {MakeDnsMessage(host_name, ns_type::ns_t_a, {"1.2.3.4"}),
+                   {host_name, ns_type::ns_t_aaaa,
+                    MakeNoDataResponse(host_name, ns_type::ns_t_aaaa, "example.com.",
+                                       kNegativeTtl)}});
+    ASSERT_EQ(0, SetResolvers());
+    ScopedExperimentFlag flag("addrinfo_cache", "1");
+
+    // The AAAA answer has no records, but its SOA record still lets the result be cached.
+    const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    for (const bool cached : {false, true}) {
+        SCOPED_TRACE(StringPrintf("cached: %d", cached));
+        addrinfo* result = nullptr;
+        uint32_t ttl = 0;
+        NetworkDnsEventReported event;
+        int rv = resolv_getaddrinfo("v4only", nullptr, &hints, &mNetcontext, &result, &event,
+                                    &ttl);
+        ScopedAddrinfo result_cleanup(result);
+        EXPECT_EQ(0, rv);
+        EXPECT_EQ("1.2.3.4", ToString(result));
+        EXPECT_LT(0U, ttl);
+        EXPECT_GE(kNegativeTtl, ttl);
+        if (cached) {
+            // Served from the result cache, without even looking up the answer cache.
+            EXPECT_EQ(0U, GetNumQueries(dns, host_name));
+            EXPECT_EQ(0, event.dns_query_events().dns_query_event_size());
+        } else {
+            EXPECT_EQ(2U, GetNumQueries(dns, host_name));
+        }
+        dns.clearQueries();
+    }
+}
+
 TEST_F(GetHostByNameForNetContextTest, AlphabeticalHostname) {
     constexpr char host_name[] = "jiababuei.example.com.";
     constexpr char v4addr[] = "1.2.3.4";
@@ -952,6 +1027,110 @@ TEST_F(GetHostByNameForNetContextTest, CnamesInfiniteLoop) {
     }
 }
 
+TEST_F(ResNsendNTest, PipelinedQueries) {
+    constexpr char host_name[] = "pipelined.example.com.";
+    constexpr ns_type types[] = {ns_t_a, ns_t_aaaa};
+
+    test::DNSResponder dns;
+    dns.addMapping(host_name, ns_type::ns_t_a, "1.2.3.4");
+    dns.addMapping(host_name, ns_type::ns_t_aaaa, "::1.2.3.4");
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+
+    std::vector<uint8_t> queries[std::size(types)];
+    std::vector<uint8_t> answers[std::size(types)];
+    ResSendTarget targets[std::size(types)];
+    for (size_t i = 0; i < std::size(types); i++) {
+        queries[i].resize(MAXPACKET);
+        const int len = res_nmkquery(QUERY, host_name, ns_c_in, types[i], /*data=*/nullptr,
+                                     /*datalen=*/0, queries[i].data(), queries[i].size(),
+                                     /*netcontext_flags=*/0);
+        ASSERT_GT(len, 0);
+        queries[i].resize(len);
+        answers[i].resize(MAXPACKET);
+        targets[i] = {
+                .query = queries[i].data(),
+                .querylen = len,
+                .answer = answers[i].data(),
+                .anssiz = static_cast<int>(answers[i].size()),
+        };
+    }
+
+    // The first time both queries are sent to the server at once, the second time they are
+    // answered by the cache.
+    for (int round = 0; round < 2; round++) {
+        SCOPED_TRACE(StringPrintf("round: %d", round));
+        NetworkDnsEventReported event;
+        ResState res;
+        res_init(&res, &mNetcontext, &event);
+        EXPECT_EQ(2, res_nsendN(&res, targets, std::size(targets), /*flags=*/0));
+        for (size_t i = 0; i < std::size(types); i++) {
+            SCOPED_TRACE(StringPrintf("type: %d", types[i]));
+            ASSERT_GT(targets[i].resplen, 0);
+            EXPECT_EQ(NOERROR, targets[i].rcode);
+            EXPECT_EQ(static_cast<int>(types[i]),
+                      static_cast<int>(getQueryType(answers[i].data(), targets[i].resplen)));
+        }
+        EXPECT_EQ(2U, GetNumQueries(dns, host_name));
+    }
+}
+
+TEST(ResMkQueryTest, InQueryMatchesGeneralPath) {
+    const std::string longLabel(NS_MAXLABEL + 1, 'a');
+    const std::string longName = StringPrintf("%s.%s.%s.%s.com", std::string(62, 'b').c_str(),
+                                              std::string(62, 'c').c_str(),
+                                              std::string(62, 'd').c_str(),
+                                              std::string(62, 'e').c_str());
+    // Besides common hostnames, these include the names left to the general path.
+    const std::string names[] = {
+            "hello.example.com", "hello.example.com.", "a", "", ".", "a..b", "escaped\\.name",
+            longLabel + ".com", longName,
+    };
+    constexpr unsigned contextFlags[] = {
+            0,
+            NET_CONTEXT_FLAG_USE_EDNS,
+            NET_CONTEXT_FLAG_USE_DNS_OVER_TLS,
+    };
+    constexpr int bufSizes[] = {HFIXEDSZ, 32, 64, 127, 128, 129, 300, MAXPACKET};
+
+    for (const auto& name : names) {
+        for (const unsigned flags : contextFlags) {
+            for (const ns_type type : {ns_t_a, ns_t_aaaa}) {
+                for (const bool edns0 : {false, true}) {
+                    for (const int buflen : bufSizes) {
+                        SCOPED_TRACE(StringPrintf("name: %s, flags: %u, type: %d, edns0: %d, "
+                                                  "buflen: %d",
+                                                  name.c_str(), flags, type, edns0, buflen));
+                        ResState res;
+                        res.netcontext_flags = flags;
+                        std::vector<uint8_t> expected(buflen);
+                        int expectedLen = res_nmkquery(QUERY, name.c_str(), ns_c_in, type,
+                                                       /*data=*/nullptr, /*datalen=*/0,
+                                                       expected.data(), buflen, flags);
+                        if (expectedLen > 0 && edns0) {
+                            expectedLen = res_nopt(&res, expectedLen, expected.data(), buflen,
+                                                   MAXPACKET);
+                        }
+                        std::vector<uint8_t> actual(buflen);
+                        const int actualLen = res_nmkquery_in(&res, name.c_str(), type,
+                                                              actual.data(), buflen, MAXPACKET,
+                                                              edns0);
+                        ASSERT_EQ(expectedLen, actualLen);
+                        if (actualLen <= 0) continue;
+
+                        // The query ID is random.
+                        reinterpret_cast<HEADER*>(expected.data())->id = 0;
+                        reinterpret_cast<HEADER*>(actual.data())->id = 0;
+                        expected.resize(expectedLen);
+                        actual.resize(actualLen);
+                        EXPECT_EQ(expected, actual);
+                    }
+                }
+            }
+        }
+    }
+}
+
 // Note that local host file function, files_getaddrinfo(), of resolv_getaddrinfo()
 // is not tested because it only returns a boolean (success or failure) without any error number.
 
@@ -19,11 +19,49 @@
 
 #include <arpa/inet.h>
 
+#include <android-base/properties.h>
 #include <netdutils/InternetAddresses.h>
 
+using android::base::GetProperty;
+using android::base::SetProperty;
 using android::net::ResolverStats;
 using android::netdutils::ScopedAddrinfo;
 
+test::DNSHeader MakeNoDataResponse(const std::string& name, ns_type type, const std::string& zone,
+                                   unsigned negativeTtl) {
+    test::DNSHeader header(kDefaultDnsHeader);
+    header.questions.push_back({
+            .qname = {.name = name},
+            .qtype = type,
+            .qclass = ns_c_in,
+    });
+    test::DNSRecord soa{
+            .name = {.name = zone},
+            .rtype = ns_type::ns_t_soa,
+            .rclass = ns_c_in,
+            .ttl = negativeTtl,
+    };
+    // MNAME and RNAME are the root, then SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM.
+    soa.rdata = {0, 0};
+    for (const uint32_t field : {1U, 3600U, 600U, 86400U, negativeTtl}) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            soa.rdata.push_back(static_cast<char>(field >> shift));
+        }
+    }
+    header.authorities.push_back(std::move(soa));
+    return header;
+}
+
+ScopedExperimentFlag::ScopedExperimentFlag(const std::string& flag, const std::string& value)
+    : mProperty("persist.device_config.netd_native." + flag),
+      mSavedValue(GetProperty(mProperty, "")) {
+    SetProperty(mProperty, value);
+}
+
+ScopedExperimentFlag::~ScopedExperimentFlag() {
+    SetProperty(mProperty, mSavedValue);
+}
+
 std::string ToString(const hostent* he) {
     if (he == nullptr) return "<null>";
     char buffer[INET6_ADDRSTRLEN];
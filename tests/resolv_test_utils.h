@@ -103,6 +103,22 @@ static const test::DNSHeader kDefaultDnsHeader = {
         .ad = false,            // non-authenticated data is unacceptable
 };
 
+// Returns a NOERROR response without records to the query for |name| and |type|. Its authority
+// section holds an SOA record of |zone| giving |negativeTtl| as the negative TTL (RFC 2308).
+test::DNSHeader MakeNoDataResponse(const std::string& name, ns_type type, const std::string& zone,
+                                   unsigned negativeTtl);
+
+// Sets the resolver experiment flag |flag| to |value|, and restores it when going out of scope.
+class ScopedExperimentFlag {
+  public:
+    ScopedExperimentFlag(const std::string& flag, const std::string& value);
+    ~ScopedExperimentFlag();
+
+  private:
+    const std::string mProperty;
+    const std::string mSavedValue;
+};
+
 size_t GetNumQueries(const test::DNSResponder& dns, const char* name);
 size_t GetNumQueriesForType(const test::DNSResponder& dns, ns_type type, const char* name);
 std::string ToString(const hostent* he);
@@ -17,6 +17,12 @@
 
 #include "util.h"
 
+#include <android-base/parseint.h>
+#include <server_configurable_flags/get_flags.h>
+
+using android::base::ParseInt;
+using server_configurable_flags::GetServerConfigurableFlag;
+
 socklen_t sockaddrSize(const sockaddr* sa) {
     if (sa == nullptr) return 0;
 
@@ -33,3 +39,21 @@ socklen_t sockaddrSize(const sockaddr* sa) {
 socklen_t sockaddrSize(const sockaddr_storage& ss) {
     return sockaddrSize(reinterpret_cast<const sockaddr*>(&ss));
 }
+
+int getExperimentFlagInt(const std::string& flagName, int defaultValue) {
+    int val = defaultValue;
+    ParseInt(GetServerConfigurableFlag("netd_native", flagName, ""), &val);
+    return val;
+}
+
+int64_t coarseMonotonicMs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+time_t coarseMonotonicSec() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
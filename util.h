@@ -18,6 +18,22 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <time.h>
+
+#include <string>
 
 socklen_t sockaddrSize(const sockaddr* sa);
 socklen_t sockaddrSize(const sockaddr_storage& ss);
+
+// Returns the value of the netd_native experiment flag |flagName|, or |defaultValue| if the flag
+// is not set or is not a valid integer.
+int getExperimentFlagInt(const std::string& flagName, int defaultValue);
+
+// Returns the time of CLOCK_MONOTONIC_COARSE in milliseconds. It is cheap to read, precise to a
+// few milliseconds and does not jump when the wall clock is set, so it suits timestamps that are
+// only compared with each other, such as cache expiry times.
+int64_t coarseMonotonicMs();
+
+// Same as coarseMonotonicMs(), in seconds, for the time_t timestamps of the resolver statistics
+// and the EDNS0 state of the servers.
+time_t coarseMonotonicSec();